@@ -24,18 +24,6 @@
 
 static const char* TAG = "esp-ssdp-example";
 
-/* Root GET handler */
-static esp_err_t ssdp_schema_get_handler(httpd_req_t* req) {
-  httpd_resp_set_type(req, "text/xml");
-  const char* response = get_ssdp_schema_str();
-  httpd_resp_send(req, response, strlen(response));
-  return ESP_OK;
-}
-
-static const httpd_uri_t ssdp_schema = {.uri = "/description.xml",
-                                        .method = HTTP_GET,
-                                        .handler = ssdp_schema_get_handler};
-
 /* Schema GET handler */
 static esp_err_t hello_get_handler(httpd_req_t* req) {
   httpd_resp_sendstr(req, "Hello World");
@@ -56,7 +44,6 @@ static httpd_handle_t start_webserver(void) {
     // Set URI handlers
     ESP_LOGI(TAG, "Registering URI handlers");
     httpd_register_uri_handler(server, &hello);
-    httpd_register_uri_handler(server, &ssdp_schema);
 
     /*
     #define SDDP_DEFAULT_CONFIG() {                    \
@@ -66,7 +53,19 @@ static httpd_handle_t start_webserver(void) {
     .port                = 80,                         \
     .ttl                 = 2,                          \
     .interval            = 1200,                       \
+    .max_age             = 0,                          \
+    .refresh_percent     = 50,                         \
+    .jitter_percent      = 10,                         \
+    .startup_delay_max   = 1000,                       \
+    .startup_burst       = 3,                          \
+    .startup_burst_spacing = 200,                      \
     .mx_max_delay        = 10000,                      \
+    .search_port         = 0,                          \
+    .allowed_sources     = NULL,                       \
+    .allowed_source_count = 0,                         \
+    .denied_sources      = NULL,                       \
+    .denied_source_count = 0,                          \
+    .ignore_own_packets  = true,                       \
     .uuid_root           = NULL,                       \
     .uuid                =  NULL,                      \
     .schema_url          = "description.xml",          \
@@ -82,7 +81,10 @@ static httpd_handle_t start_webserver(void) {
     .model_description    = NULL,                      \
     .server_name          = "SSDPServer-IDF/1.0",           \
     .services_description = NULL,                      \
-    .icons_description    = NULL                       \
+    .icons_description    = NULL,                      \
+    .manifest             = NULL,                      \
+    .gena_moderation      = 200,                       \
+    .gena_timeout_max     = 1800                       \
     }
     */
     ssdp_config_t config = SDDP_DEFAULT_CONFIG();
@@ -90,11 +92,22 @@ static httpd_handle_t start_webserver(void) {
 
     config.device_type = "rootdevice";
     config.uuid_root = "38323636-4558-4dda-9188-cda0e6";
+    // Let control points refresh this device with unicast searches
+    config.search_port = 49152;
+#if CONFIG_SSDP_MANIFEST
+    // Identity compiled from CONFIG_SSDP_MANIFEST_FILE, nothing is copied
+    config.manifest = &ssdp_manifest;
+#endif
     ESP_LOGI(TAG, "Starting ssdp service");
     esp_err_t err = ssdp_start(&config);
     if (err != ESP_OK) {
       ESP_LOGE(TAG, "Failed to start ssdp: %s", esp_err_to_name(err));
       // ssdp_stop();
+    } else {
+      // description.xml and the SCPDs of the manifest, with ETag and 304,
+      // and eventing for the services with an eventSubURL, whose variables
+      // are then updated with ssdp_gena_set()
+      ssdp_register_httpd_handlers(server);
     }
     return server;
   }
@@ -114,6 +127,8 @@ static void disconnect_handler(void* arg, esp_event_base_t event_base,
   httpd_handle_t* server = (httpd_handle_t*)arg;
   if (*server) {
     ESP_LOGI(TAG, "Stopping ssdp service");
+    // While the description is still there to tell which URIs they serve
+    ssdp_unregister_httpd_handlers(*server);
     ssdp_stop();
     ESP_LOGI(TAG, "Stopping webserver");
     if (stop_webserver(*server) == ESP_OK) {
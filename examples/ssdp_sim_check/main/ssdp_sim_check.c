@@ -0,0 +1,185 @@
+/* SSDP simulator check
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "lwip/inet.h"
+#include "nvs_flash.h"
+#include "ssdp.h"
+
+static const char* TAG = "ssdp-sim-check";
+
+/*
+ * Scenario, the same parameters are given to tools/ssdp_sim.py --check
+ */
+#define SIM_HOURS 24
+#define SIM_SEED 1
+#define SIM_MX 3                      // s, of every M-SEARCH
+#define SIM_SEARCH_INTERVAL 1800      // s between two M-SEARCH
+#define SIM_ADDR 0x0a01a8c0           // 192.168.1.10, the responder
+#define SIM_CONTROL_POINT 0x0201a8c0  // 192.168.1.2
+#define SIM_SEARCH_PORT_BASE 50000    // + search number, to match responses
+
+/*
+ * In-memory platform: virtual clock, seeded random generator and a control
+ * point on the other side of the link. Nothing waits, a day runs in seconds
+ */
+typedef struct {
+  uint64_t now;  // ms
+  uint64_t end;
+  uint32_t seed;
+  int multicast;  // handle of the SSDP group, -1 if closed
+  uint64_t next_search;
+  uint32_t searches;
+} sim_t;
+
+static sim_t sim;
+
+static uint64_t sim_millis(void* ctx) { return sim.now; }
+
+// xorshift32, the same sequence on every run
+static uint32_t sim_random(void* ctx) {
+  sim.seed ^= sim.seed << 13;
+  sim.seed ^= sim.seed >> 17;
+  sim.seed ^= sim.seed << 5;
+  return sim.seed;
+}
+
+static uint32_t sim_local_ip(void* ctx) { return SIM_ADDR; }
+
+static int sim_open(void* ctx, uint16_t port, bool multicast, uint8_t ttl) {
+  if (!multicast) {
+    // Unicast searches are not part of the scenario
+    return 2;
+  }
+  sim.multicast = 1;
+  return sim.multicast;
+}
+
+static int sim_set_membership(void* ctx, int handle, bool join) { return 0; }
+
+static void sim_close(void* ctx, int handle) {
+  if (handle == sim.multicast) {
+    sim.multicast = -1;
+  }
+}
+
+// Jump to the next M-SEARCH if it comes before the timeout, else to the end
+// of the timeout
+static int sim_wait(void* ctx, const int* handles, bool* ready, size_t count,
+                    uint32_t timeout_ms) {
+  uint64_t deadline = sim.now + timeout_ms;
+  int found = 0;
+  for (size_t i = 0; i < count; i++) {
+    ready[i] = handles[i] == sim.multicast && sim.next_search <= deadline;
+    found += ready[i];
+  }
+  if (found) {
+    if (sim.next_search > sim.now) {
+      sim.now = sim.next_search;
+    }
+    return found;
+  }
+  sim.now = deadline < sim.end ? deadline : sim.end;
+  return 0;
+}
+
+static int sim_recv(void* ctx, int handle, char* buf, size_t size,
+                    uint32_t* addr, uint16_t* port) {
+  int len = snprintf(buf, size,
+                     "M-SEARCH * HTTP/1.1\r\n"
+                     "HOST: 239.255.255.250:1900\r\n"
+                     "MAN: \"ssdp:discover\"\r\n"
+                     "MX: %d\r\n"
+                     "ST: ssdp:all\r\n"
+                     "\r\n",
+                     SIM_MX);
+  *addr = SIM_CONTROL_POINT;
+  *port = htons(SIM_SEARCH_PORT_BASE + sim.searches);
+  printf("{\"t\": %" PRIu64 ", \"search\": %" PRIu32 ", \"mx\": %d}\n",
+         sim.now, sim.searches, SIM_MX);
+  sim.searches++;
+  sim.next_search = sim.now + SIM_SEARCH_INTERVAL * 1000ULL;
+  return len;
+}
+
+// What the control point sees: one line per batch of NOTIFY or responses
+static int sim_send(void* ctx, int handle, const ssdp_datagram_t* datagrams,
+                    size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  const ssdp_iovec_t* head = &datagrams[0].parts[0];
+  if (head->len >= 6 && memcmp(head->base, "NOTIFY", 6) == 0) {
+    printf("{\"t\": %" PRIu64 ", \"notify\": %u}\n", sim.now,
+           (unsigned)count);
+  } else {
+    printf("{\"t\": %" PRIu64 ", \"response\": %u, \"search\": %u}\n",
+           sim.now, (unsigned)count,
+           (unsigned)(ntohs(datagrams[0].port) - SIM_SEARCH_PORT_BASE));
+  }
+  return count;
+}
+
+static const ssdp_platform_t sim_platform = {
+    .ctx = NULL,
+    .millis = sim_millis,
+    .random = sim_random,
+    .local_ip = sim_local_ip,
+    .open = sim_open,
+    .set_membership = sim_set_membership,
+    .close = sim_close,
+    .wait = sim_wait,
+    .recv = sim_recv,
+    .send = sim_send,
+};
+
+void app_main(void) {
+  ESP_ERROR_CHECK(nvs_flash_init());
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  ESP_ERROR_CHECK(ssdp_init());
+  // The trace is the only output
+  esp_log_level_set("*", ESP_LOG_WARN);
+
+  sim.seed = SIM_SEED;
+  sim.multicast = -1;
+  sim.end = SIM_HOURS * 3600 * 1000ULL;
+  sim.next_search = sim_random(NULL) % (SIM_SEARCH_INTERVAL * 1000);
+  ESP_ERROR_CHECK(ssdp_set_platform(&sim_platform));
+
+  ssdp_config_t config = SDDP_DEFAULT_CONFIG();
+  config.polled = true;
+  config.device_type = "rootdevice";
+  config.uuid_root = "38323636-4558-4dda-9188-cda0e6";
+  printf(
+      "{\"config\": {\"hours\": %d, \"max_age\": %" PRIu32
+      ", \"refresh_percent\": %u, \"jitter_percent\": %u, "
+      "\"startup_delay_max\": %" PRIu32 ", \"startup_burst\": %u, "
+      "\"startup_burst_spacing\": %" PRIu32 ", \"mx_max_delay\": %u, "
+      "\"mx\": %d, \"search_interval\": %d}}\n",
+      SIM_HOURS, config.max_age ? config.max_age : config.interval,
+      config.refresh_percent, config.jitter_percent, config.startup_delay_max,
+      config.startup_burst, config.startup_burst_spacing, config.mx_max_delay,
+      SIM_MX, SIM_SEARCH_INTERVAL);
+  esp_err_t err = ssdp_start(&config);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start ssdp: %s", esp_err_to_name(err));
+    return;
+  }
+  // The responder itself, driven by the virtual clock of the platform
+  while (sim.now < sim.end) {
+    ssdp_poll(ssdp_next_deadline());
+  }
+  ssdp_stop();
+  ssdp_set_platform(NULL);
+  printf("{\"end\": %" PRIu64 "}\n", sim.end);
+}
@@ -17,23 +17,124 @@
 #ifndef ESP_SSDP_H_
 #define ESP_SSDP_H_
 #include <esp_err.h>
+#include <esp_event_base.h>
+#include <esp_http_server.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <sdkconfig.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include "ssdp_header_ids.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Device identity compiled at build time by tools/ssdp_manifest.py, all the
+// strings and packet fragments stay in flash
+typedef struct {
+  const char* nt;    // NULL for the uuid target when uuid is set at runtime
+  const char* line;  // "<NT>\r\nUSN: <USN>\r\n", NULL when uuid is NULL
+  uint16_t nt_len;
+  uint16_t line_len;
+  uint32_t hash;  // FNV-1a of the lower case NT
+} ssdp_manifest_target_t;
+
+// Document served as is by ssdp_register_httpd_handlers(), e.g. an SCPD
+typedef struct {
+  const char* path;  // URI, e.g. "/scpd/switch.xml"
+  const char* body;
+  size_t len;
+  const uint8_t* gzip;  // gzip of body, NULL if not compressed
+  size_t gzip_len;
+} ssdp_manifest_file_t;
+
+typedef struct {
+  const char* uuid;  // NULL: uuid_root and MAC address at runtime
+  const char* schema_url;
+  const char* device_type;
+  const char* server_name;
+  const char* model_name;
+  const char* model_number;
+  // Complete description, or the part before the UDN uuid when uuid is NULL
+  const char* description;
+  size_t description_len;
+  const char* description_tail;  // after the UDN uuid when uuid is NULL
+  size_t description_tail_len;
+  const uint8_t* description_gzip;  // NULL if not compressed or no uuid
+  size_t description_gzip_len;
+  const ssdp_manifest_file_t* files;
+  size_t file_count;
+  uint32_t config_id;  // CONFIGID.UPNP.ORG, hash of the description
+  const ssdp_manifest_target_t* targets;  // root, uuid, device, services
+  size_t target_count;
+  const int16_t* st_table;  // open addressing on hash, -1 if empty slot
+  uint32_t st_mask;
+} ssdp_manifest_t;
+
+#if CONFIG_SSDP_MANIFEST
+// Generated from CONFIG_SSDP_MANIFEST_FILE
+extern const ssdp_manifest_t ssdp_manifest;
+#endif
+
+// IPv4 subnet in network byte order, e.g. ESP_IP4TOADDR(192, 168, 1, 0) and
+// ESP_IP4TOADDR(255, 255, 255, 0)
+typedef struct {
+  uint32_t addr;
+  uint32_t mask;
+} ssdp_subnet_t;
+
+// Service of the description, its type is also advertised and answered.
+// Strings are copied in the description as is, without markup
+typedef struct {
+  const char* type;  // e.g. "urn:schemas-upnp-org:service:SwitchPower:1"
+  const char* id;    // e.g. "urn:upnp-org:serviceId:SwitchPower"
+  const char* scpd_url;
+  const char* control_url;
+  const char* event_url;  // NULL if not evented
+} ssdp_service_t;
+
+typedef struct {
+  const char* mime_type;  // e.g. "image/png"
+  uint16_t width;
+  uint16_t height;
+  uint8_t depth;
+  const char* url;
+} ssdp_icon_t;
+
 typedef struct {
   unsigned task_priority;
   size_t stack_size;
   BaseType_t core_id;
+  bool polled;  // no task: the application calls ssdp_poll() instead
   uint8_t ttl;
   uint16_t port;
-  uint32_t interval;
+  uint32_t interval;           // max-age (s) when max_age is 0
+  uint32_t max_age;            // CACHE-CONTROL max-age (s), 0 = interval
+  uint8_t refresh_percent;     // NOTIFY period in % of max-age
+  uint8_t jitter_percent;      // random shortening of each NOTIFY period
+  uint32_t startup_delay_max;  // random delay (ms) before first NOTIFY
+  uint8_t startup_burst;       // NOTIFY sent at startup
+  uint32_t startup_burst_spacing;  // delay (ms) between startup NOTIFY
   uint16_t mx_max_delay;
+  uint16_t search_port;  // unicast SEARCHPORT.UPNP.ORG, 0 = disabled
+  // Sources dropped before parsing: denied subnets, then anything outside
+  // the allowed ones if there are any (at most 8 per list, copied at start)
+  const ssdp_subnet_t* allowed_sources;
+  size_t allowed_source_count;
+  const ssdp_subnet_t* denied_sources;
+  size_t denied_source_count;
+  bool ignore_own_packets;  // our NOTIFY looped back by the multicast socket
+  // APSTA relay (CONFIG_SSDP_RELAY): searches are forwarded between the
+  // soft-AP and station sides, upstream devices are cached for their max-age
+  // and a search repeated by AP clients within relay_holdoff (s) is answered
+  // from the cache only
+  bool relay;
+  uint8_t relay_cache_size;  // upstream devices kept, 512 bytes each
+  uint16_t relay_holdoff;
   const char* uuid_root;
   const char* uuid;
   const char* schema_url;
@@ -48,31 +149,344 @@ typedef struct {
   const char* model_number;
   const char* model_description;
   const char* server_name;
-  const char* services_description;
-  const char* icons_description;
+  const char* services_description;  // raw <service> elements
+  const char* icons_description;     // raw <icon> elements
+  // Typed alternative to the two strings above, validated and rendered into
+  // the description by ssdp_start(), the arrays are not kept
+  const ssdp_service_t* services;
+  size_t service_count;
+  const ssdp_icon_t* icons;
+  size_t icon_count;
+  const ssdp_manifest_t* manifest;  // replaces the strings above if not NULL
+  // CONFIG_SSDP_WARM_START: uuid and rendered targets from the previous
+  // start when the configuration is the same, then a startup delay of at
+  // most 100 ms. Ignored with a manifest, ESP_ERR_NOT_SUPPORTED from
+  // ssdp_start() without CONFIG_SSDP_WARM_START
+  bool warm_start;
+  uint16_t gena_moderation;   // min delay (ms) between events to a subscriber
+  uint32_t gena_timeout_max;  // longest subscription (s) granted
+  // SSDP_EVENT kinds posted (CONFIG_SSDP_EVENTS), SSDP_EVENT_MASK() bits,
+  // at most event_rate of each kind per second, 0 = no limit
+  uint32_t event_mask;
+  uint16_t event_rate;
 } ssdp_config_t;
 
 #define SDDP_DEFAULT_CONFIG()                                               \
   {                                                                         \
     .task_priority = tskIDLE_PRIORITY + 5, .stack_size = 4096,              \
-    .core_id = tskNO_AFFINITY, .ttl = 2, .port = 80, .interval = 1200,      \
-    .mx_max_delay = 10000, .uuid_root = NULL, .uuid = NULL,                 \
-    .schema_url = "description.xml", .device_type = "Basic",                \
-    .friendly_name = "ESP32", .serial_number = "000000",                    \
+    .core_id = tskNO_AFFINITY, .polled = false, .ttl = 2, .port = 80,       \
+    .interval = 1200, .max_age = 0, .refresh_percent = 50,                  \
+    .jitter_percent = 10,                                                   \
+    .startup_delay_max = 1000, .startup_burst = 3,                          \
+    .startup_burst_spacing = 200, .mx_max_delay = 10000, .search_port = 0,  \
+    .allowed_sources = NULL, .allowed_source_count = 0,                     \
+    .denied_sources = NULL, .denied_source_count = 0,                       \
+    .ignore_own_packets = true, .relay = false, .relay_cache_size = 16,    \
+    .relay_holdoff = 30,                                                    \
+    .uuid_root = NULL, .uuid = NULL, .schema_url = "description.xml",       \
+    .device_type = "Basic", .friendly_name = "ESP32",                       \
+    .serial_number = "000000",                                              \
     .presentation_url = "/", .manufacturer_name = "Espressif Systems",      \
     .manufacturer_url = "https://www.espressif.com", .model_name = "ESP32", \
     .model_url = "https://www.espressif.com", .model_number = "12345",      \
     .model_description = NULL, .server_name = "SSDPServer/1.0",             \
-    .services_description = NULL, .icons_description = NULL                 \
+    .services_description = NULL, .icons_description = NULL,                \
+    .services = NULL, .service_count = 0, .icons = NULL, .icon_count = 0,   \
+    .manifest = NULL, .warm_start = false, .gena_moderation = 200,          \
+    .gena_timeout_max = 1800, .event_mask = 0, .event_rate = 10             \
   }
 
+typedef enum {
+  SSDP_ALLOC_START,    // ssdp_start
+  SSDP_ALLOC_SEND,     // NOTIFY and search responses
+  SSDP_ALLOC_SCHEMA,   // description rendering
+  SSDP_ALLOC_GENA,     // subscriptions and events
+  SSDP_ALLOC_CAPTURE,  // pcap ring
+  SSDP_ALLOC_RELAY,    // relay cache
+  SSDP_ALLOC_SITE_MAX
+} ssdp_alloc_site_t;
+
+typedef struct {
+  size_t heap_current;  // bytes currently allocated by the component
+  size_t heap_peak;     // highest heap_current seen
+  uint32_t alloc_count[SSDP_ALLOC_SITE_MAX];
+  uint32_t free_count;
+  uint32_t alloc_failed;
+  size_t stack_size;        // bytes, 0 if the task is not running
+  size_t stack_high_water;  // minimum free stack bytes seen
+} ssdp_mem_stats_t;
+
+// Transmit path: sends never block, datagrams refused by the stack are
+// retried with a growing delay until a deadline
+typedef struct {
+  uint32_t sent;           // datagrams accepted by the stack
+  uint32_t deferred;       // replies queued after ENOMEM, ENOBUFS or EAGAIN
+  uint32_t recovered;      // queued replies sent completely later
+  uint32_t dropped_full;   // retry queue full
+  uint32_t dropped_late;   // deadline reached while still refused
+  uint32_t dropped_error;  // other errors
+  size_t queue_depth;      // replies waiting for a retry
+  size_t queue_peak;
+} ssdp_tx_stats_t;
+
+// Posted on the default event loop, never waiting for room in its queue
+ESP_EVENT_DECLARE_BASE(SSDP_EVENT);
+
+typedef enum {
+  SSDP_EVENT_STARTED,           // ssdp_event_started_t
+  SSDP_EVENT_STOPPED,           // no data
+  SSDP_EVENT_SOCKET_RESTARTED,  // ssdp_event_socket_t
+  SSDP_EVENT_SEARCH_ANSWERED,   // ssdp_event_search_t, response scheduled
+  SSDP_EVENT_NOTIFY_SENT,       // ssdp_event_notify_t
+  SSDP_EVENT_RESPONSE_DROPPED,  // ssdp_event_dropped_t, NOTIFY included
+  SSDP_EVENT_MAX,
+} ssdp_event_id_t;
+
+#define SSDP_EVENT_MASK(id) (1UL << (id))
+#define SSDP_EVENT_MASK_ALL (SSDP_EVENT_MASK(SSDP_EVENT_MAX) - 1)
+#define SSDP_EVENT_ST_SIZE 64
+
+typedef struct {
+  uint32_t boot_id;
+  uint32_t config_id;
+  bool polled;
+} ssdp_event_started_t;
+
+typedef struct {
+  int error;          // errno that made the sockets close
+  uint32_t retry_ms;  // before they are opened again
+} ssdp_event_socket_t;
+
+// Addresses and ports in network byte order
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  bool unicast;  // to SEARCHPORT.UPNP.ORG, answered at once
+  uint16_t delay_ms;
+  char st[SSDP_EVENT_ST_SIZE];  // truncated, null-terminated
+} ssdp_event_search_t;
+
+typedef struct {
+  uint16_t datagrams;
+  uint32_t next_ms;  // until the next NOTIFY
+} ssdp_event_notify_t;
+
+typedef enum {
+  SSDP_DROP_PENDING_FULL,  // too many responses waiting for their MX delay
+  SSDP_DROP_RETRY_FULL,    // see ssdp_tx_stats_t
+  SSDP_DROP_LATE,
+  SSDP_DROP_ERROR,
+} ssdp_drop_reason_t;
+
+typedef struct {
+  uint32_t addr;  // control point, 0 for a NOTIFY
+  uint16_t port;
+  uint16_t datagrams;
+  uint8_t reason;  // ssdp_drop_reason_t
+} ssdp_event_dropped_t;
+
+// Latency of each stage of a search response, with CONFIG_SSDP_TRACE
+typedef enum {
+  SSDP_TRACE_PARSE,  // recvfrom return to parse done
+  SSDP_TRACE_MATCH,  // parse done to ST matched
+  SSDP_TRACE_QUEUE,  // queued to taken for sending, queued ones only
+  SSDP_TRACE_LATE,   // response due to actually sent by the task
+  SSDP_TRACE_SEND,   // sendto/sendmmsg call, NOTIFY included
+  SSDP_TRACE_TOTAL,  // recvfrom return to sendto return
+  SSDP_TRACE_STAGE_MAX
+} ssdp_trace_stage_t;
+
+#define SSDP_TRACE_BUCKETS 24
+
+typedef struct {
+  // Bucket b counts the samples in [2^b, 2^(b+1)) us, bucket 0 the ones
+  // below 2 us and the last one everything above
+  uint32_t count[SSDP_TRACE_STAGE_MAX][SSDP_TRACE_BUCKETS];
+  uint32_t max_us[SSDP_TRACE_STAGE_MAX];
+} ssdp_trace_stats_t;
+
+// Pointer and length inside the parsed datagram, nothing is copied. ptr is
+// NULL when the header is absent
+typedef struct {
+  const char* ptr;
+  size_t len;
+} ssdp_view_t;
+
+typedef enum {
+  SSDP_MESSAGE_RESPONSE,  // HTTP/1.1 200 OK answering a search
+  SSDP_MESSAGE_SEARCH,
+  SSDP_MESSAGE_NOTIFY,
+} ssdp_message_method_t;
+
+typedef enum {
+  SSDP_NTS_NONE,  // no NTS header
+  SSDP_NTS_ALIVE,
+  SSDP_NTS_BYEBYE,
+  SSDP_NTS_UPDATE,
+  SSDP_NTS_OTHER,  // see nts_value
+} ssdp_nts_t;
+
+// Filled by ssdp_parse(), the views point into the buffer parsed and are
+// valid as long as it is. Values are trimmed, quotes are kept (MAN)
+typedef struct {
+  ssdp_message_method_t method;
+  ssdp_nts_t nts;
+  ssdp_view_t st;
+  ssdp_view_t man;
+  ssdp_view_t mx;
+  ssdp_view_t usn;
+  ssdp_view_t location;
+  ssdp_view_t cache_control;
+  ssdp_view_t nt;
+  ssdp_view_t nts_value;
+  ssdp_view_t server;
+  ssdp_view_t boot_id;      // BOOTID.UPNP.ORG
+  ssdp_view_t config_id;    // CONFIGID.UPNP.ORG
+  ssdp_view_t search_port;  // SEARCHPORT.UPNP.ORG
+  // Every known header by ssdp_header_t, the ones above included: HOST,
+  // USER-AGENT, CPFN.UPNP.ORG, NEXTBOOTID.UPNP.ORG...
+  ssdp_view_t headers[SSDP_HEADER_COUNT];
+} ssdp_message_t;
+
+// Platform hooks: transport, clock and RNG used by the SSDP task, they let a
+// host harness run the responder over an in-memory network in virtual time.
+// Addresses and ports are in network byte order, socket handles are >= 0
+typedef struct {
+  const void* base;
+  size_t len;
+} ssdp_iovec_t;
+
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  const ssdp_iovec_t* parts;  // gathered into one datagram
+  size_t part_count;
+} ssdp_datagram_t;
+
+typedef struct {
+  void* ctx;  // passed back to every hook
+  uint64_t (*millis)(void* ctx);
+  uint32_t (*random)(void* ctx);
+  uint32_t (*local_ip)(void* ctx);  // 0 when there is no address
+  // Return a handle bound to port, member of the SSDP group if multicast,
+  // -1 on error
+  int (*open)(void* ctx, uint16_t port, bool multicast, uint8_t ttl);
+  int (*set_membership)(void* ctx, int handle, bool join);
+  void (*close)(void* ctx, int handle);
+  // Set ready[i] for the readable handles, return their count, 0 on timeout,
+  // -1 with errno on error
+  int (*wait)(void* ctx, const int* handles, bool* ready, size_t count,
+              uint32_t timeout_ms);
+  // Return the datagram length, -1 with errno on error
+  int (*recv)(void* ctx, int handle, char* buf, size_t size, uint32_t* addr,
+              uint16_t* port);
+  // Return the number of datagrams sent, -1 with errno on error. Fewer than
+  // count leaves errno set for the first one not sent. Must not block,
+  // ENOMEM/ENOBUFS/EAGAIN make the task try the rest again later
+  int (*send)(void* ctx, int handle, const ssdp_datagram_t* datagrams,
+              size_t count);
+} ssdp_platform_t;
+
+// Callbacks of other protocols sharing the SSDP task, called from it: they
+// must not block and can register or remove sockets and timers
+typedef void (*ssdp_socket_cb_t)(int sock, void* arg);  // sock is readable
+typedef void (*ssdp_timer_cb_t)(void* arg);
+// Each datagram received by the SSDP sockets, before the source filter. buf
+// is the receive buffer, null-terminated and only valid during the call
+typedef void (*ssdp_observer_cb_t)(const char* buf, size_t len, uint32_t addr,
+                                   uint16_t port, void* arg);
+
 esp_err_t ssdp_init();
 
+// Before ssdp_start(), NULL restores lwIP sockets, esp_timer and esp_random
+esp_err_t ssdp_set_platform(const ssdp_platform_t* platform);
+// Before ssdp_start(), lwIP raw UDP API instead of sockets: no socket layer
+// nor mailbox on the way and no copy of the responses. Sockets cannot be
+// added with ssdp_loop_add_socket() and the relay is not available.
+// ESP_ERR_NOT_SUPPORTED without CONFIG_SSDP_RAW_UDP
+esp_err_t ssdp_set_raw_platform();
+
 esp_err_t ssdp_start(ssdp_config_t* configuration);
 
+// Waits for the SSDP task to exit before freeing anything, up to the 2 s
+// of a select in progress. Not to be called from the SSDP task itself
 esp_err_t ssdp_stop();
 
-const char* get_ssdp_schema_str();
+// With polled set in the configuration, runs the responder from the calling
+// task: sends what is due and handles the datagrams received, waiting at
+// most timeout_ms for them (0 never blocks). Without an address it returns
+// at once, the caller sleeps until ssdp_next_deadline() or its own events.
+// ssdp_poll(), ssdp_next_deadline() and ssdp_stop() must all be called from
+// the same task, ssdp_stop() never while ssdp_poll() runs (e.g. from a
+// callback of the loop)
+esp_err_t ssdp_poll(uint32_t timeout_ms);
+// ms until ssdp_poll() has something to send, 0 if it is already due
+uint32_t ssdp_next_deadline();
+
+// Forget the warm start state, e.g. at a factory reset. ESP_ERR_NOT_FOUND if
+// there is none, ESP_ERR_NOT_SUPPORTED without CONFIG_SSDP_WARM_START
+esp_err_t ssdp_warm_clear();
+
+// Copy of the description rendered by ssdp_start(), NUL-terminated and
+// truncated to size. Return its full length, 0 if not started
+size_t ssdp_get_schema(char* buf, size_t size);
+
+// After ssdp_start(): GET handlers for the description and the files of the
+// manifest, with ETag, 304 on If-None-Match and gzip bodies when available,
+// SUBSCRIBE and UNSUBSCRIBE on the eventSubURL of each service
+esp_err_t ssdp_register_httpd_handlers(httpd_handle_t server);
+// Before ssdp_stop(): remove them again, e.g. when the server keeps running
+esp_err_t ssdp_unregister_httpd_handlers(httpd_handle_t server);
+
+// Evented state variable of a service of the description, by serviceId.
+// Only the last value is kept: changes within gena_moderation of the previous
+// event go to each subscriber together in the next one. The value is escaped,
+// the name must be an XML name (letters, digits, '_', '-', '.')
+esp_err_t ssdp_gena_set(const char* service_id, const char* variable,
+                        const char* value);
+
+// Serve the socket of another protocol from the SSDP task instead of a task
+// of its own (4 at most), the socket stays owned by the caller. Changes made
+// from another task apply at the next wake-up of the SSDP task, within 2 s.
+// ESP_ERR_NOT_SUPPORTED unless the default platform is in use
+esp_err_t ssdp_loop_add_socket(int sock, ssdp_socket_cb_t callback,
+                               void* arg);
+esp_err_t ssdp_loop_remove_socket(int sock);
+// Call callback after delay (ms), then every period if not 0 (8 at most)
+esp_err_t ssdp_loop_add_timer(uint32_t delay, uint32_t period,
+                              ssdp_timer_cb_t callback, void* arg);
+esp_err_t ssdp_loop_remove_timer(ssdp_timer_cb_t callback, void* arg);
+// NULL removes it
+esp_err_t ssdp_set_observer(ssdp_observer_cb_t callback, void* arg);
+
+// Parse an SSDP datagram without allocating nor copying anything, buf needs
+// no terminating null. ESP_FAIL if it is not a well formed M-SEARCH, NOTIFY
+// or search response, callable from any task
+esp_err_t ssdp_parse(const char* buf, size_t len, ssdp_message_t* message);
+
+esp_err_t ssdp_get_mem_stats(ssdp_mem_stats_t* stats);
+
+esp_err_t ssdp_get_tx_stats(ssdp_tx_stats_t* stats);
+
+// "ssdp status|stats|trace dump|trace reset|notify now|search <st>|config"
+// for esp_console, after esp_console_init() or esp_console_new_repl_*()
+esp_err_t ssdp_register_console_commands();
+
+// ESP_ERR_NOT_SUPPORTED without CONFIG_SSDP_TRACE
+esp_err_t ssdp_get_trace_stats(ssdp_trace_stats_t* stats);
+esp_err_t ssdp_reset_trace_stats();
+// Percentiles of each stage on stdout, e.g. from a host build
+esp_err_t ssdp_dump_trace_stats();
+
+// pcap capture of every datagram received and sent, with its timestamp, to
+// file (host build) or, when file is NULL, to a RAM ring of
+// CONFIG_SSDP_CAPTURE_RING_SIZE bytes keeping the latest datagrams.
+// The file stays open, owned by the caller. ESP_ERR_NOT_SUPPORTED without
+// CONFIG_SSDP_CAPTURE
+esp_err_t ssdp_capture_start(FILE* file);
+esp_err_t ssdp_capture_stop();
+// Ring content as a pcap file, oldest datagram first
+esp_err_t ssdp_capture_dump(FILE* out);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,34 @@
+/*
+  ssdp_header_ids.h identifiers of the SSDP headers known to the parser
+
+  Generated by tools/gen_header_hash.py, do not edit.
+*/
+#ifndef ESP_SSDP_HEADER_IDS_H_
+#define ESP_SSDP_HEADER_IDS_H_
+
+typedef enum {
+  SSDP_HEADER_HOST,
+  SSDP_HEADER_MAN,
+  SSDP_HEADER_MX,
+  SSDP_HEADER_ST,
+  SSDP_HEADER_NT,
+  SSDP_HEADER_NTS,
+  SSDP_HEADER_USN,
+  SSDP_HEADER_LOCATION,
+  SSDP_HEADER_CACHE_CONTROL,
+  SSDP_HEADER_SERVER,
+  SSDP_HEADER_USER_AGENT,
+  SSDP_HEADER_EXT,
+  SSDP_HEADER_DATE,
+  SSDP_HEADER_BOOTID,
+  SSDP_HEADER_NEXTBOOTID,
+  SSDP_HEADER_CONFIGID,
+  SSDP_HEADER_SEARCHPORT,
+  SSDP_HEADER_CPFN,
+  SSDP_HEADER_CPUUID,
+  SSDP_HEADER_TCPPORT,
+  SSDP_HEADER_COUNT,
+  SSDP_HEADER_UNKNOWN = SSDP_HEADER_COUNT
+} ssdp_header_t;
+
+#endif /* ESP_SSDP_HEADER_IDS_H_ */
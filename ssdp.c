@@ -16,16 +16,24 @@
 */
 #include "ssdp.h"
 
+#include <ctype.h>
+#include <inttypes.h>
 #include <lwip/netdb.h>
 #include <stdio.h>
 
+#include "esp_event.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_netif.h"
+#include "esp_random.h"
 #include "esp_timer.h"
+#include "freertos/semphr.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
+#include "nvs.h"
+#include "ssdp_headers.h"
+#include "ssdp_private.h"
 
 static const char *TAG = "esp-ssdp";
 
@@ -33,12 +41,15 @@ static const char *TAG = "esp-ssdp";
  * Defines
  */
 #define SSDP_PORT 1900
-#define SSDP_METHOD_SIZE 10
-#define SSDP_URI_SIZE 2
-#define SSDP_BUFFER_SIZE 64
 #define SSDP_MULTICAST_TTL 2
 #define SSDP_UUID_ROOT "38323636-4558-4dda-9188-cda0e6"
 #define SSDP_MULTICAST_ADDR "239.255.255.250"
+#define SSDP_SELECT_TIMEOUT 2000
+#define SSDP_BACKOFF_MIN 100
+#define SSDP_BACKOFF_MAX 30000
+#define SSDP_NVS_NAMESPACE "ssdp"
+#define SSDP_CONFIGID_MAX 16777215
+#define SSDP_WARM_DELAY_MAX 100  // ms, startup delay cap of a warm start
 
 /*
  * Sizes
@@ -46,7 +57,6 @@ static const char *TAG = "esp-ssdp";
 #define SSDP_UUID_SIZE 37
 #define SSDP_SCHEMA_URL_SIZE 64
 #define SSDP_DEVICE_TYPE_SIZE 64
-#define SSDP_USN_SUFFIX_SIZE 64
 #define SSDP_FRIENDLY_NAME_SIZE 64
 #define SSDP_SERIAL_NUMBER_SIZE 32
 #define SSDP_PRESENTATION_URL_SIZE 128
@@ -57,40 +67,75 @@ static const char *TAG = "esp-ssdp";
 #define SSDP_SERVER_NAME_SIZE 64
 #define SSDP_MANUFACTURER_NAME_SIZE 64
 #define SSDP_MANUFACTURER_URL_SIZE 128
-#define SSDP_SERVICES_DESCRIPTION_SIZE 256
-#define SSDP_ICONS_DESCRIPTION_SIZE 256
 #define SSDP_DATAGRAM_SIZE 1401
+#define SSDP_SEARCH_PORT_HEADER_SIZE 32
+#define SSDP_HEAD_SIZE 128
+#define SSDP_PENDING_MAX 8
+#define SSDP_BATCH_MAX 8
+#define SSDP_RETRY_MAX 8
+#define SSDP_FILTER_MAX 8  // subnets per list
+#define SSDP_LOOP_SOCKETS_MAX 4  // registered by other protocols
+#define SSDP_LOOP_TIMERS_MAX 8
+// multicast, unicast, the relay ones and the registered ones
+#define SSDP_SOCKET_MAX (4 + SSDP_LOOP_SOCKETS_MAX)
+#define SSDP_RETRY_DELAY_MIN 10   // ms, doubled at each try
+#define SSDP_RETRY_DEADLINE 1000  // ms
+
+// Scatter-gather batches of datagrams where the socket layer supports it
+#if defined(CONFIG_IDF_TARGET_LINUX) && defined(__GLIBC__)
+#define SSDP_HAVE_SENDMMSG 1
+#else
+#define SSDP_HAVE_SENDMMSG 0
+#endif
+
+/*
+ * Targets
+ */
+#define SSDP_TARGET_NONE -2
+#define SSDP_TARGET_ALL -1
+#define SSDP_TARGET_ROOT 0
+#define SSDP_TARGET_UUID 1
+#define SSDP_TARGET_DEVICE 2
+#define SSDP_TARGET_SERVICES 3
 
 /*
  * Templates messages
  */
 
+// Packets are gathered from a head, the lines of the target and a tail
+
 static const char SSDP_RESPONSE_TEMPLATE[] =
     "HTTP/1.1 200 OK\r\n"
-    "EXT:\r\n";
+    "EXT:\r\n"
+    "CACHE-CONTROL: max-age=%u\r\n"
+    "ST: ";
 
 static const char SSDP_NOTIFY_TEMPLATE[] =
     "NOTIFY * HTTP/1.1\r\n"
     "HOST: 239.255.255.250:1900\r\n"
-    "NTS: ssdp:alive\r\n";
+    "NTS: ssdp:alive\r\n"
+    "CACHE-CONTROL: max-age=%u\r\n"
+    "NT: ";
+
+static const char SSDP_TARGET_TEMPLATE[] =
+    "%.*s\r\n"               // NT or ST value
+    "USN: uuid:%s%s%.*s\r\n";  // uuid, "::" and NT unless it is the uuid
 
 static const char SSDP_PACKET_TEMPLATE[] =
-    "%s"  // Message Notification or Response
-    "CACHE-CONTROL: max-age=%u\r\n"
     "SERVER: %s UPNP/1.1 %s/%s\r\n"  // server_name, model_name, model_number
-    "USN: uuid:%s%s\r\n"             // uuid, usn_suffix
-    "%s: %s\r\n"                     // "NT" or "ST", device_type
     "LOCATION: http://%s:%u/%s\r\n"  // LocalIP, port, schemaURL
+    "BOOTID.UPNP.ORG: %u\r\n"        // boot_id
+    "CONFIGID.UPNP.ORG: %u\r\n"      // config_id
+    "%s"                              // SEARCHPORT.UPNP.ORG if any
     "\r\n";
 
 static const char SSDP_SCHEMA_TEMPLATE[] =
     "<?xml version=\"1.0\"?>"
-    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\" configId=\"%u\">"
     "<specVersion>"
     "<major>1</major>"
     "<minor>0</minor>"
     "</specVersion>"
-    "<URLBase>http://%s:%u/</URLBase>"  // LocalIPStr, port
     "<device>"
     "<deviceType>urn:schemas-upnp-org:device:%s:1</deviceType>"  // device_type
     "<friendlyName>%s</friendlyName>"          // friendly_name
@@ -109,22 +154,122 @@ static const char SSDP_SCHEMA_TEMPLATE[] =
     "</root>\r\n"
     "\r\n";
 
+// Elements of the service and icon lists rendered from the typed config
+static const char SSDP_SERVICE_TEMPLATE[] =
+    "<service>"
+    "<serviceType>%s</serviceType>"
+    "<serviceId>%s</serviceId>"
+    "<SCPDURL>%s</SCPDURL>"
+    "<controlURL>%s</controlURL>"
+    "<eventSubURL>%s</eventSubURL>"
+    "</service>";
+
+static const char SSDP_ICON_TEMPLATE[] =
+    "<icon>"
+    "<mimetype>%s</mimetype>"
+    "<width>%u</width>"
+    "<height>%u</height>"
+    "<depth>%u</depth>"
+    "<url>%s</url>"
+    "</icon>";
+
 /*
  * Enums
  */
 
-typedef enum { NONE, SEARCH, NOTIFY } ssdp_method_t;
+// Task notification bits
+typedef enum {
+  SSDP_TASK_BIT_IP_UP = 1 << 0,
+  SSDP_TASK_BIT_IP_DOWN = 1 << 1,
+  SSDP_TASK_BIT_STOP = 1 << 2,
+  SSDP_TASK_BIT_NOTIFY_NOW = 1 << 3,  // console, announce without waiting
+} ssdp_task_bits_t;
 
 /*
  * Struct definitions
  */
 
+// Same layout whether it comes from a manifest in flash or is built at start,
+// nt points to the start of line, NT is also the ST to match
+typedef ssdp_manifest_target_t ssdp_target_t;
+
+// Warm start payload, see ssdp_warm.c for its storage: identity, then
+// target_count ssdp_warm_target_t and their lines, each one null-terminated.
+// BOOTID changes at each start and stays in NVS, out of it
+typedef struct {
+  uint32_t key;  // ssdp_warm_key() of the configuration it was rendered from
+  uint32_t config_hash;  // ssdp_config_hash() of the same configuration
+  char uuid[SSDP_UUID_SIZE + 1];
+  uint16_t target_count;
+  uint32_t lines_len;
+} ssdp_warm_state_t;
+
+typedef struct {
+  uint16_t nt_len;
+  uint16_t line_len;
+  uint32_t hash;
+} ssdp_warm_target_t;
+
+// Everything needed to send one reply, built on the stack of the SSDP task
+// and passed by value so no state is shared between requests
+typedef struct {
+  int sock;
+  int target;
+  in_addr_t remote_addr;
+  uint16_t remote_port;
+  int64_t received;  // us, 0 for announcements or without CONFIG_SSDP_TRACE
+  int64_t queued;    // us, when the MX delay started, same
+} ssdp_reply_t;
+
+// Search response waiting for its MX delay
+typedef struct {
+  ssdp_reply_t reply;
+  uint64_t due;
+} ssdp_pending_t;
+
+// Targets [first, last) of a reply that the stack could not take yet
+typedef struct {
+  ssdp_method_t method;
+  ssdp_reply_t reply;
+  size_t first;
+  size_t last;
+  uint32_t backoff;
+  uint64_t next_try;
+  uint64_t deadline;
+} ssdp_retry_t;
+
 typedef struct {
   // Configuration
   uint8_t ttl;
   uint16_t port;
-  uint32_t interval;
+  uint32_t max_age;
+  uint32_t notify_period;
+  uint8_t jitter_percent;
+  uint32_t startup_delay_max;
+  uint8_t startup_burst;
+  uint32_t startup_burst_spacing;
   uint16_t mx_max_delay;
+  uint16_t search_port;
+  // Source filter
+  ssdp_subnet_t allowed_sources[SSDP_FILTER_MAX];  // none: any source
+  size_t allowed_source_count;
+  ssdp_subnet_t denied_sources[SSDP_FILTER_MAX];
+  size_t denied_source_count;
+  bool ignore_own_packets;
+  uint32_t local_addr;  // as of the last ssdp_render_tail
+  bool relay;
+  const ssdp_manifest_t *manifest;
+  uint32_t boot_id;
+  uint32_t config_id;
+  uint32_t config_hash;
+  // Warm start: the state loaded, kept while the targets point into it,
+  // written again after the startup burst when it did not match
+  bool warm_start;
+  uint32_t warm_key;
+  bool warm_match;  // rendered from the same configuration
+  bool warm_dirty;
+  ssdp_warm_state_t *warm;
+  char search_port_header[SSDP_SEARCH_PORT_HEADER_SIZE];
   char *uuid;
   char *schema_url;
   char *device_type;
@@ -140,26 +285,97 @@ typedef struct {
   char *server_name;
   char *services_description;
   char *icons_description;
+  // Typed services of the configuration, only set during ssdp_start()
+  const ssdp_service_t *services;
+  size_t service_count;
   // Task handle
   TaskHandle_t xHandle;
+  size_t stack_size;
+  // Loop state between two ssdp_step()
+  bool link_up;
+  bool joined;
+  uint32_t backoff;
+  uint64_t reopen_time;  // no socket until then after a failure
+  uint64_t deadline;     // next step needed, as of the last one
+  int relay_sockets[SSDP_SOCKET_MAX - 2];
+  size_t relay_count;
   // variables
   char *datagram_buffer;
-  char respond_type[SSDP_DEVICE_TYPE_SIZE + 1];
-  char usn_suffix[SSDP_USN_SUFFIX_SIZE + 1];
   char *schema;
-  int delay;
+  size_t schema_len;
   uint64_t notify_time;
-
+  uint8_t burst_remaining;
+  // Pre-rendered packets
+  char response_head[SSDP_HEAD_SIZE];
+  char notify_head[SSDP_HEAD_SIZE];
+  const ssdp_target_t *targets;
+  size_t target_count;
+  const int16_t *st_table;
+  uint32_t st_mask;
+  ssdp_target_t *target_buffer;  // targets built at start
+  char *tail;
+  size_t tail_size;
+  size_t tail_len;
+  // Search responses
+  ssdp_pending_t pending[SSDP_PENDING_MAX];
+  size_t pending_count;
+  // Datagrams refused by the stack
+  ssdp_retry_t retries[SSDP_RETRY_MAX];
+  size_t retry_count;
 } ssdp_task_config_t;
 
+// Socket of another protocol served by the SSDP task
+typedef struct {
+  int sock;
+  ssdp_socket_cb_t callback;
+  void *arg;
+} ssdp_loop_socket_t;
+
+typedef struct {
+  ssdp_timer_cb_t callback;  // NULL: free slot
+  void *arg;
+  uint64_t due;
+  uint32_t period;  // ms, 0 for a one-shot timer
+} ssdp_loop_timer_t;
+
+// Registrations outlive ssdp_stop(), they are served while the task runs
+typedef struct {
+  ssdp_loop_socket_t sockets[SSDP_LOOP_SOCKETS_MAX];
+  size_t socket_count;
+  ssdp_loop_timer_t timers[SSDP_LOOP_TIMERS_MAX];
+  ssdp_observer_cb_t observer;
+  void *observer_arg;
+} ssdp_loop_t;
+
 /*
  * Global variables
  */
 static ssdp_task_config_t *ssdp_task_config = NULL;
 volatile bool ssdp_running = false;
 static int multicast_socket = -1;
-static SemaphoreHandle_t ssdp_send_xSemaphore = NULL;
-static SemaphoreHandle_t ssdp_on_packet_xSemaphore = NULL;
+static int unicast_socket = -1;
+static bool ssdp_initialized = false;
+static portMUX_TYPE ssdp_mem_lock = portMUX_INITIALIZER_UNLOCKED;
+static ssdp_mem_stats_t ssdp_mem_stats = {0};
+static ssdp_tx_stats_t ssdp_tx_stats = {0};
+static portMUX_TYPE ssdp_loop_lock = portMUX_INITIALIZER_UNLOCKED;
+static ssdp_loop_t ssdp_loop = {0};
+static TaskHandle_t ssdp_task_handle = NULL;
+// Without a task, ssdp_poll() runs the loop and the events are latched here
+static volatile bool ssdp_polling = false;
+static volatile uint32_t ssdp_polled_events = 0;
+// Given by the task once it no longer touches ssdp_task_config
+static SemaphoreHandle_t ssdp_task_exited = NULL;
+static StaticSemaphore_t ssdp_task_exited_buffer;
+// Held while ssdp_stop() frees ssdp_task_config and ssdp_get_status() reads
+// it, the locks live as long as the program
+static SemaphoreHandle_t ssdp_state_lock = NULL;
+static StaticSemaphore_t ssdp_state_lock_buffer;
+static esp_event_handler_instance_t ssdp_ip_event_instance = NULL;
+#if CONFIG_SSDP_TRACE
+static portMUX_TYPE ssdp_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+static ssdp_trace_stats_t ssdp_trace_stats = {0};
+#endif
 
 /*
  * Prototypes
@@ -167,28 +383,122 @@ static SemaphoreHandle_t ssdp_on_packet_xSemaphore = NULL;
 
 static void ssdp_set_UUID(char **uuid, const char *root_uid);
 static void ssdp_running_task(void *pvParameters);
+static void ssdp_step(uint32_t wait_max);
 static char *ssdp_get_LocalIP();
 static void onPacket(int sock, in_addr_t remote_addr, uint16_t remote_port,
-                     char *buf, int len);
-static void ssdp_send(int sock, ssdp_method_t method, in_addr_t remote_addr,
-                      uint16_t remote_port);
-static uint64_t ssdp_millis();
-static int ssdp_random(int lowval, int highval);
+                     char *buf, int len, bool unicast, int64_t received);
+static void ssdp_send(ssdp_method_t method, const ssdp_reply_t reply);
+static int ssdp_match_target(const ssdp_view_t *st);
+static bool ssdp_source_allowed(uint32_t addr);
+static bool ssdp_queue_reply(const ssdp_reply_t reply, uint64_t due);
+static uint64_t ssdp_send_due_replies(uint64_t now);
+static void ssdp_render_tail();
+static esp_err_t ssdp_build_schema();
+static void ssdp_schedule_notify(uint64_t now);
+static void ssdp_restart_announcements(uint64_t now, uint32_t delay_max);
+static void ssdp_warm_persist();
 
 /*
  * Local Functions
  */
 
-int ssdp_random(int lowval, int highval) {
-  srand(esp_timer_get_time() / 1000);
-  return lowval + rand() % (highval - lowval + 1);
+// Counting allocator: the size is kept in front of each block so the heap
+// owned by the component can be followed without heap tracing
+typedef union {
+  size_t size;
+  uint64_t align;
+} ssdp_alloc_header_t;
+
+void *ssdp_calloc(ssdp_alloc_site_t site, size_t n, size_t size) {
+  size_t total = n * size;
+  ssdp_alloc_header_t *header = (ssdp_alloc_header_t *)calloc(
+      1, sizeof(ssdp_alloc_header_t) + total);
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  if (header) {
+    header->size = total;
+    ssdp_mem_stats.heap_current += total;
+    if (ssdp_mem_stats.heap_current > ssdp_mem_stats.heap_peak) {
+      ssdp_mem_stats.heap_peak = ssdp_mem_stats.heap_current;
+    }
+    ssdp_mem_stats.alloc_count[site]++;
+  } else {
+    ssdp_mem_stats.alloc_failed++;
+  }
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+  return header ? header + 1 : NULL;
 }
 
-uint64_t ssdp_millis() { return esp_timer_get_time() / 1000; }
+void ssdp_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  ssdp_alloc_header_t *header = (ssdp_alloc_header_t *)ptr - 1;
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  ssdp_mem_stats.heap_current -= header->size;
+  ssdp_mem_stats.free_count++;
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+  free(header);
+}
 
-char *ssdp_get_LocalIP() {
-  esp_err_t err;
-  esp_netif_ip_info_t ip_info = {0};
+/*
+ * Latency tracing: the clock is esp_timer and not the platform one, it
+ * measures the real cost of each stage
+ */
+
+#if CONFIG_SSDP_TRACE
+static int64_t ssdp_trace_now() { return esp_timer_get_time(); }
+
+static void ssdp_trace_record(ssdp_trace_stage_t stage, int64_t us) {
+  if (us < 0) {
+    us = 0;
+  }
+  size_t bucket = 0;
+  for (int64_t v = us >> 1; v && bucket < SSDP_TRACE_BUCKETS - 1; v >>= 1) {
+    bucket++;
+  }
+  portENTER_CRITICAL(&ssdp_trace_lock);
+  ssdp_trace_stats.count[stage][bucket]++;
+  if (us > ssdp_trace_stats.max_us[stage]) {
+    ssdp_trace_stats.max_us[stage] = us > UINT32_MAX ? UINT32_MAX : us;
+  }
+  portEXIT_CRITICAL(&ssdp_trace_lock);
+}
+#else
+static inline int64_t ssdp_trace_now() { return 0; }
+
+static inline void ssdp_trace_record(ssdp_trace_stage_t stage, int64_t us) {}
+#endif
+
+// Set notify_time to the next announcement: the startup burst first, then
+// the refresh period shortened by a random share of jitter_percent so a
+// fleet rebooted at once drifts apart instead of announcing in lockstep
+void ssdp_schedule_notify(uint64_t now) {
+  uint32_t delay;
+  if (ssdp_task_config->burst_remaining > 0) {
+    ssdp_task_config->burst_remaining--;
+    delay = ssdp_random(ssdp_task_config->startup_burst_spacing / 2,
+                        ssdp_task_config->startup_burst_spacing);
+  } else {
+    uint64_t period = ssdp_task_config->notify_period * 1000ULL;
+    uint64_t jitter = period * ssdp_task_config->jitter_percent / 100;
+    delay = period - ssdp_random(0, jitter);
+  }
+  ssdp_task_config->notify_time = now + delay;
+}
+
+// Random delay then startup burst, at start and when back on the network
+void ssdp_restart_announcements(uint64_t now, uint32_t delay_max) {
+  ssdp_task_config->notify_time = now + ssdp_random(0, delay_max);
+  ssdp_task_config->burst_remaining = ssdp_task_config->startup_burst > 1
+                                          ? ssdp_task_config->startup_burst - 1
+                                          : 0;
+}
+
+/*
+ * Default platform: lwIP sockets, esp_timer and esp_random
+ */
+
+static esp_netif_t *ssdp_get_netif() {
   esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
   if (netif == NULL) {
     netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
@@ -196,24 +506,48 @@ char *ssdp_get_LocalIP() {
   if (netif == NULL) {
     netif = esp_netif_get_handle_from_ifkey("ETH_DEF");
   }
+  return netif;
+}
+
+uint32_t ssdp_default_local_ip(void *ctx) {
+  esp_err_t err;
+  esp_netif_ip_info_t ip_info = {0};
+  esp_netif_t *netif = ssdp_get_netif();
   if (netif == NULL) {
-    return "0.0.0.0";
+    return 0;
   }
   err = esp_netif_get_ip_info(netif, &ip_info);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Failed to get IP address info. Error 0x%x", err);
-    return "0.0.0.0";
+    return 0;
+  }
+  return ip_info.ip.addr;
+}
+
+uint64_t ssdp_default_millis(void *ctx) {
+  return esp_timer_get_time() / 1000;
+}
+
+uint32_t ssdp_default_random(void *ctx) { return esp_random(); }
+
+/* Join or leave the IPV4 multicast group in place, the socket is kept */
+static int socket_set_ipv4_multicast_membership(int sock, bool join) {
+  struct ip_mreq imreq = {0};
+  imreq.imr_interface.s_addr = IPADDR_ANY;
+  inet_aton(SSDP_MULTICAST_ADDR, &imreq.imr_multiaddr.s_addr);
+  int err = setsockopt(sock, IPPROTO_IP,
+                       join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, &imreq,
+                       sizeof(struct ip_mreq));
+  if (err < 0) {
+    ESP_LOGE(TAG, "Failed to set %s. Error %d",
+             join ? "IP_ADD_MEMBERSHIP" : "IP_DROP_MEMBERSHIP", errno);
   }
-  return ip4addr_ntoa((const ip4_addr_t *)&ip_info.ip);
+  return err;
 }
 
 /* Add a socket, either IPV4-only or IPV6 dual mode, to the IPV4
    multicast group */
 static int socket_add_ipv4_multicast_group(int sock, bool assign_source_if) {
-  if (!ssdp_task_config) {
-    ESP_LOGE(TAG, "SSDP is not started.");
-    return -1;
-  }
   struct ip_mreq imreq = {0};
   struct in_addr iaddr = {0};
   int err = 0;
@@ -259,11 +593,7 @@ err:
   return err;
 }
 
-static int create_multicast_ipv4_socket(void) {
-  if (!ssdp_task_config) {
-    ESP_LOGE(TAG, "SSDP is not started.");
-    return -1;
-  }
+static int create_multicast_ipv4_socket(uint16_t port, uint8_t ttl) {
   struct sockaddr_in saddr = {0};
   int sock = -1;
   int err = 0;
@@ -276,7 +606,7 @@ static int create_multicast_ipv4_socket(void) {
 
   // Bind the socket to any address
   saddr.sin_family = PF_INET;
-  saddr.sin_port = htons(SSDP_PORT);
+  saddr.sin_port = htons(port);
   saddr.sin_addr.s_addr = htonl(INADDR_ANY);
   err = bind(sock, (struct sockaddr *)&saddr, sizeof(struct sockaddr_in));
   if (err < 0) {
@@ -285,8 +615,7 @@ static int create_multicast_ipv4_socket(void) {
   }
 
   // Assign multicast TTL (set separately from normal interface TTL)
-  setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ssdp_task_config->ttl,
-             sizeof(uint8_t));
+  err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(uint8_t));
   if (err < 0) {
     ESP_LOGE(TAG, "Failed to set IP_MULTICAST_TTL. Error %d", errno);
     goto err;
@@ -317,8 +646,201 @@ err:
   return -1;
 }
 
+// Socket for the UPnP 1.1 SEARCHPORT.UPNP.ORG, control points knowing the
+// device send their M-SEARCH here instead of the multicast group
+static int create_unicast_ipv4_socket(uint16_t port) {
+  struct sockaddr_in saddr = {0};
+  int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Failed to create unicast socket. Error %d", errno);
+    return -1;
+  }
+  saddr.sin_family = PF_INET;
+  saddr.sin_port = htons(port);
+  saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sock, (struct sockaddr *)&saddr, sizeof(struct sockaddr_in)) < 0) {
+    ESP_LOGE(TAG, "Failed to bind unicast socket on port %d. Error %d", port,
+             errno);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static int ssdp_default_open(void *ctx, uint16_t port, bool multicast,
+                             uint8_t ttl) {
+  return multicast ? create_multicast_ipv4_socket(port, ttl)
+                   : create_unicast_ipv4_socket(port);
+}
+
+static int ssdp_default_set_membership(void *ctx, int sock, bool join) {
+  return socket_set_ipv4_multicast_membership(sock, join);
+}
+
+static void ssdp_default_close(void *ctx, int sock) {
+  shutdown(sock, 0);
+  close(sock);
+}
+
+static int ssdp_default_wait(void *ctx, const int *socks, bool *ready,
+                             size_t count, uint32_t timeout_ms) {
+  struct timeval tv = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  int max_fd = -1;
+  for (size_t i = 0; i < count; i++) {
+    FD_SET(socks[i], &rfds);
+    if (socks[i] > max_fd) {
+      max_fd = socks[i];
+    }
+  }
+  int s = select(max_fd + 1, &rfds, NULL, NULL, &tv);
+  for (size_t i = 0; i < count; i++) {
+    ready[i] = s > 0 && FD_ISSET(socks[i], &rfds);
+  }
+  return s;
+}
+
+static int ssdp_default_recv(void *ctx, int sock, char *buf, size_t size,
+                             uint32_t *addr, uint16_t *port) {
+  struct sockaddr_storage raddr;
+  socklen_t socklen = sizeof(raddr);
+  // Read all the datagram at once, if over buffer the data will be discarded
+  int len = recvfrom(sock, buf, size, 0, (struct sockaddr *)&raddr, &socklen);
+  if (len < 0) {
+    return -1;
+  }
+  if (raddr.ss_family != PF_INET) {
+    // Nothing to answer to
+    return 0;
+  }
+  *addr = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
+  *port = ((struct sockaddr_in *)&raddr)->sin_port;
+  return len;
+}
+
+static int ssdp_default_send(void *ctx, int sock,
+                             const ssdp_datagram_t *datagrams, size_t count) {
+  struct sockaddr_in dest[SSDP_BATCH_MAX];
+  struct iovec iov[SSDP_BATCH_MAX][3];
+#if SSDP_HAVE_SENDMMSG
+  struct mmsghdr msgs[SSDP_BATCH_MAX];
+  memset(msgs, 0, sizeof(msgs));
+#endif
+  if (count > SSDP_BATCH_MAX) {
+    count = SSDP_BATCH_MAX;
+  }
+  int sent = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t parts = datagrams[i].part_count > 3 ? 3 : datagrams[i].part_count;
+    memset(&dest[i], 0, sizeof(dest[i]));
+    dest[i].sin_family = PF_INET;
+    dest[i].sin_addr.s_addr = datagrams[i].addr;
+    dest[i].sin_port = datagrams[i].port;
+    for (size_t j = 0; j < parts; j++) {
+      iov[i][j].iov_base = (void *)datagrams[i].parts[j].base;
+      iov[i][j].iov_len = datagrams[i].parts[j].len;
+    }
+#if SSDP_HAVE_SENDMMSG
+    msgs[i].msg_hdr.msg_name = &dest[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(dest[i]);
+    msgs[i].msg_hdr.msg_iov = iov[i];
+    msgs[i].msg_hdr.msg_iovlen = parts;
+#else
+    struct msghdr msg = {
+        .msg_name = &dest[i],
+        .msg_namelen = sizeof(dest[i]),
+        .msg_iov = iov[i],
+        .msg_iovlen = parts,
+    };
+    if (sendmsg(sock, &msg, MSG_DONTWAIT) < 0) {
+      return sent > 0 ? sent : -1;
+    }
+    sent++;
+#endif
+  }
+#if SSDP_HAVE_SENDMMSG
+  sent = sendmmsg(sock, msgs, count, MSG_DONTWAIT);
+  // A short count leaves errno as it was, the next datagram on its own
+  // tells why it could not go
+  while (sent >= 0 && sent < (int)count &&
+         sendmsg(sock, &msgs[sent].msg_hdr, MSG_DONTWAIT) >= 0) {
+    sent++;
+  }
+#endif
+  return sent;
+}
+
+static const ssdp_platform_t SSDP_DEFAULT_PLATFORM = {
+    .ctx = NULL,
+    .millis = ssdp_default_millis,
+    .random = ssdp_default_random,
+    .local_ip = ssdp_default_local_ip,
+    .open = ssdp_default_open,
+    .set_membership = ssdp_default_set_membership,
+    .close = ssdp_default_close,
+    .wait = ssdp_default_wait,
+    .recv = ssdp_default_recv,
+    .send = ssdp_default_send,
+};
+
+static const ssdp_platform_t *ssdp_platform = &SSDP_DEFAULT_PLATFORM;
+
+int ssdp_random(int lowval, int highval) {
+  // Do not seed from the uptime: devices powered up together would share the
+  // same sequence and announce in lockstep
+  return lowval + ssdp_platform->random(ssdp_platform->ctx) %
+                      (highval - lowval + 1);
+}
+
+uint64_t ssdp_millis() { return ssdp_platform->millis(ssdp_platform->ctx); }
+
+static bool ssdp_has_ip() {
+  return ssdp_platform->local_ip(ssdp_platform->ctx) != 0;
+}
+
+char *ssdp_get_LocalIP() {
+  ip4_addr_t ip = {.addr = ssdp_platform->local_ip(ssdp_platform->ctx)};
+  return ip4addr_ntoa(&ip);
+}
+
+static bool ssdp_view_equals(const ssdp_view_t *view, const char *str) {
+  return view->ptr && strlen(str) == view->len &&
+         strncasecmp(view->ptr, str, view->len) == 0;
+}
+
+static bool ssdp_subnet_contains(const ssdp_subnet_t *subnets, size_t count,
+                                 uint32_t addr) {
+  for (size_t i = 0; i < count; i++) {
+    if ((addr & subnets[i].mask) == subnets[i].addr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checked on the source address before anything is parsed: our own packets
+// looped back by the multicast socket, the denied subnets, then the allowed
+// ones if any
+static bool ssdp_source_allowed(uint32_t addr) {
+  if (ssdp_task_config->ignore_own_packets &&
+      addr == ssdp_task_config->local_addr) {
+    return false;
+  }
+  if (ssdp_subnet_contains(ssdp_task_config->denied_sources,
+                           ssdp_task_config->denied_source_count, addr)) {
+    return false;
+  }
+  return ssdp_task_config->allowed_source_count == 0 ||
+         ssdp_subnet_contains(ssdp_task_config->allowed_sources,
+                              ssdp_task_config->allowed_source_count, addr);
+}
+
 static void onPacket(int sock, in_addr_t remote_addr, uint16_t remote_port,
-                     char *buf, int len) {
+                     char *buf, int len, bool unicast, int64_t received) {
   ESP_LOGI(TAG, "received %d bytes from %s:%d", len,
            ip4addr_ntoa((const ip4_addr_t *)&remote_addr), remote_port);
   ESP_LOGI(TAG, "%s", buf);
@@ -326,422 +848,1355 @@ static void onPacket(int sock, in_addr_t remote_addr, uint16_t remote_port,
   if (len == 0) {
     return;
   }
-  if (xSemaphoreTake(ssdp_on_packet_xSemaphore, (TickType_t)10) != pdTRUE) {
-    ESP_LOGE(TAG, "Failed to take on packet semaphore");
+  ssdp_message_t message;
+  esp_err_t parsed = ssdp_parse(buf, len, &message);
+  int64_t parse_done = ssdp_trace_now();
+  ssdp_trace_record(SSDP_TRACE_PARSE, parse_done - received);
+  if (parsed != ESP_OK || message.method != SSDP_MESSAGE_SEARCH) {
+    ESP_LOGI(TAG, "SSDP: ignore...\n");
+    return;
+  }
+  // Reject anything else than a discovery before doing any response work
+  const ssdp_view_t *man = &message.man;
+  if (!ssdp_view_equals(man, "\"ssdp:discover\"") &&
+      !ssdp_view_equals(man, "ssdp:discover")) {
+    ESP_LOGI(TAG, "REJECT. MAN is not ssdp:discover\n");
     return;
   }
-  ESP_LOGI(TAG, "Success to get on packet semaphore");
-  ssdp_method_t method = NONE;
-  typedef enum { METHOD, URI, PROTO, KEY, VALUE, ABORT } states;
-  states state = METHOD;
-  typedef enum { STRIP, START, SKIP, MAN, ST, MX } headers;
-  headers header = STRIP;
-  bool pending = false;
-  bool stmatch = false;
-  uint8_t cursor = 0;
-  uint8_t cr = 0;
+  const ssdp_view_t *st = &message.st;
+  if (!st->ptr || st->len == 0) {
+    ESP_LOGI(TAG, "REJECT. Missing ST\n");
+    return;
+  }
+  ESP_LOGI(TAG, "ST: '%.*s'\n", (int)st->len, st->ptr);
+  int target = ssdp_match_target(st);
+  ssdp_trace_record(SSDP_TRACE_MATCH, ssdp_trace_now() - parse_done);
+  if (target == SSDP_TARGET_NONE) {
+    ESP_LOGI(TAG, "REJECT. The search type %.*s does not match our type %s\n",
+             (int)st->len, st->ptr, ssdp_task_config->device_type);
+    ESP_LOGI(TAG, "SSDP: ignore...\n");
+    return;
+  }
+
+  // Spread the answers over the MX window, unicast searches carry no MX
+  // and are answered without delay
+  uint32_t delay = 0;
+  const ssdp_view_t *mx = &message.mx;
+  if (!unicast && mx->ptr) {
+    uint32_t mx_value = 0;
+    for (size_t i = 0; i < mx->len && isdigit((unsigned char)mx->ptr[i]) &&
+                       mx_value <= 120;
+         i++) {
+      mx_value = mx_value * 10 + (mx->ptr[i] - '0');
+    }
+    uint32_t window = mx_value * 1000;
+    if (window > ssdp_task_config->mx_max_delay) {
+      window = ssdp_task_config->mx_max_delay;
+    }
+    delay = ssdp_random(0, window);
+  }
+  const ssdp_reply_t reply = {
+      .sock = sock,
+      .target = target,
+      .remote_addr = remote_addr,
+      .remote_port = remote_port,
+      .received = received,
+  };
+  if (!ssdp_queue_reply(reply, ssdp_millis() + delay)) {
+    return;
+  }
+  ESP_LOGI(TAG, "SSDP: respond in %u ms...\n", delay);
+  if (SSDP_EVENT_ENABLED(SSDP_EVENT_SEARCH_ANSWERED)) {
+    ssdp_event_search_t event = {
+        .addr = remote_addr,
+        .port = remote_port,
+        .unicast = unicast,
+        .delay_ms = delay,
+    };
+    size_t len = st->len < sizeof(event.st) ? st->len : sizeof(event.st) - 1;
+    memcpy(event.st, st->ptr, len);
+    ssdp_event_post(SSDP_EVENT_SEARCH_ANSWERED, &event, sizeof(event));
+  }
+}
+
+// Index of the target answering the search, SSDP_TARGET_ALL for ssdp:all
+static int ssdp_match_target(const ssdp_view_t *st) {
+  if (ssdp_view_equals(st, "ssdp:all")) {
+    return SSDP_TARGET_ALL;
+  }
+  uint32_t hash = ssdp_hash_nt(st->ptr, st->len);
+  if (ssdp_task_config->st_table) {
+    // Table generated with the manifest
+    for (uint32_t slot = hash & ssdp_task_config->st_mask;
+         ssdp_task_config->st_table[slot] >= 0;
+         slot = (slot + 1) & ssdp_task_config->st_mask) {
+      int i = ssdp_task_config->st_table[slot];
+      const ssdp_target_t *target = &ssdp_task_config->targets[i];
+      if (target->hash == hash && st->len == target->nt_len &&
+          strncasecmp(st->ptr, target->nt, st->len) == 0) {
+        return i;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < ssdp_task_config->target_count; i++) {
+      const ssdp_target_t *target = &ssdp_task_config->targets[i];
+      if (target->hash == hash && st->len == target->nt_len &&
+          strncasecmp(st->ptr, target->nt, st->len) == 0) {
+        return i;
+      }
+    }
+  }
+  // Searches for the bare device type, as answered by previous versions
+  if (ssdp_task_config->device_type &&
+      ssdp_view_equals(st, ssdp_task_config->device_type)) {
+    return SSDP_TARGET_DEVICE;
+  }
+  return SSDP_TARGET_NONE;
+}
 
-  char buffer[SSDP_BUFFER_SIZE] = {0};
+static void ssdp_post_dropped(ssdp_method_t method, const ssdp_reply_t *reply,
+                              size_t datagrams, ssdp_drop_reason_t reason) {
+  if (!SSDP_EVENT_ENABLED(SSDP_EVENT_RESPONSE_DROPPED)) {
+    return;
+  }
+  const ssdp_event_dropped_t event = {
+      .addr = method == NONE ? reply->remote_addr : 0,
+      .port = method == NONE ? reply->remote_port : 0,
+      .datagrams = datagrams,
+      .reason = reason,
+  };
+  ssdp_event_post(SSDP_EVENT_RESPONSE_DROPPED, &event, sizeof(event));
+}
 
-  for (uint i = 0; i < len; i++) {
-    char c = buf[i];
+static bool ssdp_queue_reply(const ssdp_reply_t reply, uint64_t due) {
+  if (ssdp_task_config->pending_count >= SSDP_PENDING_MAX) {
+    ESP_LOGW(TAG, "Too many pending search responses, dropping one");
+    ssdp_post_dropped(NONE, &reply,
+                      reply.target == SSDP_TARGET_ALL
+                          ? ssdp_task_config->target_count
+                          : 1,
+                      SSDP_DROP_PENDING_FULL);
+    return false;
+  }
+  ssdp_pending_t *pending =
+      &ssdp_task_config->pending[ssdp_task_config->pending_count++];
+  pending->reply = reply;
+  pending->reply.queued = ssdp_trace_now();
+  pending->due = due;
+  return true;
+}
 
-    if (c == '\r' || c == '\n') {
-      cr++;
+// Send the responses whose MX delay expired, return the delay until the
+// next one or UINT64_MAX if none is pending
+static uint64_t ssdp_send_due_replies(uint64_t now) {
+  uint64_t next = UINT64_MAX;
+  size_t i = 0;
+  while (i < ssdp_task_config->pending_count) {
+    ssdp_pending_t *pending = &ssdp_task_config->pending[i];
+    if (pending->due <= now) {
+      ssdp_trace_record(SSDP_TRACE_LATE, (now - pending->due) * 1000LL);
+      ssdp_trace_record(SSDP_TRACE_QUEUE,
+                        ssdp_trace_now() - pending->reply.queued);
+      ssdp_send(NONE, pending->reply);
+      // Order does not matter, fill the hole with the last one
+      *pending = ssdp_task_config->pending[--ssdp_task_config->pending_count];
     } else {
-      cr = 0;
-    }
-
-    switch (state) {
-      case METHOD:
-        if (c == ' ') {
-          if (strcmp(buffer, "M-SEARCH") == 0) {
-            method = SEARCH;
-          }
-
-          if (method == NONE) {
-            state = ABORT;
-          } else {
-            state = URI;
-          }
-          cursor = 0;
-
-        } else if (cursor < SSDP_METHOD_SIZE - 1) {
-          buffer[cursor++] = c;
-          buffer[cursor] = '\0';
-        }
-        break;
-      case URI:
-        if (c == ' ') {
-          if (strcmp(buffer, "*")) {
-            state = ABORT;
-          } else {
-            state = PROTO;
-          }
-          cursor = 0;
-        } else if (cursor < SSDP_URI_SIZE - 1) {
-          buffer[cursor++] = c;
-          buffer[cursor] = '\0';
-        }
-        break;
-      case PROTO:
-        if (cr == 2) {
-          state = KEY;
-          cursor = 0;
-        }
-        break;
-      case KEY:
-        if (cr == 4) {
-          if (stmatch) {
-            pending = true;
-          }
-        } else if (c == ':') {
-          cursor = 0;
-          state = VALUE;
-        } else if (c != '\r' && c != '\n' && c != ' ' &&
-                   cursor < SSDP_BUFFER_SIZE - 1) {
-          buffer[cursor++] = c;
-          buffer[cursor] = '\0';
-        }
-        break;
-      case VALUE:
-        if (cr == 2) {
-          switch (header) {
-            case START:
-              ESP_LOGI(TAG, "***********************\n");
-            case SKIP:
-            case STRIP:
-              break;
-            case MAN:
-              ESP_LOGI(TAG, "MAN: %s\n", (char *)buffer);
-              break;
-            case ST:
-              // save the search term for the reply and clear usn suffix.
-              strlcpy(ssdp_task_config->respond_type, buffer,
-                      sizeof(ssdp_task_config->respond_type));
-              ssdp_task_config->usn_suffix[0] = '\0';
-
-              ESP_LOGI(TAG, "ST: '%s'\n", buffer);
-
-              // if looking for all or root reply with upnp:rootdevice
-              if (strcmp(buffer, "ssdp:all") == 0 ||
-                  strcmp(buffer, "upnp:rootdevice") == 0) {
-                stmatch = true;
-                // set USN suffix
-                strlcpy(ssdp_task_config->usn_suffix, "::upnp:rootdevice",
-                        sizeof(ssdp_task_config->usn_suffix));
-                ESP_LOGI(TAG, "the search type matches all and root\n");
-                state = KEY;
-              } else {
-                // if the search type matches our type, we should respond
-                // instead of ABORT
-                if (strcasecmp(buffer, ssdp_task_config->device_type) == 0) {
-                  stmatch = true;
-                  // set USN suffix to the device type
-                  strlcpy(ssdp_task_config->usn_suffix,
-                          "::", sizeof(ssdp_task_config->usn_suffix));
-                  strlcat(ssdp_task_config->usn_suffix,
-                          ssdp_task_config->device_type,
-                          sizeof(ssdp_task_config->usn_suffix));
-                  ESP_LOGI(TAG, "the search type matches our type %s\n");
-                  state = KEY;
-                } else {
-                  state = ABORT;
-                  ESP_LOGI(
-                      TAG,
-                      "REJECT. The search type %s does not match our type %s\n",
-                      buffer, ssdp_task_config->device_type);
-                  ESP_LOGI(TAG, "***********************\n");
-                }
-              }
-              break;
-            case MX:
-              ssdp_task_config->delay = ssdp_random(0, atoi(buffer)) * 1000L;
-              if (ssdp_task_config->delay > ssdp_task_config->mx_max_delay) {
-                ssdp_task_config->delay = ssdp_task_config->mx_max_delay;
-              }
-              break;
-          }
-
-          if (state != ABORT) {
-            state = KEY;
-            header = STRIP;
-            cursor = 0;
-          }
-        } else if (c != '\r' && c != '\n') {
-          if (header == STRIP) {
-            if (c == ' ') {
-              break;
-            } else {
-              header = START;
-            }
-          }
-          if (header == START) {
-            if (strncmp(buffer, "MA", 2) == 0) {
-              header = MAN;
-            } else if (strcmp(buffer, "ST") == 0) {
-              header = ST;
-            } else if (strcmp(buffer, "MX") == 0) {
-              header = MX;
-            } else {
-              header = SKIP;
-            }
-          }
-
-          if (cursor < SSDP_BUFFER_SIZE - 1) {
-            buffer[cursor++] = c;
-            buffer[cursor] = '\0';
-          }
-        }
-        break;
-      case ABORT:
-        pending = false;
-        ssdp_task_config->delay = 0;
-        break;
+      if (pending->due - now < next) {
+        next = pending->due - now;
+      }
+      i++;
     }
   }
+  return next;
+}
 
-  if (pending) {
-    pending = false;
-    ssdp_task_config->delay = 0;
-    ssdp_send(sock, NONE, remote_addr, remote_port);
-    ESP_LOGI(TAG, "SSDP: respond...\n");
+// Errors worth waiting for instead of rebuilding the socket
+static bool ssdp_transient_error(int error) {
+  return error == EAGAIN || error == EWOULDBLOCK || error == EINTR ||
+         error == ENOMEM || error == ENOBUFS;
+}
+
+// Send the pre-rendered packets of the targets [first, last), each datagram
+// is gathered from the head, the target line and the tail. Return the first
+// target not sent, last if all were, with the errno of the send in *error
+// otherwise
+static size_t ssdp_transmit(ssdp_method_t method, const ssdp_reply_t *reply,
+                            size_t first, size_t last, int *error) {
+  uint32_t addr;
+  uint16_t port;
+  if (method == NONE) {
+    addr = reply->remote_addr;
+    port = reply->remote_port;
   } else {
-    ESP_LOGI(TAG, "SSDP: ignore...\n");
+    inet_aton(SSDP_MULTICAST_ADDR, &addr);
+    port = htons(SSDP_PORT);
   }
-  xSemaphoreGive(ssdp_on_packet_xSemaphore);
+  const char *head = (method == NONE) ? ssdp_task_config->response_head
+                                      : ssdp_task_config->notify_head;
+  size_t head_len = strlen(head);
+  while (first < last) {
+    size_t count = last - first;
+    if (count > SSDP_BATCH_MAX) {
+      count = SSDP_BATCH_MAX;
+    }
+    ssdp_iovec_t parts[SSDP_BATCH_MAX][3];
+    ssdp_datagram_t datagrams[SSDP_BATCH_MAX];
+    for (size_t i = 0; i < count; i++) {
+      const ssdp_target_t *entry = &ssdp_task_config->targets[first + i];
+      parts[i][0] = (ssdp_iovec_t){head, head_len};
+      parts[i][1] = (ssdp_iovec_t){entry->line, entry->line_len};
+      parts[i][2] =
+          (ssdp_iovec_t){ssdp_task_config->tail, ssdp_task_config->tail_len};
+      datagrams[i] = (ssdp_datagram_t){
+          .addr = addr,
+          .port = port,
+          .parts = parts[i],
+          .part_count = 3,
+      };
+    }
+    errno = 0;
+    int sent = ssdp_platform->send(ssdp_platform->ctx, reply->sock,
+                                   datagrams, count);
+    // Before capture or logging can touch errno
+    *error = (sent < (int)count) ? (errno ? errno : EIO) : 0;
+    if (sent > 0) {
+      portENTER_CRITICAL(&ssdp_mem_lock);
+      ssdp_tx_stats.sent += sent;
+      portEXIT_CRITICAL(&ssdp_mem_lock);
+      first += sent;
+    }
+#if CONFIG_SSDP_CAPTURE
+    uint16_t src_port = htons(reply->sock == unicast_socket
+                                  ? ssdp_task_config->search_port
+                                  : SSDP_PORT);
+    for (int i = 0; i < sent; i++) {
+      ssdp_capture_packet(ssdp_task_config->local_addr, src_port,
+                          datagrams[i].addr, datagrams[i].port,
+                          datagrams[i].parts, datagrams[i].part_count);
+    }
+#endif
+    if (sent < (int)count) {
+      break;
+    }
+  }
+  return first;
 }
 
-void ssdp_send(int sock, ssdp_method_t method, in_addr_t remote_addr,
-               uint16_t remote_port) {
-  if (xSemaphoreTake(ssdp_send_xSemaphore, (TickType_t)10) != pdTRUE) {
-    ESP_LOGE(TAG, "Failed to take send semaphore");
+static void ssdp_update_tx_depth() {
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  ssdp_tx_stats.queue_depth = ssdp_task_config->retry_count;
+  if (ssdp_tx_stats.queue_depth > ssdp_tx_stats.queue_peak) {
+    ssdp_tx_stats.queue_peak = ssdp_tx_stats.queue_depth;
+  }
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+}
+
+static void ssdp_count_tx(uint32_t *counter) {
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  (*counter)++;
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+}
+
+// The stack ran out of buffers (ENOMEM with lwIP during bursts): keep what
+// was not sent and try again a bit later instead of losing it
+static void ssdp_queue_retry(ssdp_method_t method, const ssdp_reply_t *reply,
+                             size_t first, size_t last, uint64_t now) {
+  if (ssdp_task_config->retry_count >= SSDP_RETRY_MAX) {
+    ESP_LOGW(TAG, "Retry queue full, dropping %u datagrams",
+             (unsigned)(last - first));
+    ssdp_count_tx(&ssdp_tx_stats.dropped_full);
+    ssdp_post_dropped(method, reply, last - first, SSDP_DROP_RETRY_FULL);
     return;
   }
-  ESP_LOGI(TAG, "Success to get send semaphore");
-  int err = 0;
+  ssdp_retry_t *retry =
+      &ssdp_task_config->retries[ssdp_task_config->retry_count++];
+  retry->method = method;
+  retry->reply = *reply;
+  retry->first = first;
+  retry->last = last;
+  retry->backoff = SSDP_RETRY_DELAY_MIN;
+  retry->next_try = now + SSDP_RETRY_DELAY_MIN;
+  retry->deadline = now + SSDP_RETRY_DEADLINE;
+  ssdp_count_tx(&ssdp_tx_stats.deferred);
+  ssdp_update_tx_depth();
+}
+
+// Try the queued datagrams again, each entry doubling its delay until it
+// goes or its deadline passes. Return the delay until the next try or
+// UINT64_MAX if the queue is empty
+static uint64_t ssdp_send_retries(uint64_t now) {
+  uint64_t next = UINT64_MAX;
+  size_t i = 0;
+  while (i < ssdp_task_config->retry_count) {
+    ssdp_retry_t *retry = &ssdp_task_config->retries[i];
+    bool done = false;
+    if (retry->next_try <= now) {
+      int error = 0;
+      retry->first = ssdp_transmit(retry->method, &retry->reply,
+                                   retry->first, retry->last, &error);
+      if (retry->first == retry->last) {
+        ssdp_count_tx(&ssdp_tx_stats.recovered);
+        done = true;
+      } else if (!ssdp_transient_error(error)) {
+        ESP_LOGE(TAG, "Retry failed. errno: %d", error);
+        ssdp_count_tx(&ssdp_tx_stats.dropped_error);
+        ssdp_post_dropped(retry->method, &retry->reply,
+                          retry->last - retry->first, SSDP_DROP_ERROR);
+        done = true;
+      } else if (now + retry->backoff * 2 > retry->deadline) {
+        ESP_LOGW(TAG, "Dropping %u datagrams after retries",
+                 (unsigned)(retry->last - retry->first));
+        ssdp_count_tx(&ssdp_tx_stats.dropped_late);
+        ssdp_post_dropped(retry->method, &retry->reply,
+                          retry->last - retry->first, SSDP_DROP_LATE);
+        done = true;
+      } else {
+        retry->backoff *= 2;
+        retry->next_try = now + retry->backoff;
+      }
+    }
+    if (done) {
+      // Order does not matter, fill the hole with the last one
+      *retry = ssdp_task_config->retries[--ssdp_task_config->retry_count];
+      ssdp_update_tx_depth();
+    } else {
+      if (retry->next_try - now < next) {
+        next = retry->next_try - now;
+      }
+      i++;
+    }
+  }
+  return next;
+}
+
+// Send the packet of one target, or of all of them as one batch. Only
+// called from the SSDP task, which owns the packets: no lock needed
+void ssdp_send(ssdp_method_t method, const ssdp_reply_t reply) {
   if (method == NONE) {
     ESP_LOGI(TAG, "Sending Response to %s:%d",
-             ip4addr_ntoa((const ip4_addr_t *)&remote_addr), remote_port);
-
+             ip4addr_ntoa((const ip4_addr_t *)&reply.remote_addr),
+             reply.remote_port);
   } else {
-    // send notify with our root device type
-    strlcpy(ssdp_task_config->respond_type, "upnp:rootdevice",
-            sizeof(ssdp_task_config->respond_type));
-    strlcpy(ssdp_task_config->usn_suffix, "::upnp:rootdevice",
-            sizeof(ssdp_task_config->usn_suffix));
     ESP_LOGI(TAG, "Sending Notify to %s:%d", SSDP_MULTICAST_ADDR, SSDP_PORT);
   }
-  size_t len_msg_template = (method == NONE) ? strlen(SSDP_RESPONSE_TEMPLATE)
-                                             : strlen(SSDP_NOTIFY_TEMPLATE);
-  size_t msg_buffer_size =
-      strlen(SSDP_PACKET_TEMPLATE) + len_msg_template + 5 +
-      (ssdp_task_config->server_name ? strlen(ssdp_task_config->server_name)
-                                     : 1) +
-      (ssdp_task_config->model_name ? strlen(ssdp_task_config->model_name)
-                                    : 1) +
-      (ssdp_task_config->model_number ? strlen(ssdp_task_config->model_number)
-                                      : 1) +
-      (SSDP_UUID_SIZE) + (SSDP_USN_SUFFIX_SIZE) + 2  // "NT" or "ST"
-      + strlen(ssdp_task_config->respond_type) + 16 + 5 +
-      (ssdp_task_config->schema_url ? strlen(ssdp_task_config->schema_url) : 1);
-  char *msg_buffer = (char *)calloc(msg_buffer_size + 1, sizeof(char));
-
-  if (!msg_buffer) {
-    ESP_LOGE(TAG, "Error not enough memory for valueBuffer creation");
-    xSemaphoreGive(ssdp_send_xSemaphore);
+  size_t first = (reply.target == SSDP_TARGET_ALL) ? 0 : reply.target;
+  size_t last = (reply.target == SSDP_TARGET_ALL)
+                    ? ssdp_task_config->target_count
+                    : (size_t)reply.target + 1;
+
+  int64_t send_start = ssdp_trace_now();
+  int error = 0;
+  size_t next = ssdp_transmit(method, &reply, first, last, &error);
+  int64_t send_done = ssdp_trace_now();
+  ssdp_trace_record(SSDP_TRACE_SEND, send_done - send_start);
+  if (reply.received) {
+    ssdp_trace_record(SSDP_TRACE_TOTAL, send_done - reply.received);
+  }
+  if (next < last) {
+    if (ssdp_transient_error(error)) {
+      ssdp_queue_retry(method, &reply, next, last, ssdp_millis());
+    } else {
+      ESP_LOGE(TAG, "IPV4 send sent %d of %d. errno: %d", (int)(next - first),
+               (int)(last - first), error);
+      ssdp_count_tx(&ssdp_tx_stats.dropped_error);
+      ssdp_post_dropped(method, &reply, last - next, SSDP_DROP_ERROR);
+    }
+  }
+}
+
+// Wake the task up with SSDP_TASK_BIT_* bits, or keep them for the next
+// ssdp_poll()
+static void ssdp_post_events(uint32_t events) {
+  TaskHandle_t task = ssdp_task_handle;
+  if (task) {
+    xTaskNotify(task, events, eSetBits);
+  } else if (ssdp_polling) {
+    portENTER_CRITICAL(&ssdp_loop_lock);
+    ssdp_polled_events |= events;
+    portEXIT_CRITICAL(&ssdp_loop_lock);
+  }
+}
+
+// Sleep until one of the SSDP_TASK_BIT_* bits is notified or timeout expires
+static uint32_t ssdp_wait_events(uint32_t timeout_ms) {
+  uint32_t events = 0;
+  if (!ssdp_polling) {
+    xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(timeout_ms));
+    return events;
+  }
+  // Never sleeps: the caller of ssdp_poll() gets ssdp_next_deadline() and
+  // sleeps in its own loop, where it can be woken up
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  events = ssdp_polled_events;
+  ssdp_polled_events = 0;
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return events;
+}
+
+// Delay until the next registered timer, UINT64_MAX if there is none
+static uint64_t ssdp_loop_next_timer(uint64_t now) {
+  uint64_t next = UINT64_MAX;
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  for (size_t i = 0; i < SSDP_LOOP_TIMERS_MAX; i++) {
+    const ssdp_loop_timer_t *timer = &ssdp_loop.timers[i];
+    if (timer->callback) {
+      uint64_t delay = timer->due > now ? timer->due - now : 0;
+      if (delay < next) {
+        next = delay;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return next;
+}
+
+// Call the registered timers that are due, return the delay until the next
+// one or UINT64_MAX. Callbacks run outside the lock and may register again
+static uint64_t ssdp_loop_run_timers(uint64_t now) {
+  for (size_t i = 0; i < SSDP_LOOP_TIMERS_MAX; i++) {
+    ssdp_timer_cb_t callback = NULL;
+    void *arg = NULL;
+    portENTER_CRITICAL(&ssdp_loop_lock);
+    ssdp_loop_timer_t *timer = &ssdp_loop.timers[i];
+    if (timer->callback && timer->due <= now) {
+      callback = timer->callback;
+      arg = timer->arg;
+      if (timer->period) {
+        // Late ticks are skipped, not bunched up
+        timer->due = timer->due + timer->period > now
+                         ? timer->due + timer->period
+                         : now + timer->period;
+      } else {
+        timer->callback = NULL;
+      }
+    }
+    portEXIT_CRITICAL(&ssdp_loop_lock);
+    if (callback) {
+      callback(arg);
+    }
+  }
+  return ssdp_loop_next_timer(now);
+}
+
+// Snapshot of the registered sockets and observer for one select
+static size_t ssdp_loop_snapshot(int *socks, ssdp_loop_socket_t *entries,
+                                 ssdp_observer_cb_t *observer,
+                                 void **observer_arg) {
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  size_t count = ssdp_loop.socket_count;
+  for (size_t i = 0; i < count; i++) {
+    entries[i] = ssdp_loop.sockets[i];
+    socks[i] = entries[i].sock;
+  }
+  *observer = ssdp_loop.observer;
+  *observer_arg = ssdp_loop.observer_arg;
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return count;
+}
+
+static void ssdp_close_sockets() {
+  // Responses were bound to these sockets
+  ssdp_task_config->pending_count = 0;
+  ssdp_task_config->retry_count = 0;
+  ssdp_update_tx_depth();
+  ssdp_relay_close();
+  if (multicast_socket >= 0) {
+    ssdp_platform->close(ssdp_platform->ctx, multicast_socket);
+    multicast_socket = -1;
+  }
+  if (unicast_socket >= 0) {
+    ssdp_platform->close(ssdp_platform->ctx, unicast_socket);
+    unicast_socket = -1;
+  }
+}
+
+static uint32_t ssdp_next_backoff(uint32_t backoff) {
+  return backoff * 2 > SSDP_BACKOFF_MAX ? SSDP_BACKOFF_MAX : backoff * 2;
+}
+
+// One pass of the responder: the sockets follow the link, what is due is
+// sent and the sockets are read, waiting at most wait_max ms for them. The
+// state between two passes lives in ssdp_task_config
+void ssdp_step(uint32_t wait_max) {
+  uint64_t now = ssdp_millis();
+  if (!ssdp_task_config->link_up || now < ssdp_task_config->reopen_time) {
+    // No socket: nothing to do until an interface has an address or the
+    // backoff after a failure expires. IP events end the wait, the timeout
+    // only covers a missing default event loop and the registered timers
+    uint64_t timeout = ssdp_task_config->link_up
+                           ? ssdp_task_config->reopen_time - now
+                           : SSDP_BACKOFF_MAX;
+    uint64_t timer_delay = ssdp_loop_run_timers(now);
+    if (timer_delay < timeout) {
+      timeout = timer_delay;
+    }
+    ssdp_task_config->deadline = now + timeout;
+    uint32_t events =
+        ssdp_wait_events(timeout < wait_max ? timeout : wait_max);
+    if (!ssdp_task_config->link_up || (events & SSDP_TASK_BIT_IP_DOWN)) {
+      ssdp_task_config->link_up = ssdp_has_ip();
+    }
     return;
   }
+  if (multicast_socket < 0) {
+    multicast_socket = ssdp_platform->open(ssdp_platform->ctx, SSDP_PORT,
+                                           true, ssdp_task_config->ttl);
+    if (multicast_socket < 0) {
+      ESP_LOGE(TAG, "Failed to create IPv4 multicast socket, retry in %u ms",
+               ssdp_task_config->backoff);
+      ssdp_task_config->reopen_time = now + ssdp_task_config->backoff;
+      ssdp_task_config->backoff = ssdp_next_backoff(ssdp_task_config->backoff);
+      return;
+    }
+    if (ssdp_task_config->search_port) {
+      // Searches still work through multicast if this one fails
+      unicast_socket = ssdp_platform->open(
+          ssdp_platform->ctx, ssdp_task_config->search_port, false, 0);
+    }
+    ssdp_task_config->backoff = SSDP_BACKOFF_MIN;
+    ssdp_task_config->joined = true;
+    ssdp_render_tail();
+    ssdp_task_config->relay_count =
+        ssdp_relay_open(multicast_socket, ssdp_task_config->relay_sockets);
+  } else if (!ssdp_task_config->joined) {
+    // Back on the network with the socket kept open
+    ssdp_task_config->joined =
+        ssdp_platform->set_membership(ssdp_platform->ctx, multicast_socket,
+                                      true) >= 0;
+    ssdp_render_tail();
+    // The relay sockets are bound to the interface addresses
+    ssdp_task_config->relay_count =
+        ssdp_relay_open(multicast_socket, ssdp_task_config->relay_sockets);
+    ssdp_restart_announcements(ssdp_millis(),
+                               ssdp_task_config->startup_delay_max);
+  }
 
-  int result = snprintf(
-      msg_buffer, msg_buffer_size, SSDP_PACKET_TEMPLATE,
-      ((method == NONE) ? SSDP_RESPONSE_TEMPLATE : SSDP_NOTIFY_TEMPLATE),
-      ssdp_task_config->interval,
-      ssdp_task_config->server_name ? ssdp_task_config->server_name : "",
-      ssdp_task_config->model_name ? ssdp_task_config->model_name : "",
-      ssdp_task_config->model_number ? ssdp_task_config->model_number : "",
-      ssdp_task_config->uuid ? ssdp_task_config->uuid : "",
-      ssdp_task_config->usn_suffix, (method == NONE) ? "ST" : "NT",
-      ssdp_task_config->respond_type, ssdp_get_LocalIP(),
-      ssdp_task_config->port,
-      ssdp_task_config->schema_url ? ssdp_task_config->schema_url : "");
-  ESP_LOGI(TAG, "sprintf result: %d", result);
-  if (result < 0) {
-    ESP_LOGE(TAG, "Error not enough memory for msg_buffer creation");
-  }
-
-  ESP_LOGI(TAG, "*************************TX*************************");
-  ESP_LOGI(TAG, "%s", msg_buffer);
-  ESP_LOGI(TAG, "****************************************************");
-
-  struct addrinfo hints = {
-      .ai_flags = AI_PASSIVE,
-      .ai_socktype = SOCK_DGRAM,
+  // Wake up for the next announcement or search response if it is due
+  // before select timeout
+  now = ssdp_millis();
+  uint64_t timeout = ssdp_send_due_replies(now);
+  uint64_t retry_delay = ssdp_send_retries(now);
+  if (retry_delay < timeout) {
+    timeout = retry_delay;
+  }
+  if (timeout > SSDP_SELECT_TIMEOUT) {
+    timeout = SSDP_SELECT_TIMEOUT;
+  }
+  if (ssdp_task_config->notify_time <= now) {
+    timeout = 0;
+  } else if (ssdp_task_config->notify_time - now < timeout) {
+    timeout = ssdp_task_config->notify_time - now;
+  }
+  uint32_t gena_delay = ssdp_gena_poll(now);
+  if (gena_delay < timeout) {
+    timeout = gena_delay;
+  }
+  uint64_t timer_delay = ssdp_loop_run_timers(now);
+  if (timer_delay < timeout) {
+    timeout = timer_delay;
+  }
+  ssdp_task_config->deadline = now + timeout;
+  if (timeout > wait_max) {
+    timeout = wait_max;
+  }
+  int socks[SSDP_SOCKET_MAX] = {multicast_socket};
+  bool ready[SSDP_SOCKET_MAX] = {false};
+  size_t sock_count = 1;
+  if (unicast_socket >= 0) {
+    socks[sock_count++] = unicast_socket;
+  }
+  // Responses to the searches forwarded by the relay
+  size_t relay_first = sock_count;
+  for (size_t i = 0; i < ssdp_task_config->relay_count; i++) {
+    socks[sock_count++] = ssdp_task_config->relay_sockets[i];
+  }
+  // Then the ones of the other protocols sharing the task
+  size_t loop_first = sock_count;
+  ssdp_loop_socket_t loop_sockets[SSDP_LOOP_SOCKETS_MAX];
+  ssdp_observer_cb_t observer;
+  void *observer_arg;
+  sock_count += ssdp_loop_snapshot(&socks[loop_first], loop_sockets,
+                                   &observer, &observer_arg);
+
+  bool rebuild = false;
+  int rebuild_error = 0;
+  int s = ssdp_platform->wait(ssdp_platform->ctx, socks, ready, sock_count,
+                              timeout);
+  if (!ssdp_running) {
+    return;
+  }
+  if (s < 0) {
+    ESP_LOGE(TAG, "Select failed: errno %d", errno);
+    rebuild = !ssdp_transient_error(errno);
+    rebuild_error = errno;
+  } else if (s > 0) {
+    for (size_t i = 0; i < sock_count; i++) {
+      if (!ready[i]) {
+        continue;
+      }
+      if (i >= loop_first) {
+        // The protocol reads its own socket
+        const ssdp_loop_socket_t *entry = &loop_sockets[i - loop_first];
+        entry->callback(entry->sock, entry->arg);
+        continue;
+      }
+      uint32_t remote_addr = 0;
+      uint16_t remote_port = 0;
+      int len = ssdp_platform->recv(
+          ssdp_platform->ctx, socks[i], ssdp_task_config->datagram_buffer,
+          SSDP_DATAGRAM_SIZE - 1, &remote_addr, &remote_port);
+      int64_t received = ssdp_trace_now();
+      bool unicast = socks[i] == unicast_socket;
+      if (i >= relay_first) {
+        if (len > 0) {
+          ssdp_relay_receive(socks[i], ssdp_task_config->datagram_buffer, len,
+                             ssdp_millis());
+        }
+        continue;
+      }
+      if (len > 0) {
+        // Null-terminate whatever we received and treat like a string...
+        ssdp_task_config->datagram_buffer[len] = 0;
+      }
+      if (len > 0 && observer) {
+        // Every datagram, before the source filter, read in place
+        observer(ssdp_task_config->datagram_buffer, len, remote_addr,
+                 remote_port, observer_arg);
+      }
+#if CONFIG_SSDP_CAPTURE
+      if (len > 0) {
+        const ssdp_iovec_t payload = {ssdp_task_config->datagram_buffer,
+                                      (size_t)len};
+        uint32_t dst = ssdp_task_config->local_addr;
+        if (i == 0) {
+          inet_aton(SSDP_MULTICAST_ADDR, &dst);
+        }
+        ssdp_capture_packet(remote_addr, remote_port, dst,
+                            htons(i == 0 ? SSDP_PORT
+                                         : ssdp_task_config->search_port),
+                            &payload, 1);
+      }
+#endif
+      if (len < 0) {
+        ESP_LOGE(TAG, "%s recvfrom failed: errno %d",
+                 unicast ? "unicast" : "multicast", errno);
+        // The unicast socket is optional, only multicast errors rebuild
+        if (i == 0 && !ssdp_transient_error(errno)) {
+          rebuild = true;
+          rebuild_error = errno;
+        }
+      } else if (len > 0 && !ssdp_source_allowed(remote_addr)) {
+        ESP_LOGD(TAG, "Filtered datagram from %s",
+                 ip4addr_ntoa((const ip4_addr_t *)&remote_addr));
+      } else if (len > 0) {
+        // The relay forwards searches between the AP and STA sides and
+        // drops its own, then we answer like any device of the network
+        if (unicast ||
+            ssdp_relay_packet(ssdp_task_config->datagram_buffer, len,
+                              remote_addr, remote_port, ssdp_millis())) {
+          // Answer from the socket the search came to
+          onPacket(socks[i], remote_addr, remote_port,
+                   ssdp_task_config->datagram_buffer, len, unicast, received);
+        }
+      }
+    }
+  }
+  if (rebuild) {
+    ESP_LOGE(TAG, "Shutting down socket and restarting in %u ms...",
+             ssdp_task_config->backoff);
+    ssdp_close_sockets();
+    if (SSDP_EVENT_ENABLED(SSDP_EVENT_SOCKET_RESTARTED)) {
+      const ssdp_event_socket_t event = {
+          .error = rebuild_error,
+          .retry_ms = ssdp_task_config->backoff,
+      };
+      ssdp_event_post(SSDP_EVENT_SOCKET_RESTARTED, &event, sizeof(event));
+    }
+    ssdp_task_config->reopen_time = ssdp_millis() + ssdp_task_config->backoff;
+    ssdp_task_config->backoff = ssdp_next_backoff(ssdp_task_config->backoff);
+    return;
+  }
+
+  now = ssdp_millis();
+  if (now >= ssdp_task_config->notify_time) {
+    bool burst_done = ssdp_task_config->burst_remaining == 0;
+    ssdp_schedule_notify(now);
+    ESP_LOGI(TAG, "SSDP: notify...\n");
+    const ssdp_reply_t notify = {
+        .sock = multicast_socket,
+        .target = SSDP_TARGET_ALL,
+    };
+    ssdp_send(NOTIFY, notify);
+    if (SSDP_EVENT_ENABLED(SSDP_EVENT_NOTIFY_SENT)) {
+      const ssdp_event_notify_t event = {
+          .datagrams = ssdp_task_config->target_count,
+          .next_ms = ssdp_task_config->notify_time - now,
+      };
+      ssdp_event_post(SSDP_EVENT_NOTIFY_SENT, &event, sizeof(event));
+    }
+    if (burst_done && ssdp_task_config->warm_dirty) {
+      // The flash write waits for the last NOTIFY of the startup burst
+      ssdp_task_config->warm_dirty = false;
+      ssdp_warm_persist();
+    }
+  }
+
+  // Membership follows the interface address without rebuilding the socket
+  uint32_t events = ssdp_wait_events(0);
+  if (events & SSDP_TASK_BIT_IP_DOWN) {
+    ssdp_task_config->link_up = ssdp_has_ip();
+    if (!ssdp_task_config->link_up) {
+      ESP_LOGI(TAG, "No IP address, leaving multicast group");
+      ssdp_platform->set_membership(ssdp_platform->ctx, multicast_socket,
+                                    false);
+      ssdp_task_config->joined = false;
+    }
+  }
+  if (ssdp_task_config->link_up && (events & SSDP_TASK_BIT_IP_UP)) {
+    // The address may have changed, join again through the new one
+    ssdp_platform->set_membership(ssdp_platform->ctx, multicast_socket, false);
+    ssdp_task_config->joined = false;
+  }
+  if (events & SSDP_TASK_BIT_NOTIFY_NOW) {
+    ssdp_task_config->notify_time = now;
+  }
+}
+
+void ssdp_running_task(void *pvParameters) {
+  ESP_LOGI(TAG, "Starting ssdp_running_task");
+  while (ssdp_running) {
+    ssdp_step(UINT32_MAX);
+  }
+  // ssdp_stop() frees the configuration once this is given
+  xSemaphoreGive(ssdp_task_exited);
+  vTaskDelete(NULL);
+}
+
+void ssdp_set_UUID(char **uuid, const char *root_uid) {
+  uint8_t mac[6];
+  esp_err_t err = esp_efuse_mac_get_default((uint8_t *)&mac);
+  if (ESP_OK != err) {
+    memset(mac, 0, 6);
+    ESP_LOGW(TAG, "Not able to read MAC address, use 000000");
+  }
+
+  sprintf(*uuid, "%s%02x%02x%02x", root_uid, mac[2], mac[1], mac[0]);
+}
+
+static uint32_t ssdp_hash_str(uint32_t hash, const char *str) {
+  // FNV-1a, the terminating zero is hashed to separate the fields
+  if (str) {
+    for (; *str; str++) {
+      hash = (hash ^ (uint8_t)*str) * 16777619UL;
+    }
+  }
+  return hash * 16777619UL;
+}
+
+// FNV-1a of the lower case NT, tools/ssdp_manifest.py computes the same
+uint32_t ssdp_hash_nt(const char *nt, size_t len) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)tolower((unsigned char)nt[i])) * 16777619UL;
+  }
+  return hash;
+}
+
+// Hash of everything published in the description, a change of it is a
+// new configuration for control points
+static uint32_t ssdp_config_hash() {
+  uint32_t hash = 2166136261UL;
+  const char *fields[] = {
+      ssdp_task_config->uuid,
+      ssdp_task_config->schema_url,
+      ssdp_task_config->device_type,
+      ssdp_task_config->friendly_name,
+      ssdp_task_config->serial_number,
+      ssdp_task_config->presentation_url,
+      ssdp_task_config->manufacturer_name,
+      ssdp_task_config->manufacturer_url,
+      ssdp_task_config->model_name,
+      ssdp_task_config->model_url,
+      ssdp_task_config->model_number,
+      ssdp_task_config->model_description,
+      ssdp_task_config->services_description,
+      ssdp_task_config->icons_description,
   };
-  struct addrinfo *res;
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    hash = ssdp_hash_str(hash, fields[i]);
+  }
+  return hash ^ ssdp_task_config->port;
+}
 
-  hints.ai_family = AF_INET;  // For an IPv4 socket
-  if (method == NONE) {
-    err = getaddrinfo(ip4addr_ntoa((const ip4_addr_t *)&remote_addr), NULL,
-                      &hints, &res);
-  } else {
-    err = getaddrinfo(SSDP_MULTICAST_ADDR, NULL, &hints, &res);
+// BOOTID.UPNP.ORG is increased at each start, CONFIGID.UPNP.ORG each time
+// the published configuration changes, both survive reboots in NVS
+static void ssdp_load_boot_state() {
+  const ssdp_manifest_t *manifest = ssdp_task_config->manifest;
+  const ssdp_warm_state_t *warm = ssdp_task_config->warm;
+  // Same configuration as the warm state, same hash: no need to compute it
+  uint32_t hash = manifest                       ? manifest->config_id
+                  : ssdp_task_config->warm_match ? warm->config_hash
+                                                 : ssdp_config_hash();
+  uint32_t stored_hash = 0;
+  nvs_handle_t handle;
+  ssdp_task_config->config_hash = hash;
+  // Without NVS still advertise valid values, stable for a configuration
+  ssdp_task_config->boot_id = 1;
+  ssdp_task_config->config_id = hash & SSDP_CONFIGID_MAX;
+  esp_err_t err = nvs_open(SSDP_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "NVS not available for boot id: %s", esp_err_to_name(err));
+    return;
   }
-  if (res == 0 || err < 0) {
-    if (err < 0) {
-      ESP_LOGE(TAG,
-               "getaddrinfo() failed for IPV4 destination address. error: %d",
-               err);
-    } else {
-      ESP_LOGE(TAG, "getaddrinfo() did not return any addresses");
+  if (nvs_get_u32(handle, "bootid", &ssdp_task_config->boot_id) == ESP_OK) {
+    ssdp_task_config->boot_id = (ssdp_task_config->boot_id + 1) & 0x7FFFFFFF;
+  }
+  // A manifest bakes its CONFIGID in the description, nothing to track
+  if (!manifest && nvs_get_u32(handle, "cfghash", &stored_hash) == ESP_OK &&
+      nvs_get_u32(handle, "configid", &ssdp_task_config->config_id) ==
+          ESP_OK) {
+    if (stored_hash != hash) {
+      ssdp_task_config->config_id =
+          (ssdp_task_config->config_id + 1) & SSDP_CONFIGID_MAX;
     }
-    free(msg_buffer);
-    xSemaphoreGive(ssdp_send_xSemaphore);
+  }
+  // Committed before the first announcement, warm start or not
+  nvs_set_u32(handle, "bootid", ssdp_task_config->boot_id);
+  if (!manifest) {
+    nvs_set_u32(handle, "cfghash", hash);
+    nvs_set_u32(handle, "configid", ssdp_task_config->config_id);
+  }
+  err = nvs_commit(handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to save boot id: %s", esp_err_to_name(err));
+  }
+  nvs_close(handle);
+  ESP_LOGI(TAG, "BOOTID %u, CONFIGID %u", ssdp_task_config->boot_id,
+           ssdp_task_config->config_id);
+}
+
+// Hash of everything the warm state is rendered from: the uuid settings,
+// the description, the port and the MAC address
+static uint32_t ssdp_warm_key(const ssdp_config_t *configuration) {
+  uint32_t hash = 2166136261UL;
+  const char *fields[] = {
+      configuration->uuid_root,
+      configuration->uuid,
+      configuration->schema_url,
+      configuration->device_type,
+      configuration->friendly_name,
+      configuration->serial_number,
+      configuration->presentation_url,
+      configuration->manufacturer_name,
+      configuration->manufacturer_url,
+      configuration->model_name,
+      configuration->model_url,
+      configuration->model_number,
+      configuration->model_description,
+      configuration->services_description,
+      configuration->icons_description,
+  };
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    hash = ssdp_hash_str(hash, fields[i]);
+  }
+  for (size_t i = 0; i < configuration->service_count; i++) {
+    const ssdp_service_t *service = &configuration->services[i];
+    hash = ssdp_hash_str(hash, service->type);
+    hash = ssdp_hash_str(hash, service->id);
+    hash = ssdp_hash_str(hash, service->scpd_url);
+    hash = ssdp_hash_str(hash, service->control_url);
+    hash = ssdp_hash_str(hash, service->event_url);
+  }
+  for (size_t i = 0; i < configuration->icon_count; i++) {
+    const ssdp_icon_t *icon = &configuration->icons[i];
+    hash = ssdp_hash_str(hash, icon->mime_type);
+    hash = ssdp_hash_str(hash, icon->url);
+    hash = (hash ^ ((uint32_t)icon->width << 16 | icon->height)) * 16777619UL;
+    hash = (hash ^ icon->depth) * 16777619UL;
+  }
+  // A state copied to another board with the NVS image must not give it the
+  // uuid of the first one
+  uint8_t mac[6] = {0};
+  esp_efuse_mac_get_default(mac);
+  for (size_t i = 0; i < sizeof(mac); i++) {
+    hash = (hash ^ mac[i]) * 16777619UL;
+  }
+  return hash ^ configuration->port;
+}
+
+// State of the previous start, its layout is checked before anything in it
+// is used. It is kept only when the configuration is the same, otherwise it
+// is written again once this start is announced
+static void ssdp_warm_restore() {
+  size_t len = 0;
+  ssdp_task_config->warm_dirty = true;
+  ssdp_warm_state_t *warm = (ssdp_warm_state_t *)ssdp_warm_load(&len);
+  if (!warm) {
     return;
   }
-  if (method == NONE) {
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = remote_port;
-  } else {
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = htons(SSDP_PORT);
+  size_t lines_offset = sizeof(ssdp_warm_state_t);
+  size_t lines_len = 0;
+  bool valid = len >= sizeof(ssdp_warm_state_t) &&
+               warm->target_count >= SSDP_TARGET_SERVICES &&
+               memchr(warm->uuid, 0, sizeof(warm->uuid)) != NULL;
+  if (valid) {
+    lines_offset += warm->target_count * sizeof(ssdp_warm_target_t);
+    valid = lines_offset <= len && len - lines_offset == warm->lines_len;
+  }
+  const ssdp_warm_target_t *targets = (const ssdp_warm_target_t *)(warm + 1);
+  for (size_t i = 0; valid && i < warm->target_count; i++) {
+    lines_len += targets[i].line_len + 1;
+    valid = targets[i].nt_len < targets[i].line_len &&
+            lines_len <= warm->lines_len &&
+            ((const char *)warm)[lines_offset + lines_len - 1] == 0;
   }
+  if (!valid || lines_len != warm->lines_len) {
+    ESP_LOGW(TAG, "Warm state layout not recognized");
+    ssdp_free(warm);
+    return;
+  }
+  if (warm->key != ssdp_task_config->warm_key) {
+    ESP_LOGD(TAG, "Configuration changed since the warm state");
+    ssdp_free(warm);
+    return;
+  }
+  ssdp_task_config->warm = warm;
+  ssdp_task_config->warm_match = true;
+  ssdp_task_config->warm_dirty = false;
+}
 
-  ESP_LOGI(TAG, "Sending to IPV4 multicast address %s:%d...",
-           ip4addr_ntoa((const ip4_addr_t *)&remote_addr), remote_port);
+// Targets of the warm state, the lines stay in its buffer
+static esp_err_t ssdp_warm_targets() {
+  const ssdp_warm_state_t *warm = ssdp_task_config->warm;
+  ssdp_task_config->target_buffer = (ssdp_target_t *)ssdp_calloc(
+      SSDP_ALLOC_START, warm->target_count, sizeof(ssdp_target_t));
+  if (!ssdp_task_config->target_buffer) {
+    ESP_LOGE(TAG, "No enough memory for ssdp targets");
+    return ESP_ERR_NO_MEM;
+  }
+  ssdp_task_config->targets = ssdp_task_config->target_buffer;
+  const ssdp_warm_target_t *entry = (const ssdp_warm_target_t *)(warm + 1);
+  const char *line = (const char *)(entry + warm->target_count);
+  for (size_t i = 0; i < warm->target_count; i++) {
+    ssdp_target_t *target = &ssdp_task_config->target_buffer[i];
+    target->nt = line;
+    target->line = line;
+    target->nt_len = entry[i].nt_len;
+    target->line_len = entry[i].line_len;
+    target->hash = entry[i].hash;
+    line += entry[i].line_len + 1;
+  }
+  ssdp_task_config->target_count = warm->target_count;
+  return ESP_OK;
+}
 
-  err = sendto(sock, msg_buffer, strlen(msg_buffer), 0, res->ai_addr,
-               res->ai_addrlen);
-  freeaddrinfo(res);
-  if (err < 0) {
-    ESP_LOGE(TAG, "IPV4 sendto failed. errno: %d", errno);
-  } else {
+// Save this start for the next one, from the task once the startup burst is
+// sent, only when the configuration changed
+static void ssdp_warm_persist() {
+  size_t lines_len = 0;
+  for (size_t i = 0; i < ssdp_task_config->target_count; i++) {
+    lines_len += ssdp_task_config->targets[i].line_len + 1;
+  }
+  size_t len = sizeof(ssdp_warm_state_t) +
+               ssdp_task_config->target_count * sizeof(ssdp_warm_target_t) +
+               lines_len;
+  ssdp_warm_state_t *warm =
+      (ssdp_warm_state_t *)ssdp_calloc(SSDP_ALLOC_START, 1, len);
+  if (!warm) {
+    ESP_LOGW(TAG, "No enough memory to save the warm state");
+    return;
+  }
+  warm->key = ssdp_task_config->warm_key;
+  warm->config_hash = ssdp_task_config->config_hash;
+  strncpy(warm->uuid, ssdp_task_config->uuid, sizeof(warm->uuid) - 1);
+  warm->target_count = ssdp_task_config->target_count;
+  warm->lines_len = lines_len;
+  ssdp_warm_target_t *entry = (ssdp_warm_target_t *)(warm + 1);
+  char *line = (char *)(entry + warm->target_count);
+  for (size_t i = 0; i < ssdp_task_config->target_count; i++) {
+    const ssdp_target_t *target = &ssdp_task_config->targets[i];
+    entry[i].nt_len = target->nt_len;
+    entry[i].line_len = target->line_len;
+    entry[i].hash = target->hash;
+    memcpy(line, target->line, target->line_len);
+    line += target->line_len + 1;
+  }
+  ssdp_warm_save(warm, len);
+  ssdp_free(warm);
+}
+
+static void ssdp_ip_event_handler(void *arg, esp_event_base_t event_base,
+                                  int32_t event_id, void *event_data) {
+  uint32_t events = 0;
+  switch (event_id) {
+    case IP_EVENT_STA_GOT_IP:
+    case IP_EVENT_ETH_GOT_IP:
+      events = SSDP_TASK_BIT_IP_UP;
+      break;
+    case IP_EVENT_STA_LOST_IP:
+    case IP_EVENT_ETH_LOST_IP:
+      events = SSDP_TASK_BIT_IP_DOWN;
+      break;
+    default:
+      return;
+  }
+  ssdp_post_events(events);
+}
+
+// Targets advertised by NOTIFY and answered to searches, in this order:
+// root device, device uuid, device type, then every service type
+static esp_err_t ssdp_add_target(const char *nt, size_t nt_len) {
+  ssdp_target_t *target =
+      &ssdp_task_config->target_buffer[ssdp_task_config->target_count];
+  bool is_uuid = nt_len > 5 && strncmp(nt, "uuid:", 5) == 0;
+  size_t line_size = strlen(SSDP_TARGET_TEMPLATE) + nt_len * 2 +
+                     strlen(ssdp_task_config->uuid) + 1;
+  char *line = (char *)ssdp_calloc(SSDP_ALLOC_START, line_size, sizeof(char));
+  if (!line) {
+    ESP_LOGE(TAG, "No enough memory for ssdp targets");
+    return ESP_ERR_NO_MEM;
+  }
+  target->line = line;
+  int len = snprintf(line, line_size, SSDP_TARGET_TEMPLATE, (int)nt_len, nt,
+                     ssdp_task_config->uuid, is_uuid ? "" : "::",
+                     is_uuid ? 0 : (int)nt_len, nt);
+  if (len < 0 || (size_t)len >= line_size) {
+    return ESP_FAIL;
+  }
+  target->nt = line;
+  target->nt_len = nt_len;
+  target->line_len = len;
+  target->hash = ssdp_hash_nt(nt, nt_len);
+  ssdp_task_config->target_count++;
+  return ESP_OK;
+}
+
+// Several instances of a service type are announced once
+static esp_err_t ssdp_add_service_target(const char *type, size_t len) {
+  const ssdp_view_t view = {type, len};
+  if (ssdp_match_target(&view) != SSDP_TARGET_NONE) {
+    return ESP_OK;
+  }
+  return ssdp_add_target(type, len);
+}
+
+// Manifest whose uuid is only known at runtime: the lines are rendered from
+// the NT of the manifest
+static esp_err_t ssdp_build_manifest_targets() {
+  const ssdp_manifest_t *manifest = ssdp_task_config->manifest;
+  ssdp_task_config->target_buffer = (ssdp_target_t *)ssdp_calloc(
+      SSDP_ALLOC_START, manifest->target_count, sizeof(ssdp_target_t));
+  if (!ssdp_task_config->target_buffer) {
+    ESP_LOGE(TAG, "No enough memory for ssdp targets");
+    return ESP_ERR_NO_MEM;
+  }
+  ssdp_task_config->targets = ssdp_task_config->target_buffer;
+  char uuid_nt[SSDP_UUID_SIZE + 6];
+  snprintf(uuid_nt, sizeof(uuid_nt), "uuid:%s", ssdp_task_config->uuid);
+  esp_err_t err = ESP_OK;
+  for (size_t i = 0; err == ESP_OK && i < manifest->target_count; i++) {
+    const char *nt =
+        manifest->targets[i].nt ? manifest->targets[i].nt : uuid_nt;
+    err = ssdp_add_target(nt, strlen(nt));
+  }
+  return err;
+}
+
+static esp_err_t ssdp_build_targets() {
+  const ssdp_manifest_t *manifest = ssdp_task_config->manifest;
+  if (manifest && manifest->uuid) {
+    // Everything is in flash, nothing to build
+    ssdp_task_config->targets = manifest->targets;
+    ssdp_task_config->target_count = manifest->target_count;
+    ssdp_task_config->st_table = manifest->st_table;
+    ssdp_task_config->st_mask = manifest->st_mask;
+    return ESP_OK;
+  }
+  if (manifest) {
+    return ssdp_build_manifest_targets();
+  }
+  if (ssdp_task_config->warm) {
+    return ssdp_warm_targets();
+  }
+  static const char service_tag[] = "<serviceType>";
+  static const char service_end_tag[] = "</serviceType>";
+  size_t services = ssdp_task_config->service_count;
+  // Typed services need no XML scanning
+  const char *services_xml = ssdp_task_config->services
+                                 ? NULL
+                                 : ssdp_task_config->services_description;
+  for (const char *p = services_xml; p && (p = strstr(p, service_tag));
+       p += strlen(service_tag)) {
+    services++;
+  }
+  ssdp_task_config->target_buffer = (ssdp_target_t *)ssdp_calloc(
+      SSDP_ALLOC_START, SSDP_TARGET_SERVICES + services, sizeof(ssdp_target_t));
+  if (!ssdp_task_config->target_buffer) {
+    ESP_LOGE(TAG, "No enough memory for ssdp targets");
+    return ESP_ERR_NO_MEM;
+  }
+  ssdp_task_config->targets = ssdp_task_config->target_buffer;
+  char uuid_nt[SSDP_UUID_SIZE + 6];
+  char device_nt[SSDP_DEVICE_TYPE_SIZE + 32];
+  snprintf(uuid_nt, sizeof(uuid_nt), "uuid:%s", ssdp_task_config->uuid);
+  snprintf(device_nt, sizeof(device_nt), "urn:schemas-upnp-org:device:%s:1",
+           ssdp_task_config->device_type ? ssdp_task_config->device_type : "");
+  esp_err_t err = ssdp_add_target("upnp:rootdevice", strlen("upnp:rootdevice"));
+  if (err == ESP_OK) {
+    err = ssdp_add_target(uuid_nt, strlen(uuid_nt));
   }
+  if (err == ESP_OK) {
+    err = ssdp_add_target(device_nt, strlen(device_nt));
+  }
+  for (size_t i = 0; err == ESP_OK && i < ssdp_task_config->service_count;
+       i++) {
+    const char *type = ssdp_task_config->services[i].type;
+    err = ssdp_add_service_target(type, strlen(type));
+  }
+  // Service types are only read once from the services description
+  const char *p = services_xml;
+  while (err == ESP_OK && p && (p = strstr(p, service_tag))) {
+    p += strlen(service_tag);
+    const char *end = strstr(p, service_end_tag);
+    if (!end) {
+      break;
+    }
+    err = ssdp_add_service_target(p, end - p);
+    p = end;
+  }
+  return err;
+}
 
-  free(msg_buffer);
-  xSemaphoreGive(ssdp_send_xSemaphore);
+// Render the part of the packets depending on the IP address
+static void ssdp_render_tail() {
+  ssdp_task_config->local_addr = ssdp_platform->local_ip(ssdp_platform->ctx);
+  int len = snprintf(
+      ssdp_task_config->tail, ssdp_task_config->tail_size,
+      SSDP_PACKET_TEMPLATE,
+      ssdp_task_config->server_name ? ssdp_task_config->server_name : "",
+      ssdp_task_config->model_name ? ssdp_task_config->model_name : "",
+      ssdp_task_config->model_number ? ssdp_task_config->model_number : "",
+      ssdp_get_LocalIP(), ssdp_task_config->port,
+      ssdp_task_config->schema_url ? ssdp_task_config->schema_url : "",
+      ssdp_task_config->boot_id, ssdp_task_config->config_id,
+      ssdp_task_config->search_port_header);
+  if (len < 0 || (size_t)len >= ssdp_task_config->tail_size) {
+    ESP_LOGE(TAG, "Error rendering packets");
+    len = 0;
+  }
+  ssdp_task_config->tail_len = len;
+}
+
+static esp_err_t ssdp_build_packets() {
+  snprintf(ssdp_task_config->response_head, SSDP_HEAD_SIZE,
+           SSDP_RESPONSE_TEMPLATE, ssdp_task_config->max_age);
+  snprintf(ssdp_task_config->notify_head, SSDP_HEAD_SIZE, SSDP_NOTIFY_TEMPLATE,
+           ssdp_task_config->max_age);
+  ssdp_task_config->tail_size =
+      strlen(SSDP_PACKET_TEMPLATE) +
+      (ssdp_task_config->server_name ? strlen(ssdp_task_config->server_name)
+                                     : 0) +
+      (ssdp_task_config->model_name ? strlen(ssdp_task_config->model_name)
+                                    : 0) +
+      (ssdp_task_config->model_number ? strlen(ssdp_task_config->model_number)
+                                      : 0) +
+      15 + 5  // IP, port
+      + (ssdp_task_config->schema_url ? strlen(ssdp_task_config->schema_url)
+                                      : 0) +
+      10 + 8  // boot_id, config_id
+      + strlen(ssdp_task_config->search_port_header) + 1;
+  ssdp_task_config->tail = (char *)ssdp_calloc(
+      SSDP_ALLOC_START, ssdp_task_config->tail_size, sizeof(char));
+  if (!ssdp_task_config->tail) {
+    ESP_LOGE(TAG, "No enough memory for ssdp packets");
+    return ESP_ERR_NO_MEM;
+  }
+  ssdp_render_tail();
+  return ssdp_build_targets();
+}
+
+// Copied as is into the description: no markup, not empty when required
+static bool ssdp_valid_text(const char *text, bool required) {
+  if (!text || !text[0]) {
+    return !required;
+  }
+  return strpbrk(text, "<>&") == NULL;
+}
+
+// Checked once at start, rendering and targets rely on it afterwards
+static esp_err_t ssdp_validate_services(const ssdp_config_t *configuration) {
+  if ((configuration->service_count && !configuration->services) ||
+      (configuration->icon_count && !configuration->icons)) {
+    ESP_LOGE(TAG, "Missing services or icons array");
+    return ESP_ERR_INVALID_ARG;
+  }
+  if ((configuration->service_count && configuration->services_description) ||
+      (configuration->icon_count && configuration->icons_description)) {
+    ESP_LOGE(TAG, "Typed and raw XML services or icons are exclusive");
+    return ESP_ERR_INVALID_ARG;
+  }
+  for (size_t i = 0; i < configuration->service_count; i++) {
+    const ssdp_service_t *service = &configuration->services[i];
+    if (!ssdp_valid_text(service->type, true) ||
+        strncmp(service->type, "urn:", 4) != 0 ||
+        !strstr(service->type, ":service:") ||
+        !ssdp_valid_text(service->id, true) ||
+        !ssdp_valid_text(service->scpd_url, true) ||
+        !ssdp_valid_text(service->control_url, true) ||
+        !ssdp_valid_text(service->event_url, false)) {
+      ESP_LOGE(TAG, "Invalid service %u", (unsigned)i);
+      return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (strcmp(configuration->services[j].id, service->id) == 0) {
+        ESP_LOGE(TAG, "Duplicate serviceId %s", service->id);
+        return ESP_ERR_INVALID_ARG;
+      }
+    }
+  }
+  for (size_t i = 0; i < configuration->icon_count; i++) {
+    const ssdp_icon_t *icon = &configuration->icons[i];
+    if (!ssdp_valid_text(icon->mime_type, true) ||
+        !strchr(icon->mime_type, '/') || !ssdp_valid_text(icon->url, true) ||
+        !icon->width || !icon->height || !icon->depth) {
+      ESP_LOGE(TAG, "Invalid icon %u", (unsigned)i);
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+  return ESP_OK;
 }
 
-void ssdp_running_task(void *pvParameters) {
-  ESP_LOGI(TAG, "Starting ssdp_running_task");
-  ssdp_running = true;
-  while (ssdp_running) {
-    multicast_socket = create_multicast_ipv4_socket();
-    if (multicast_socket < 0) {
-      ESP_LOGE(TAG, "Failed to create IPv4 multicast socket");
+// The first pass sizes the list, the second one renders it
+static char *ssdp_render_services(const ssdp_service_t *services,
+                                  size_t count) {
+  char *xml = NULL;
+  size_t size = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+      const ssdp_service_t *service = &services[i];
+      len += snprintf(xml ? xml + len : NULL, xml ? size - len : 0,
+                      SSDP_SERVICE_TEMPLATE, service->type, service->id,
+                      service->scpd_url, service->control_url,
+                      service->event_url ? service->event_url : "");
     }
-    if (multicast_socket < 0) {
-      // Nothing to do!
-      vTaskDelay(5 / portTICK_PERIOD_MS);
-      continue;
+    if (!xml) {
+      size = len + 1;
+      xml = (char *)ssdp_calloc(SSDP_ALLOC_START, size, sizeof(char));
+      if (!xml) {
+        return NULL;
+      }
     }
+  }
+  return xml;
+}
 
-    // set destination multicast addresses for sending from these sockets
-    struct sockaddr_in sdestv4 = {
-        .sin_family = PF_INET,
-        .sin_port = htons(SSDP_PORT),
-    };
-    // We know this inet_aton will pass because we did it above already
-    inet_aton(SSDP_MULTICAST_ADDR, &sdestv4.sin_addr.s_addr);  // s_addr = u32
-    // Loop waiting for UDP received, and sending UDP packets if we don't
-    // see any.
-    int err = 1;
-    while (err > 0) {
-      struct timeval tv = {
-          .tv_sec = 2,
-          .tv_usec = 0,
-      };
-      fd_set rfds;
-      FD_ZERO(&rfds);
-      FD_SET(multicast_socket, &rfds);
-
-      int s = select(multicast_socket + 1, &rfds, NULL, NULL, &tv);
-      if (s < 0) {
-        ESP_LOGE(TAG, "Select failed: errno %d", errno);
-        err = -1;
-        break;
-      } else if (s > 0) {
-        if (FD_ISSET(multicast_socket, &rfds)) {
-          // Incoming datagram received
-          struct sockaddr_storage raddr;
-          socklen_t socklen = sizeof(raddr);
-          // Read all the datagram at once, if over buffer the data will
-          // be discarded
-          int len = recvfrom(
-              multicast_socket, ssdp_task_config->datagram_buffer,
-              SSDP_DATAGRAM_SIZE - 1, 0, (struct sockaddr *)&raddr, &socklen);
-          if (len < 0) {
-            ESP_LOGE(TAG, "multicast recvfrom failed: errno %d", errno);
-            err = -1;
-            break;
-          }
-          if (raddr.ss_family == PF_INET) {
-            ssdp_task_config->datagram_buffer[len] =
-                0;  // Null-terminate whatever we received and treat
-                    // like a string...
-            uint16_t remote_port = ((struct sockaddr_in *)&raddr)->sin_port;
-            in_addr_t remote_addr =
-                ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
-            onPacket(multicast_socket, remote_addr, remote_port,
-                     ssdp_task_config->datagram_buffer, len);
-          }
-        }
-      }
-      if (ssdp_task_config) {
-        if ((ssdp_task_config->notify_time == 0) ||
-            (ssdp_millis() - ssdp_task_config->notify_time) >
-                (ssdp_task_config->interval * 1000L)) {
-          ssdp_task_config->notify_time = ssdp_millis();
-          ESP_LOGI(TAG, "SSDP: notify...\n");
-          ssdp_send(multicast_socket, NOTIFY, 0, 0);
-        }
+static char *ssdp_render_icons(const ssdp_icon_t *icons, size_t count) {
+  char *xml = NULL;
+  size_t size = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+      const ssdp_icon_t *icon = &icons[i];
+      len += snprintf(xml ? xml + len : NULL, xml ? size - len : 0,
+                      SSDP_ICON_TEMPLATE, icon->mime_type, icon->width,
+                      icon->height, icon->depth, icon->url);
+    }
+    if (!xml) {
+      size = len + 1;
+      xml = (char *)ssdp_calloc(SSDP_ALLOC_START, size, sizeof(char));
+      if (!xml) {
+        return NULL;
       }
     }
-    ESP_LOGE(TAG, "Shutting down socket and restarting...");
-    shutdown(multicast_socket, 0);
-    close(multicast_socket);
-    multicast_socket = -1;
   }
+  return xml;
+}
 
-  vTaskDelete(NULL);
+// Manifest with its uuid: targets and description are used from flash
+static bool ssdp_static_identity() {
+  return ssdp_task_config->manifest && ssdp_task_config->manifest->uuid;
 }
 
-void ssdp_set_UUID(char **uuid, const char *root_uid) {
-  uint8_t mac[6];
-  esp_err_t err = esp_efuse_mac_get_default((uint8_t *)&mac);
-  if (ESP_OK != err) {
-    memset(mac, 0, 6);
-    ESP_LOGW(TAG, "Not able to read MAC address, use 000000");
+static esp_err_t ssdp_use_manifest(const ssdp_config_t *configuration) {
+  const ssdp_manifest_t *manifest = configuration->manifest;
+  if (!manifest->description || !manifest->targets ||
+      manifest->target_count < SSDP_TARGET_SERVICES) {
+    ESP_LOGE(TAG, "Invalid manifest");
+    return ESP_ERR_INVALID_ARG;
   }
-
-  sprintf(*uuid, "%s%02x%02x%02x", root_uid, mac[2], mac[1], mac[0]);
+  ssdp_task_config->manifest = manifest;
+  // Never written nor freed, they stay in flash
+  ssdp_task_config->schema_url = (char *)manifest->schema_url;
+  ssdp_task_config->device_type = (char *)manifest->device_type;
+  ssdp_task_config->server_name = (char *)manifest->server_name;
+  ssdp_task_config->model_name = (char *)manifest->model_name;
+  ssdp_task_config->model_number = (char *)manifest->model_number;
+  if (manifest->uuid) {
+    if (strlen(manifest->uuid) >= SSDP_UUID_SIZE) {
+      ESP_LOGE(TAG, "Invalid manifest uuid");
+      return ESP_ERR_INVALID_ARG;
+    }
+    ssdp_task_config->uuid = (char *)manifest->uuid;
+    return ESP_OK;
+  }
+  // Each device of a fleet sharing the manifest gets its own uuid
+  ssdp_task_config->uuid = (char *)ssdp_calloc(
+      SSDP_ALLOC_START, SSDP_UUID_SIZE + 1, sizeof(char));
+  if (!ssdp_task_config->uuid) {
+    ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
+    return ESP_ERR_NO_MEM;
+  }
+  if (configuration->uuid_root &&
+      strlen(configuration->uuid_root) == strlen(SSDP_UUID_ROOT)) {
+    ssdp_set_UUID(&ssdp_task_config->uuid, configuration->uuid_root);
+  } else {
+    ssdp_set_UUID(&ssdp_task_config->uuid, SSDP_UUID_ROOT);
+  }
+  return ESP_OK;
 }
 
 /*
  * Global Functions
  */
 esp_err_t ssdp_init() {
-  if (!ssdp_send_xSemaphore) {
-    ssdp_send_xSemaphore = xSemaphoreCreateBinary();
-    if (!ssdp_send_xSemaphore) {
-      ESP_LOGE(TAG, "Error creating the send semaphore");
-      return ESP_ERR_NO_MEM;
-    }
-  }
-  if (!ssdp_on_packet_xSemaphore) {
-    ssdp_on_packet_xSemaphore = xSemaphoreCreateBinary();
-    if (!ssdp_on_packet_xSemaphore) {
-      ESP_LOGE(TAG, "Error creating the on packet semaphore");
-      return ESP_ERR_NO_MEM;
-    }
+  // Packets are only built and sent by the SSDP task, only the locks of its
+  // lifetime are needed
+  if (!ssdp_state_lock) {
+    ssdp_state_lock = xSemaphoreCreateMutexStatic(&ssdp_state_lock_buffer);
+    ssdp_task_exited = xSemaphoreCreateBinaryStatic(&ssdp_task_exited_buffer);
   }
+  ssdp_initialized = true;
+  return ESP_OK;
+}
 
-  xSemaphoreGive(ssdp_send_xSemaphore);
-  xSemaphoreGive(ssdp_on_packet_xSemaphore);
+esp_err_t ssdp_set_platform(const ssdp_platform_t *platform) {
+  if (ssdp_task_config) {
+    ESP_LOGE(TAG, "SSDP is already started.");
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (platform == NULL) {
+    ssdp_platform = &SSDP_DEFAULT_PLATFORM;
+    return ESP_OK;
+  }
+  if (!platform->millis || !platform->random || !platform->local_ip ||
+      !platform->open || !platform->set_membership || !platform->close ||
+      !platform->wait || !platform->recv || !platform->send) {
+    ESP_LOGE(TAG, "Incomplete platform.");
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (ssdp_loop.socket_count) {
+    // They would never be served
+    ESP_LOGE(TAG, "Sockets are registered with ssdp_loop_add_socket()");
+    return ESP_ERR_INVALID_STATE;
+  }
+  ssdp_platform = platform;
   return ESP_OK;
 }
 
 esp_err_t ssdp_start(ssdp_config_t *configuration) {
   esp_err_t err_start = ESP_OK;
-  if (!ssdp_send_xSemaphore) {
+  if (!ssdp_initialized) {
     ESP_LOGE(TAG, "SSDP not initialized");
     return ESP_ERR_INVALID_STATE;
   }
@@ -754,11 +2209,30 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     ESP_LOGE(TAG, "SSDP already started");
     return ESP_ERR_INVALID_STATE;
   }
+  if (configuration->allowed_source_count > SSDP_FILTER_MAX ||
+      configuration->denied_source_count > SSDP_FILTER_MAX ||
+      (configuration->allowed_source_count &&
+       !configuration->allowed_sources) ||
+      (configuration->denied_source_count && !configuration->denied_sources)) {
+    ESP_LOGE(TAG, "At most %d subnets per source list", SSDP_FILTER_MAX);
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (configuration->relay && ssdp_platform != &SSDP_DEFAULT_PLATFORM) {
+    ESP_LOGE(TAG, "The relay needs the lwIP sockets of the default platform");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+#if !CONFIG_SSDP_WARM_START
+  if (configuration->warm_start) {
+    ESP_LOGE(TAG, "warm_start needs CONFIG_SSDP_WARM_START");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+#endif
   ESP_LOGI(TAG, "SSDP basic sanity check done");
 
   // Create task configuration workplace
   ssdp_task_config =
-      (ssdp_task_config_t *)calloc(1, sizeof(ssdp_task_config_t));
+      (ssdp_task_config_t *)ssdp_calloc(SSDP_ALLOC_START, 1,
+                                        sizeof(ssdp_task_config_t));
   if (!ssdp_task_config) {
     ESP_LOGE(TAG, "No enough memory for ssdp task configuration");
     err_start = ESP_ERR_NO_MEM;
@@ -766,7 +2240,8 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
   if (err_start == ESP_OK) {
     // Buffer for udp packet
     ssdp_task_config->datagram_buffer =
-        (char *)calloc(SSDP_DATAGRAM_SIZE, sizeof(uint8_t));
+        (char *)ssdp_calloc(SSDP_ALLOC_START, SSDP_DATAGRAM_SIZE,
+                            sizeof(uint8_t));
     if (!ssdp_task_config->datagram_buffer) {
       ESP_LOGE(TAG, "No enough memory for ssdp datagram buffer");
       err_start = ESP_ERR_NO_MEM;
@@ -776,26 +2251,88 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     // Task configuration
     ssdp_task_config->port = configuration->port;
     ssdp_task_config->ttl = configuration->ttl;
-    ssdp_task_config->interval = configuration->interval;
+    ssdp_task_config->max_age = configuration->max_age
+                                    ? configuration->max_age
+                                    : configuration->interval;
+    // refresh at a fraction of max-age, 0% keeps the legacy period
+    ssdp_task_config->notify_period =
+        (configuration->refresh_percent > 0 &&
+         configuration->refresh_percent < 100)
+            ? ssdp_task_config->max_age * configuration->refresh_percent / 100
+            : ssdp_task_config->max_age;
+    if (ssdp_task_config->notify_period == 0) {
+      ssdp_task_config->notify_period = 1;
+    }
+    ssdp_task_config->jitter_percent = configuration->jitter_percent > 100
+                                           ? 100
+                                           : configuration->jitter_percent;
+    ssdp_task_config->startup_delay_max = configuration->startup_delay_max;
+    ssdp_task_config->startup_burst = configuration->startup_burst;
+    ssdp_task_config->startup_burst_spacing =
+        configuration->startup_burst_spacing;
     ssdp_task_config->mx_max_delay = configuration->mx_max_delay;
-    // Working variables
-    ssdp_task_config->delay = 0;
-    ssdp_task_config->respond_type[0] = 0x0;
-    ssdp_task_config->notify_time = 0;
+    ssdp_task_config->search_port = configuration->search_port;
+    // Networks are masked once here, a source only needs one AND each
+    for (size_t i = 0; i < configuration->allowed_source_count; i++) {
+      const ssdp_subnet_t *subnet = &configuration->allowed_sources[i];
+      ssdp_task_config->allowed_sources[i].addr = subnet->addr & subnet->mask;
+      ssdp_task_config->allowed_sources[i].mask = subnet->mask;
+    }
+    ssdp_task_config->allowed_source_count =
+        configuration->allowed_source_count;
+    for (size_t i = 0; i < configuration->denied_source_count; i++) {
+      const ssdp_subnet_t *subnet = &configuration->denied_sources[i];
+      ssdp_task_config->denied_sources[i].addr = subnet->addr & subnet->mask;
+      ssdp_task_config->denied_sources[i].mask = subnet->mask;
+    }
+    ssdp_task_config->denied_source_count = configuration->denied_source_count;
+    ssdp_task_config->ignore_own_packets = configuration->ignore_own_packets;
+    if (ssdp_task_config->search_port) {
+      snprintf(ssdp_task_config->search_port_header,
+               SSDP_SEARCH_PORT_HEADER_SIZE, "SEARCHPORT.UPNP.ORG: %u\r\n",
+               ssdp_task_config->search_port);
+    }
 
-    // UUID
-    ssdp_task_config->uuid = (char *)calloc(SSDP_UUID_SIZE + 1, sizeof(char));
+    if (configuration->manifest) {
+      // No string to copy, the identity was compiled with the firmware
+      err_start = ssdp_use_manifest(configuration);
+    } else {
+      // UUID
+      ssdp_task_config->uuid = (char *)ssdp_calloc(
+          SSDP_ALLOC_START, SSDP_UUID_SIZE + 1, sizeof(char));
 
-    if (!ssdp_task_config->uuid) {
-      ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
-      err_start = ESP_ERR_NO_MEM;
+      if (!ssdp_task_config->uuid) {
+        ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
+        err_start = ESP_ERR_NO_MEM;
+      }
     }
   }
 
+  if (err_start == ESP_OK && configuration->warm_start &&
+      !configuration->manifest) {
+    ssdp_task_config->warm_start = true;
+    ssdp_task_config->warm_key = ssdp_warm_key(configuration);
+    ssdp_warm_restore();
+  }
+
   if (err_start == ESP_OK) {
+    // First announcement after a random delay, then the startup burst. A
+    // matching warm state leaves nothing to render: announce almost at once
+    uint32_t delay_max = ssdp_task_config->startup_delay_max;
+    if (ssdp_task_config->warm_match && delay_max > SSDP_WARM_DELAY_MAX) {
+      delay_max = SSDP_WARM_DELAY_MAX;
+    }
+    ssdp_restart_announcements(ssdp_millis(), delay_max);
+  }
+
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Nothing is configured use default root and mac
-    if ((!configuration->uuid_root || strlen(configuration->uuid_root) == 0) &&
-        (!configuration->uuid || strlen(configuration->uuid) == 0)) {
+    if (ssdp_task_config->warm_match) {
+      // Same configuration, so the same uuid as last time
+      strcpy(ssdp_task_config->uuid, ssdp_task_config->warm->uuid);
+    } else if ((!configuration->uuid_root ||
+                strlen(configuration->uuid_root) == 0) &&
+               (!configuration->uuid || strlen(configuration->uuid) == 0)) {
       ssdp_set_UUID(&ssdp_task_config->uuid, SSDP_UUID_ROOT);
     } else {
       // if no full UID is configured but has root
@@ -817,7 +2354,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Schema_ url
     if (configuration->schema_url) {
       if (strlen(configuration->schema_url) > SSDP_SCHEMA_URL_SIZE) {
@@ -825,8 +2362,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->schema_url =
-            (char *)calloc(strlen(configuration->schema_url) + 1, sizeof(char));
+        ssdp_task_config->schema_url = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->schema_url) + 1,
+            sizeof(char));
         if (!ssdp_task_config->schema_url) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -838,7 +2376,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Device type
     if (configuration->device_type) {
       if (strlen(configuration->device_type) > SSDP_DEVICE_TYPE_SIZE) {
@@ -846,8 +2384,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->device_type = (char *)calloc(
-            strlen(configuration->device_type) + 1, sizeof(char));
+        ssdp_task_config->device_type = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->device_type) + 1,
+            sizeof(char));
         if (!ssdp_task_config->device_type) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -859,7 +2398,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Friendly name
     if (configuration->friendly_name) {
       if (strlen(configuration->friendly_name) > SSDP_FRIENDLY_NAME_SIZE) {
@@ -867,8 +2406,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->friendly_name = (char *)calloc(
-            strlen(configuration->friendly_name) + 1, sizeof(char));
+        ssdp_task_config->friendly_name = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->friendly_name) + 1,
+            sizeof(char));
         if (!ssdp_task_config->friendly_name) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -880,7 +2420,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Serial Number
     if (configuration->serial_number) {
       if (strlen(configuration->serial_number) > SSDP_SERIAL_NUMBER_SIZE) {
@@ -888,8 +2428,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->serial_number = (char *)calloc(
-            strlen(configuration->serial_number) + 1, sizeof(char));
+        ssdp_task_config->serial_number = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->serial_number) + 1,
+            sizeof(char));
         if (!ssdp_task_config->serial_number) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -901,7 +2442,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Presentation url
     if (configuration->presentation_url) {
       if (strlen(configuration->presentation_url) >
@@ -910,8 +2451,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->presentation_url = (char *)calloc(
-            strlen(configuration->presentation_url) + 1, sizeof(char));
+        ssdp_task_config->presentation_url = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->presentation_url) + 1,
+            sizeof(char));
         if (!ssdp_task_config->presentation_url) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -924,7 +2466,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Manufacturer name
     if (configuration->manufacturer_name) {
       if (strlen(configuration->manufacturer_name) >
@@ -933,8 +2475,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->manufacturer_name = (char *)calloc(
-            strlen(configuration->manufacturer_name) + 1, sizeof(char));
+        ssdp_task_config->manufacturer_name = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->manufacturer_name) + 1,
+            sizeof(char));
         if (!ssdp_task_config->manufacturer_name) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -946,7 +2489,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
       }
     }
   }
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Manufacturer url
     if (configuration->manufacturer_url) {
       if (strlen(configuration->manufacturer_url) >
@@ -955,8 +2498,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->manufacturer_url = (char *)calloc(
-            strlen(configuration->manufacturer_url) + 1, sizeof(char));
+        ssdp_task_config->manufacturer_url = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->manufacturer_url) + 1,
+            sizeof(char));
         if (!ssdp_task_config->manufacturer_url) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -969,7 +2513,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Model name
     if (configuration->model_name) {
       if (strlen(configuration->model_name) > SSDP_MODEL_NAME_SIZE) {
@@ -977,8 +2521,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->model_name =
-            (char *)calloc(strlen(configuration->model_name) + 1, sizeof(char));
+        ssdp_task_config->model_name = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->model_name) + 1,
+            sizeof(char));
         if (!ssdp_task_config->model_name) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -990,7 +2535,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Model url
     if (configuration->model_url) {
       if (strlen(configuration->model_url) > SSDP_MODEL_URL_SIZE) {
@@ -998,8 +2543,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->model_url =
-            (char *)calloc(strlen(configuration->model_url) + 1, sizeof(char));
+        ssdp_task_config->model_url = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->model_url) + 1,
+            sizeof(char));
         if (!ssdp_task_config->model_url) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -1011,7 +2557,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Model number
     if (configuration->model_number) {
       if (strlen(configuration->model_number) > SSDP_MODEL_NUMBER_SIZE) {
@@ -1019,8 +2565,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->model_number = (char *)calloc(
-            strlen(configuration->model_number) + 1, sizeof(char));
+        ssdp_task_config->model_number = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->model_number) + 1,
+            sizeof(char));
         if (!ssdp_task_config->model_number) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -1032,7 +2579,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Model description
     if (configuration->model_description) {
       if (strlen(configuration->model_description) >
@@ -1041,8 +2588,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->model_description = (char *)calloc(
-            strlen(configuration->model_description) + 1, sizeof(char));
+        ssdp_task_config->model_description = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->model_description) + 1,
+            sizeof(char));
         if (!ssdp_task_config->model_description) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -1054,7 +2602,7 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
       }
     }
   }
-  if (err_start == ESP_OK) {
+  if (err_start == ESP_OK && !configuration->manifest) {
     // Server name
     if (configuration->server_name) {
       if (strlen(configuration->server_name) > SSDP_SERVER_NAME_SIZE) {
@@ -1062,8 +2610,9 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
         err_start = ESP_ERR_INVALID_ARG;
       }
       if (err_start == ESP_OK) {
-        ssdp_task_config->server_name = (char *)calloc(
-            strlen(configuration->server_name) + 1, sizeof(char));
+        ssdp_task_config->server_name = (char *)ssdp_calloc(
+            SSDP_ALLOC_START, strlen(configuration->server_name) + 1,
+            sizeof(char));
         if (!ssdp_task_config->server_name) {
           ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
           err_start = ESP_ERR_NO_MEM;
@@ -1075,58 +2624,102 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     }
   }
 
-  if (err_start == ESP_OK) {
-    // Services description
-    if (configuration->services_description) {
-      if (strlen(configuration->services_description) >
-          SSDP_SERVICES_DESCRIPTION_SIZE) {
-        ESP_LOGE(TAG, "Services description too long");
-        err_start = ESP_ERR_INVALID_ARG;
-      }
-      if (err_start == ESP_OK) {
-        ssdp_task_config->services_description = (char *)calloc(
-            strlen(configuration->services_description) + 1, sizeof(char));
-        if (!ssdp_task_config->services_description) {
-          ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
-          err_start = ESP_ERR_NO_MEM;
-        }
-        if (err_start == ESP_OK) {
-          strcpy(ssdp_task_config->services_description,
-                 configuration->services_description);
-        }
+  if (err_start == ESP_OK && !configuration->manifest) {
+    err_start = ssdp_validate_services(configuration);
+  }
+
+  if (err_start == ESP_OK && !configuration->manifest) {
+    // Services description, rendered from the typed services if any
+    if (configuration->service_count) {
+      ssdp_task_config->services_description = ssdp_render_services(
+          configuration->services, configuration->service_count);
+      ssdp_task_config->services = configuration->services;
+      ssdp_task_config->service_count = configuration->service_count;
+    } else if (configuration->services_description) {
+      ssdp_task_config->services_description = (char *)ssdp_calloc(
+          SSDP_ALLOC_START, strlen(configuration->services_description) + 1,
+          sizeof(char));
+      if (ssdp_task_config->services_description) {
+        strcpy(ssdp_task_config->services_description,
+               configuration->services_description);
       }
     }
+    if ((configuration->service_count ||
+         configuration->services_description) &&
+        !ssdp_task_config->services_description) {
+      ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
+      err_start = ESP_ERR_NO_MEM;
+    }
   }
 
-  if (err_start == ESP_OK) {
-    // Icons description
-    if (configuration->icons_description) {
-      if (strlen(configuration->icons_description) >
-          SSDP_ICONS_DESCRIPTION_SIZE) {
-        ESP_LOGE(TAG, "Icons description too long");
-        err_start = ESP_ERR_INVALID_ARG;
-      }
-      if (err_start == ESP_OK) {
-        ssdp_task_config->icons_description = (char *)calloc(
-            strlen(configuration->icons_description) + 1, sizeof(char));
-        if (!ssdp_task_config->icons_description) {
-          ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
-          err_start = ESP_ERR_NO_MEM;
-        }
-        if (err_start == ESP_OK) {
-          strcpy(ssdp_task_config->icons_description,
-                 configuration->icons_description);
-        }
+  if (err_start == ESP_OK && !configuration->manifest) {
+    // Icons description, rendered from the typed icons if any
+    if (configuration->icon_count) {
+      ssdp_task_config->icons_description =
+          ssdp_render_icons(configuration->icons, configuration->icon_count);
+    } else if (configuration->icons_description) {
+      ssdp_task_config->icons_description = (char *)ssdp_calloc(
+          SSDP_ALLOC_START, strlen(configuration->icons_description) + 1,
+          sizeof(char));
+      if (ssdp_task_config->icons_description) {
+        strcpy(ssdp_task_config->icons_description,
+               configuration->icons_description);
       }
     }
+    if ((configuration->icon_count || configuration->icons_description) &&
+        !ssdp_task_config->icons_description) {
+      ESP_LOGE(TAG, "No enough memory for ssdp user task configuration");
+      err_start = ESP_ERR_NO_MEM;
+    }
+  }
+
+  if (err_start == ESP_OK) {
+    ssdp_load_boot_state();
+    err_start = ssdp_build_packets();
+    // The service types are in the targets, the array is not kept
+    ssdp_task_config->services = NULL;
+    ssdp_task_config->service_count = 0;
+  }
+
+  if (err_start == ESP_OK) {
+    err_start = ssdp_build_schema();
+  }
+
+  if (err_start == ESP_OK) {
+    err_start = ssdp_gena_start(ssdp_task_config->schema,
+                                configuration->gena_moderation,
+                                configuration->gena_timeout_max);
+  }
+
+  if (err_start == ESP_OK && configuration->relay) {
+    ssdp_task_config->relay = true;
+    err_start = ssdp_relay_start(configuration->ttl,
+                                 configuration->relay_cache_size,
+                                 configuration->relay_holdoff);
   }
 
   if (err_start == ESP_OK) {
+    ssdp_task_config->backoff = SSDP_BACKOFF_MIN;
+    ssdp_task_config->link_up = ssdp_has_ip();
+    // Before the task, which posts from its first pass
+    ssdp_event_start(configuration->event_mask, configuration->event_rate);
+  }
+
+  if (err_start == ESP_OK && configuration->polled) {
+    // The application runs the loop from its own task with ssdp_poll()
+    ESP_LOGI(TAG, "No task, polled by the application");
+    ssdp_polled_events = 0;
+    ssdp_polling = true;
+    ssdp_running = true;
+  } else if (err_start == ESP_OK) {
+    // Set before the task runs, so a stop right after start is not lost
+    ssdp_running = true;
     ESP_LOGI(TAG, "Task creation core %d, stack:  %d, priotity %d",
              configuration->core_id, configuration->stack_size,
              configuration->task_priority);
 
     // Task creation
+    ssdp_task_config->stack_size = configuration->stack_size;
     BaseType_t res = xTaskCreatePinnedToCore(
         ssdp_running_task, "ssdp_running_task", configuration->stack_size, NULL,
         configuration->task_priority, &ssdp_task_config->xHandle,
@@ -1134,17 +2727,64 @@ esp_err_t ssdp_start(ssdp_config_t *configuration) {
     if (!(res == pdPASS && ssdp_task_config->xHandle)) {
       ESP_LOGE(TAG, "Failed to create task");
       err_start = ESP_FAIL;
+    } else {
+      ssdp_task_handle = ssdp_task_config->xHandle;
+    }
+  }
+
+  if (err_start == ESP_OK) {
+    // Without the default event loop the task falls back to polling
+    if (esp_event_handler_instance_register(
+            IP_EVENT, ESP_EVENT_ANY_ID, ssdp_ip_event_handler, NULL,
+            &ssdp_ip_event_instance) != ESP_OK) {
+      ESP_LOGW(TAG, "IP events not available, polling the interfaces");
+      ssdp_ip_event_instance = NULL;
     }
+    const ssdp_event_started_t event = {
+        .boot_id = ssdp_task_config->boot_id,
+        .config_id = ssdp_task_config->config_id,
+        .polled = configuration->polled,
+    };
+    ssdp_event_post(SSDP_EVENT_STARTED, &event, sizeof(event));
   }
 
+  if (err_start != ESP_OK && ssdp_task_config &&
+      !ssdp_task_config->xHandle) {
+    // Release what was allocated so a new start can be attempted
+    ssdp_stop();
+  }
   return err_start;
 }
 
 esp_err_t ssdp_stop() {
   ESP_LOGD(TAG, "Stopping SSDP");
+  if (ssdp_ip_event_instance) {
+    esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID,
+                                          ssdp_ip_event_instance);
+    ssdp_ip_event_instance = NULL;
+  }
+  if (ssdp_running) {
+    ssdp_event_post(SSDP_EVENT_STOPPED, NULL, 0);
+  }
+  ssdp_event_stop();
   // to close properly let's just the loop to stop
   ssdp_running = false;
-  vTaskDelay(100 / portTICK_PERIOD_MS);
+  // Without a task, the caller of ssdp_poll() is the one stopping
+  ssdp_polling = false;
+  if (ssdp_task_handle) {
+    TaskHandle_t task = ssdp_task_handle;
+    // Under the lock: ssdp_get_mem_stats() stops reading its stack first
+    xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+    ssdp_task_handle = NULL;
+    xSemaphoreGive(ssdp_state_lock);
+    // Wake the task up if it is waiting for the network, then wait for the
+    // end of its last pass, up to SSDP_SELECT_TIMEOUT in a select
+    xTaskNotify(task, SSDP_TASK_BIT_STOP, eSetBits);
+    xSemaphoreTake(ssdp_task_exited, portMAX_DELAY);
+  }
+  if (ssdp_state_lock) {
+    xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+  }
   if (ssdp_task_config) {
     // Delete the Task
     if (ssdp_task_config->xHandle) {
@@ -1153,52 +2793,90 @@ esp_err_t ssdp_stop() {
       ssdp_task_config->xHandle = NULL;
       ESP_LOGD(TAG, "Deleting SSDP Task");
     }
-    if (multicast_socket != -1) {
-      shutdown(multicast_socket, 0);
-      close(multicast_socket);
-      multicast_socket = -1;
-    }
-    // Free memory
-    free(ssdp_task_config->device_type);
-    free(ssdp_task_config->friendly_name);
-    free(ssdp_task_config->serial_number);
-    free(ssdp_task_config->presentation_url);
-    free(ssdp_task_config->manufacturer_name);
-    free(ssdp_task_config->manufacturer_url);
-    free(ssdp_task_config->model_name);
-    free(ssdp_task_config->model_url);
-    free(ssdp_task_config->model_number);
-    free(ssdp_task_config->model_description);
-    free(ssdp_task_config->server_name);
-    free(ssdp_task_config->services_description);
-    free(ssdp_task_config->icons_description);
-    free(ssdp_task_config->datagram_buffer);
-    free(ssdp_task_config->schema);
-    free(ssdp_task_config);
+    ssdp_close_sockets();
+    ssdp_gena_stop();
+    ssdp_relay_stop();
+    // Free memory, the strings of a manifest are in flash
+    if (!ssdp_task_config->manifest) {
+      ssdp_free(ssdp_task_config->schema_url);
+      ssdp_free(ssdp_task_config->device_type);
+      ssdp_free(ssdp_task_config->friendly_name);
+      ssdp_free(ssdp_task_config->serial_number);
+      ssdp_free(ssdp_task_config->presentation_url);
+      ssdp_free(ssdp_task_config->manufacturer_name);
+      ssdp_free(ssdp_task_config->manufacturer_url);
+      ssdp_free(ssdp_task_config->model_name);
+      ssdp_free(ssdp_task_config->model_url);
+      ssdp_free(ssdp_task_config->model_number);
+      ssdp_free(ssdp_task_config->model_description);
+      ssdp_free(ssdp_task_config->server_name);
+      ssdp_free(ssdp_task_config->services_description);
+      ssdp_free(ssdp_task_config->icons_description);
+    }
+    ssdp_free(ssdp_task_config->datagram_buffer);
+    if (ssdp_task_config->target_buffer) {
+      // Lines of a warm start are in its state
+      for (size_t i = 0;
+           !ssdp_task_config->warm && i < ssdp_task_config->target_count;
+           i++) {
+        ssdp_free((void *)ssdp_task_config->target_buffer[i].line);
+      }
+      ssdp_free(ssdp_task_config->target_buffer);
+    }
+    ssdp_free(ssdp_task_config->warm);
+    ssdp_free(ssdp_task_config->tail);
+    if (!ssdp_static_identity()) {
+      ssdp_free(ssdp_task_config->uuid);
+      ssdp_free(ssdp_task_config->schema);
+    }
+    ssdp_free(ssdp_task_config);
     ssdp_task_config = NULL;
   }
+  if (ssdp_state_lock) {
+    xSemaphoreGive(ssdp_state_lock);
+  }
 
   if (multicast_socket != -1) {
-    shutdown(multicast_socket, 0);
-    close(multicast_socket);
+    ssdp_platform->close(ssdp_platform->ctx, multicast_socket);
     multicast_socket = -1;
   }
   return ESP_OK;
 }
 
-const char *get_ssdp_schema_str() {
-  if (!ssdp_task_config) {
-    ESP_LOGE(TAG, "SSDP not started");
-    return NULL;
+// The description does not depend on the IP address (URLBase is deprecated
+// since UPnP 1.1) so it is rendered once at start and never changes until
+// ssdp_stop, any task can read it without lock
+esp_err_t ssdp_build_schema() {
+  const ssdp_manifest_t *manifest = ssdp_task_config->manifest;
+  if (manifest && manifest->uuid) {
+    ssdp_task_config->schema = (char *)manifest->description;
+    ssdp_task_config->schema_len = manifest->description_len;
+    return ESP_OK;
   }
-  if (ssdp_task_config->schema) {
-    free(ssdp_task_config->schema);
-    ssdp_task_config->schema = NULL;
+  if (manifest) {
+    // Only the UDN uuid is inserted
+    size_t uuid_len = strlen(ssdp_task_config->uuid);
+    char *schema = (char *)ssdp_calloc(
+        SSDP_ALLOC_SCHEMA,
+        manifest->description_len + uuid_len +
+            manifest->description_tail_len + 1,
+        sizeof(char));
+    if (!schema) {
+      ESP_LOGE(TAG, "Memory allocation error for schema");
+      return ESP_ERR_NO_MEM;
+    }
+    memcpy(schema, manifest->description, manifest->description_len);
+    memcpy(schema + manifest->description_len, ssdp_task_config->uuid,
+           uuid_len);
+    memcpy(schema + manifest->description_len + uuid_len,
+           manifest->description_tail, manifest->description_tail_len);
+    ssdp_task_config->schema = schema;
+    ssdp_task_config->schema_len =
+        manifest->description_len + uuid_len + manifest->description_tail_len;
+    return ESP_OK;
   }
-
   size_t template_size =
-      sizeof(SSDP_SCHEMA_TEMPLATE) + 15  // IP
-      + 5                                // port
+      sizeof(SSDP_SCHEMA_TEMPLATE) + 8  // configId
       + (ssdp_task_config->device_type ? strlen(ssdp_task_config->device_type)
                                        : 1) +
       (ssdp_task_config->friendly_name ? strlen(ssdp_task_config->friendly_name)
@@ -1230,45 +2908,406 @@ const char *get_ssdp_schema_str() {
            ? strlen(ssdp_task_config->icons_description)
            : 1);
 
-  ssdp_task_config->schema = (char *)calloc(template_size + 1, sizeof(char));
+  ssdp_task_config->schema = (char *)ssdp_calloc(
+      SSDP_ALLOC_SCHEMA, template_size + 1, sizeof(char));
   if (ssdp_task_config->schema) {
-    if (sprintf(
-            ssdp_task_config->schema, SSDP_SCHEMA_TEMPLATE, ssdp_get_LocalIP(),
-            ssdp_task_config->port,
-            ssdp_task_config->device_type ? ssdp_task_config->device_type : "",
-            ssdp_task_config->friendly_name ? ssdp_task_config->friendly_name
-                                            : "",
-            ssdp_task_config->presentation_url
-                ? ssdp_task_config->presentation_url
-                : "",
-            ssdp_task_config->serial_number ? ssdp_task_config->serial_number
-                                            : "",
-            ssdp_task_config->model_name ? ssdp_task_config->model_name : "",
-            ssdp_task_config->model_description
-                ? ssdp_task_config->model_description
-                : "",
-            ssdp_task_config->model_number ? ssdp_task_config->model_number
-                                           : "",
-            ssdp_task_config->model_url ? ssdp_task_config->model_url : "",
-            ssdp_task_config->manufacturer_name
-                ? ssdp_task_config->manufacturer_name
-                : "",
-            ssdp_task_config->manufacturer_url
-                ? ssdp_task_config->manufacturer_url
-                : "",
-            ssdp_task_config->uuid ? ssdp_task_config->uuid : "",
-            ssdp_task_config->services_description
-                ? ssdp_task_config->services_description
-                : "",
-            ssdp_task_config->icons_description
-                ? ssdp_task_config->icons_description
-                : "") < 0) {
+    int len = sprintf(
+        ssdp_task_config->schema, SSDP_SCHEMA_TEMPLATE,
+        ssdp_task_config->config_id,
+        ssdp_task_config->device_type ? ssdp_task_config->device_type : "",
+        ssdp_task_config->friendly_name ? ssdp_task_config->friendly_name : "",
+        ssdp_task_config->presentation_url
+            ? ssdp_task_config->presentation_url
+            : "",
+        ssdp_task_config->serial_number ? ssdp_task_config->serial_number : "",
+        ssdp_task_config->model_name ? ssdp_task_config->model_name : "",
+        ssdp_task_config->model_description
+            ? ssdp_task_config->model_description
+            : "",
+        ssdp_task_config->model_number ? ssdp_task_config->model_number : "",
+        ssdp_task_config->model_url ? ssdp_task_config->model_url : "",
+        ssdp_task_config->manufacturer_name
+            ? ssdp_task_config->manufacturer_name
+            : "",
+        ssdp_task_config->manufacturer_url
+            ? ssdp_task_config->manufacturer_url
+            : "",
+        ssdp_task_config->uuid ? ssdp_task_config->uuid : "",
+        ssdp_task_config->services_description
+            ? ssdp_task_config->services_description
+            : "",
+        ssdp_task_config->icons_description
+            ? ssdp_task_config->icons_description
+            : "");
+    if (len < 0) {
       ESP_LOGE(TAG, "sprintf error for schema");
-      free(ssdp_task_config->schema);
+      ssdp_free(ssdp_task_config->schema);
       ssdp_task_config->schema = NULL;
+      return ESP_FAIL;
     }
+    ssdp_task_config->schema_len = len;
   } else {
     ESP_LOGE(TAG, "Memory allocation error for schema");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+size_t ssdp_get_schema(char *buf, size_t size) {
+  ssdp_description_t description;
+  if (ssdp_acquire_description(&description) != ESP_OK) {
+    ESP_LOGE(TAG, "SSDP not started");
+    if (size) {
+      buf[0] = 0;
+    }
+    return 0;
+  }
+  if (size) {
+    size_t len = description.len < size ? description.len : size - 1;
+    memcpy(buf, description.body, len);
+    buf[len] = 0;
+  }
+  ssdp_release_description();
+  return description.len;
+}
+
+// Held under ssdp_state_lock, ssdp_stop() waits for the release
+esp_err_t ssdp_acquire_description(ssdp_description_t *description) {
+  if (!ssdp_state_lock) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+  if (!ssdp_task_config || !ssdp_task_config->schema) {
+    xSemaphoreGive(ssdp_state_lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  const ssdp_manifest_t *manifest = ssdp_task_config->manifest;
+  description->url =
+      ssdp_task_config->schema_url ? ssdp_task_config->schema_url : "";
+  description->body = ssdp_task_config->schema;
+  description->len = ssdp_task_config->schema_len;
+  // Only a description completely in flash can be compressed at build time
+  description->gzip = ssdp_static_identity() ? manifest->description_gzip
+                                              : NULL;
+  description->gzip_len =
+      description->gzip ? manifest->description_gzip_len : 0;
+  description->generation = ssdp_task_config->config_id;
+  description->manifest = manifest;
+  return ESP_OK;
+}
+
+void ssdp_release_description() { xSemaphoreGive(ssdp_state_lock); }
+
+esp_err_t ssdp_get_trace_stats(ssdp_trace_stats_t *stats) {
+#if CONFIG_SSDP_TRACE
+  if (!stats) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&ssdp_trace_lock);
+  *stats = ssdp_trace_stats;
+  portEXIT_CRITICAL(&ssdp_trace_lock);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t ssdp_reset_trace_stats() {
+#if CONFIG_SSDP_TRACE
+  portENTER_CRITICAL(&ssdp_trace_lock);
+  memset(&ssdp_trace_stats, 0, sizeof(ssdp_trace_stats));
+  portEXIT_CRITICAL(&ssdp_trace_lock);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+// Upper bound (us) of the bucket holding the given share of the samples
+static uint64_t ssdp_trace_percentile(const uint32_t *count, uint32_t total,
+                                      uint32_t percent) {
+  uint64_t seen = 0;
+  for (size_t b = 0; b < SSDP_TRACE_BUCKETS; b++) {
+    seen += count[b];
+    if (seen * 100 >= (uint64_t)total * percent) {
+      return 2ULL << b;
+    }
+  }
+  return 2ULL << (SSDP_TRACE_BUCKETS - 1);
+}
+
+esp_err_t ssdp_dump_trace_stats() {
+  static const char *const names[SSDP_TRACE_STAGE_MAX] = {
+      "parse", "match", "queue", "late", "send", "total"};
+  ssdp_trace_stats_t stats;
+  esp_err_t err = ssdp_get_trace_stats(&stats);
+  if (err != ESP_OK) {
+    return err;
+  }
+  printf("%-6s %10s %10s %10s %10s %10s\n", "stage", "count", "p50<us",
+         "p90<us", "p99<us", "max us");
+  for (size_t stage = 0; stage < SSDP_TRACE_STAGE_MAX; stage++) {
+    uint32_t total = 0;
+    for (size_t b = 0; b < SSDP_TRACE_BUCKETS; b++) {
+      total += stats.count[stage][b];
+    }
+    if (total == 0) {
+      printf("%-6s %10u\n", names[stage], 0);
+      continue;
+    }
+    printf("%-6s %10" PRIu32 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+           " %10" PRIu32 "\n",
+           names[stage], total,
+           ssdp_trace_percentile(stats.count[stage], total, 50),
+           ssdp_trace_percentile(stats.count[stage], total, 90),
+           ssdp_trace_percentile(stats.count[stage], total, 99),
+           stats.max_us[stage]);
+  }
+  return ESP_OK;
+}
+
+// Read from another task while the SSDP task runs: each field is consistent
+// but they may come from different loop iterations. The lock only keeps
+// ssdp_stop() from freeing the configuration meanwhile, so the strings are
+// copied
+esp_err_t ssdp_get_status(ssdp_status_t *status) {
+  if (!status) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(status, 0, sizeof(ssdp_status_t));
+  if (!ssdp_state_lock) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+  if (!ssdp_task_config) {
+    xSemaphoreGive(ssdp_state_lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  status->running = ssdp_running;
+  status->multicast_open = multicast_socket >= 0;
+  status->unicast_open = unicast_socket >= 0;
+  status->local_addr = ssdp_task_config->local_addr;
+  snprintf(status->uuid, sizeof(status->uuid), "%s",
+           ssdp_task_config->uuid ? ssdp_task_config->uuid : "");
+  snprintf(status->device_type, sizeof(status->device_type), "%s",
+           ssdp_task_config->device_type ? ssdp_task_config->device_type
+                                         : "");
+  snprintf(status->schema_url, sizeof(status->schema_url), "%s",
+           ssdp_task_config->schema_url ? ssdp_task_config->schema_url : "");
+  status->manifest = ssdp_task_config->manifest != NULL;
+  status->boot_id = ssdp_task_config->boot_id;
+  status->config_id = ssdp_task_config->config_id;
+  status->port = ssdp_task_config->port;
+  status->search_port = ssdp_task_config->search_port;
+  status->ttl = ssdp_task_config->ttl;
+  status->max_age = ssdp_task_config->max_age;
+  status->notify_period = ssdp_task_config->notify_period;
+  status->jitter_percent = ssdp_task_config->jitter_percent;
+  status->mx_max_delay = ssdp_task_config->mx_max_delay;
+  status->next_notify =
+      (int64_t)ssdp_task_config->notify_time - (int64_t)ssdp_millis();
+  status->target_count = ssdp_task_config->target_count;
+  status->pending_count = ssdp_task_config->pending_count;
+  status->retry_count = ssdp_task_config->retry_count;
+  status->allowed_source_count = ssdp_task_config->allowed_source_count;
+  status->denied_source_count = ssdp_task_config->denied_source_count;
+  status->ignore_own_packets = ssdp_task_config->ignore_own_packets;
+  status->relay = ssdp_task_config->relay;
+  status->relay_cached = ssdp_relay_cached_count(ssdp_millis());
+  xSemaphoreGive(ssdp_state_lock);
+  return ESP_OK;
+}
+
+esp_err_t ssdp_notify_now() {
+  if (!ssdp_task_handle && !ssdp_polling) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  ssdp_post_events(SSDP_TASK_BIT_NOTIFY_NOW);
+  return ESP_OK;
+}
+
+// The targets are immutable once started, any task can match against them
+// as long as ssdp_stop() does not free them meanwhile
+size_t ssdp_search_targets(const char *st, ssdp_target_cb_t callback,
+                           void *arg) {
+  if (!st || !ssdp_state_lock) {
+    return 0;
+  }
+  xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+  size_t first = 0;
+  size_t count = 0;
+  if (ssdp_task_config) {
+    const ssdp_view_t view = {st, strlen(st)};
+    int target = ssdp_match_target(&view);
+    if (target == SSDP_TARGET_ALL) {
+      count = ssdp_task_config->target_count;
+    } else if (target != SSDP_TARGET_NONE) {
+      first = target;
+      count = 1;
+    }
+  }
+  for (size_t i = first; i < first + count; i++) {
+    callback(&ssdp_task_config->targets[i], arg);
+  }
+  xSemaphoreGive(ssdp_state_lock);
+  return count;
+}
+
+esp_err_t ssdp_get_tx_stats(ssdp_tx_stats_t *stats) {
+  if (!stats) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  *stats = ssdp_tx_stats;
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+  return ESP_OK;
+}
+
+esp_err_t ssdp_get_mem_stats(ssdp_mem_stats_t *stats) {
+  if (!stats) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&ssdp_mem_lock);
+  *stats = ssdp_mem_stats;
+  portEXIT_CRITICAL(&ssdp_mem_lock);
+  stats->stack_size = 0;
+  stats->stack_high_water = 0;
+  if (!ssdp_state_lock) {
+    return ESP_OK;
+  }
+  // ssdp_stop() frees the configuration and lets the task exit under it
+  xSemaphoreTake(ssdp_state_lock, portMAX_DELAY);
+  if (ssdp_task_config && ssdp_task_handle) {
+    stats->stack_size = ssdp_task_config->stack_size;
+    // In bytes, StackType_t is uint8_t on ESP-IDF
+    stats->stack_high_water =
+        uxTaskGetStackHighWaterMark(ssdp_task_handle) * sizeof(StackType_t);
+  }
+  xSemaphoreGive(ssdp_state_lock);
+  return ESP_OK;
+}
+
+esp_err_t ssdp_loop_add_socket(int sock, ssdp_socket_cb_t callback,
+                               void *arg) {
+  if (sock < 0 || !callback) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (ssdp_platform != &SSDP_DEFAULT_PLATFORM) {
+    // Only select() of the default platform waits on other sockets
+    ESP_LOGE(TAG, "The platform in use cannot serve other sockets");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  esp_err_t err = ESP_OK;
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  for (size_t i = 0; i < ssdp_loop.socket_count; i++) {
+    if (ssdp_loop.sockets[i].sock == sock) {
+      err = ESP_ERR_INVALID_STATE;
+    }
+  }
+  if (err == ESP_OK && ssdp_loop.socket_count >= SSDP_LOOP_SOCKETS_MAX) {
+    err = ESP_ERR_NO_MEM;
+  }
+  if (err == ESP_OK) {
+    ssdp_loop.sockets[ssdp_loop.socket_count++] =
+        (ssdp_loop_socket_t){sock, callback, arg};
+  }
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return err;
+}
+
+esp_err_t ssdp_loop_remove_socket(int sock) {
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  for (size_t i = 0; i < ssdp_loop.socket_count; i++) {
+    if (ssdp_loop.sockets[i].sock == sock) {
+      ssdp_loop.sockets[i] = ssdp_loop.sockets[--ssdp_loop.socket_count];
+      err = ESP_OK;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return err;
+}
+
+esp_err_t ssdp_loop_add_timer(uint32_t delay, uint32_t period,
+                              ssdp_timer_cb_t callback, void *arg) {
+  if (!callback) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  uint64_t due = ssdp_millis() + delay;
+  esp_err_t err = ESP_ERR_NO_MEM;
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  for (size_t i = 0; i < SSDP_LOOP_TIMERS_MAX; i++) {
+    if (!ssdp_loop.timers[i].callback) {
+      ssdp_loop.timers[i] = (ssdp_loop_timer_t){callback, arg, due, period};
+      err = ESP_OK;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return err;
+}
+
+esp_err_t ssdp_loop_remove_timer(ssdp_timer_cb_t callback, void *arg) {
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  for (size_t i = 0; i < SSDP_LOOP_TIMERS_MAX; i++) {
+    ssdp_loop_timer_t *timer = &ssdp_loop.timers[i];
+    if (timer->callback == callback && timer->arg == arg) {
+      timer->callback = NULL;
+      err = ESP_OK;
+    }
+  }
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return err;
+}
+
+esp_err_t ssdp_set_observer(ssdp_observer_cb_t callback, void *arg) {
+  portENTER_CRITICAL(&ssdp_loop_lock);
+  ssdp_loop.observer = callback;
+  ssdp_loop.observer_arg = arg;
+  portEXIT_CRITICAL(&ssdp_loop_lock);
+  return ESP_OK;
+}
+
+esp_err_t ssdp_poll(uint32_t timeout_ms) {
+  if (!ssdp_polling || !ssdp_running) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  ssdp_step(timeout_ms);
+  return ESP_OK;
+}
+
+uint32_t ssdp_next_deadline() {
+  if (!ssdp_polling || !ssdp_running) {
+    return UINT32_MAX;
+  }
+  if (ssdp_polled_events) {
+    return 0;
   }
-  return ssdp_task_config->schema;
-}
\ No newline at end of file
+  // As of the last ssdp_poll(): GENA, link checks and socket backoff
+  uint64_t deadline = ssdp_task_config->deadline;
+  if (multicast_socket >= 0) {
+    // Plus what the datagrams read since then have scheduled
+    if (ssdp_task_config->notify_time < deadline) {
+      deadline = ssdp_task_config->notify_time;
+    }
+    for (size_t i = 0; i < ssdp_task_config->pending_count; i++) {
+      if (ssdp_task_config->pending[i].due < deadline) {
+        deadline = ssdp_task_config->pending[i].due;
+      }
+    }
+    for (size_t i = 0; i < ssdp_task_config->retry_count; i++) {
+      if (ssdp_task_config->retries[i].next_try < deadline) {
+        deadline = ssdp_task_config->retries[i].next_try;
+      }
+    }
+  }
+  uint64_t now = ssdp_millis();
+  uint64_t delay = deadline > now ? deadline - now : 0;
+  uint64_t timer_delay = ssdp_loop_next_timer(now);
+  if (timer_delay < delay) {
+    delay = timer_delay;
+  }
+  return delay < UINT32_MAX ? (uint32_t)delay : UINT32_MAX;
+}
@@ -0,0 +1,298 @@
+/*
+  ssdp_capture.c pcap capture of the datagrams received and sent
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+#if CONFIG_SSDP_CAPTURE
+static const char *TAG = "esp-ssdp-capture";
+
+/*
+ * Defines
+ */
+#define SSDP_PCAP_MAGIC 0xa1b2c3d4  // microsecond timestamps, host order
+#define SSDP_PCAP_SNAPLEN 65535
+#define SSDP_PCAP_LINKTYPE_IPV4 228  // records start with the IPv4 header
+#define SSDP_CAPTURE_TTL 64
+
+/*
+ * Struct definitions
+ */
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} ssdp_pcap_header_t;
+
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} ssdp_pcap_record_t;
+
+// IPv4 and UDP headers rebuilt around each payload, network byte order
+typedef struct {
+  uint8_t version_ihl;
+  uint8_t tos;
+  uint16_t total_len;
+  uint16_t id;
+  uint16_t fragment;
+  uint8_t ttl;
+  uint8_t protocol;
+  uint16_t checksum;
+  uint32_t src;
+  uint32_t dst;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t udp_len;
+  uint16_t udp_checksum;  // 0: not computed, allowed over IPv4
+} ssdp_pcap_ip_udp_t;
+
+/*
+ * Global variables
+ */
+
+// Written by the SSDP task, started, stopped and dumped from any task
+static struct {
+  bool active;
+  FILE *file;     // NULL: records go to the ring
+  uint8_t *ring;  // CONFIG_SSDP_CAPTURE_RING_SIZE bytes of whole records
+  size_t head;    // oldest record
+  size_t used;
+  uint16_t ip_id;
+} ssdp_capture;
+static SemaphoreHandle_t ssdp_capture_lock = NULL;
+static StaticSemaphore_t ssdp_capture_lock_buffer;
+
+/*
+ * Local Functions
+ */
+
+static void ssdp_capture_header(ssdp_pcap_header_t *header) {
+  *header = (ssdp_pcap_header_t){
+      .magic = SSDP_PCAP_MAGIC,
+      .version_major = 2,
+      .version_minor = 4,
+      .snaplen = SSDP_PCAP_SNAPLEN,
+      .linktype = SSDP_PCAP_LINKTYPE_IPV4,
+  };
+}
+
+static uint16_t ssdp_ip_checksum(const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    sum += (bytes[i] << 8) | bytes[i + 1];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return htons(~sum & 0xffff);
+}
+
+static void ssdp_ring_copy(size_t offset, void *dst, const void *src,
+                           size_t len, bool write) {
+  offset %= CONFIG_SSDP_CAPTURE_RING_SIZE;
+  size_t first = CONFIG_SSDP_CAPTURE_RING_SIZE - offset;
+  if (first > len) {
+    first = len;
+  }
+  if (write) {
+    memcpy(ssdp_capture.ring + offset, src, first);
+    memcpy(ssdp_capture.ring, (const uint8_t *)src + first, len - first);
+  } else {
+    memcpy(dst, ssdp_capture.ring + offset, first);
+    memcpy((uint8_t *)dst + first, ssdp_capture.ring, len - first);
+  }
+}
+
+static void ssdp_capture_write(const void *data, size_t len) {
+  if (ssdp_capture.file) {
+    fwrite(data, 1, len, ssdp_capture.file);
+  } else {
+    ssdp_ring_copy(ssdp_capture.head + ssdp_capture.used, NULL, data, len,
+                   true);
+    ssdp_capture.used += len;
+  }
+}
+
+// Push the oldest records out until len bytes are free
+static void ssdp_ring_make_room(size_t len) {
+  while (CONFIG_SSDP_CAPTURE_RING_SIZE - ssdp_capture.used < len) {
+    ssdp_pcap_record_t record;
+    ssdp_ring_copy(ssdp_capture.head, &record, NULL, sizeof(record), false);
+    size_t size = sizeof(record) + record.incl_len;
+    ssdp_capture.head =
+        (ssdp_capture.head + size) % CONFIG_SSDP_CAPTURE_RING_SIZE;
+    ssdp_capture.used -= size;
+  }
+}
+
+/*
+ * Global Functions
+ */
+
+void ssdp_capture_packet(uint32_t src, uint16_t src_port, uint32_t dst,
+                         uint16_t dst_port, const ssdp_iovec_t *parts,
+                         size_t part_count) {
+  if (!ssdp_capture.active) {
+    return;
+  }
+  size_t payload_len = 0;
+  for (size_t i = 0; i < part_count; i++) {
+    payload_len += parts[i].len;
+  }
+  size_t len = sizeof(ssdp_pcap_ip_udp_t) + payload_len;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  const ssdp_pcap_record_t record = {
+      .ts_sec = now.tv_sec,
+      .ts_usec = now.tv_usec,
+      .incl_len = len,
+      .orig_len = len,
+  };
+  xSemaphoreTake(ssdp_capture_lock, portMAX_DELAY);
+  if (!ssdp_capture.active ||
+      (!ssdp_capture.file &&
+       sizeof(record) + len > CONFIG_SSDP_CAPTURE_RING_SIZE)) {
+    xSemaphoreGive(ssdp_capture_lock);
+    return;
+  }
+  ssdp_pcap_ip_udp_t headers = {
+      .version_ihl = 0x45,
+      .total_len = htons(len),
+      .id = htons(ssdp_capture.ip_id++),
+      .ttl = SSDP_CAPTURE_TTL,
+      .protocol = IPPROTO_UDP,
+      .src = src,
+      .dst = dst,
+      .src_port = src_port,
+      .dst_port = dst_port,
+      .udp_len = htons(len - 20),
+  };
+  headers.checksum = ssdp_ip_checksum(&headers, 20);
+  if (!ssdp_capture.file) {
+    ssdp_ring_make_room(sizeof(record) + len);
+  }
+  ssdp_capture_write(&record, sizeof(record));
+  ssdp_capture_write(&headers, sizeof(headers));
+  for (size_t i = 0; i < part_count; i++) {
+    ssdp_capture_write(parts[i].base, parts[i].len);
+  }
+  xSemaphoreGive(ssdp_capture_lock);
+}
+
+esp_err_t ssdp_capture_start(FILE *file) {
+  if (!ssdp_capture_lock) {
+    ssdp_capture_lock =
+        xSemaphoreCreateMutexStatic(&ssdp_capture_lock_buffer);
+  }
+  uint8_t *ring = NULL;
+  if (!file) {
+    ring = (uint8_t *)ssdp_calloc(SSDP_ALLOC_CAPTURE,
+                                  CONFIG_SSDP_CAPTURE_RING_SIZE, 1);
+    if (!ring) {
+      ESP_LOGE(TAG, "Memory allocation error for capture ring");
+      return ESP_ERR_NO_MEM;
+    }
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(ssdp_capture_lock, portMAX_DELAY);
+  if (ssdp_capture.active) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    // Ring of the previous capture, kept until now for ssdp_capture_dump()
+    uint8_t *previous = ssdp_capture.ring;
+    ssdp_capture.file = file;
+    ssdp_capture.ring = ring;
+    ring = previous;
+    ssdp_capture.head = 0;
+    ssdp_capture.used = 0;
+    if (file) {
+      ssdp_pcap_header_t header;
+      ssdp_capture_header(&header);
+      fwrite(&header, 1, sizeof(header), file);
+    }
+    ssdp_capture.active = true;
+  }
+  xSemaphoreGive(ssdp_capture_lock);
+  ssdp_free(ring);
+  return err;
+}
+
+esp_err_t ssdp_capture_stop() {
+  if (!ssdp_capture_lock) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(ssdp_capture_lock, portMAX_DELAY);
+  bool active = ssdp_capture.active;
+  ssdp_capture.active = false;
+  if (ssdp_capture.file) {
+    // The caller owns the file
+    fflush(ssdp_capture.file);
+    ssdp_capture.file = NULL;
+  }
+  // The ring is kept for ssdp_capture_dump() until the next start
+  xSemaphoreGive(ssdp_capture_lock);
+  return active ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t ssdp_capture_dump(FILE *out) {
+  if (!out) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (!ssdp_capture_lock) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(ssdp_capture_lock, portMAX_DELAY);
+  if (!ssdp_capture.ring) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    ssdp_pcap_header_t header;
+    ssdp_capture_header(&header);
+    fwrite(&header, 1, sizeof(header), out);
+    size_t first = CONFIG_SSDP_CAPTURE_RING_SIZE - ssdp_capture.head;
+    if (first > ssdp_capture.used) {
+      first = ssdp_capture.used;
+    }
+    fwrite(ssdp_capture.ring + ssdp_capture.head, 1, first, out);
+    fwrite(ssdp_capture.ring, 1, ssdp_capture.used - first, out);
+    fflush(out);
+  }
+  xSemaphoreGive(ssdp_capture_lock);
+  return err;
+}
+
+#else
+esp_err_t ssdp_capture_start(FILE *file) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t ssdp_capture_stop() { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t ssdp_capture_dump(FILE *out) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
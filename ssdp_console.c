@@ -0,0 +1,212 @@
+/*
+  ssdp_console.c esp_console commands to inspect and drive the responder
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_console.h"
+#include "lwip/ip4_addr.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+/*
+ * Local Functions
+ */
+
+static int ssdp_console_usage() {
+  printf(
+      "Usage: ssdp status | stats | trace dump | trace reset | notify now |\n"
+      "            search <st> | config\n");
+  return 1;
+}
+
+static const char *ssdp_console_str(const char *str) {
+  return str[0] ? str : "(none)";
+}
+
+static int ssdp_console_status() {
+  ssdp_status_t status;
+  if (ssdp_get_status(&status) != ESP_OK) {
+    printf("SSDP not started\n");
+    return 1;
+  }
+  ip4_addr_t ip = {.addr = status.local_addr};
+  printf("running:       %s\n", status.running ? "yes" : "no");
+  printf("address:       %s\n", status.local_addr ? ip4addr_ntoa(&ip) : "-");
+  printf("sockets:       multicast %s, unicast %s\n",
+         status.multicast_open ? "open" : "closed",
+         status.search_port ? (status.unicast_open ? "open" : "closed")
+                            : "disabled");
+  printf("uuid:          %s\n", ssdp_console_str(status.uuid));
+  printf("BOOTID:        %" PRIu32 "\n", status.boot_id);
+  printf("CONFIGID:      %" PRIu32 "\n", status.config_id);
+  printf("next NOTIFY:   %s%" PRId64 " ms\n",
+         status.next_notify < 0 ? "late by " : "in ",
+         status.next_notify < 0 ? -status.next_notify : status.next_notify);
+  printf("pending:       %u search responses, %u retries\n",
+         (unsigned)status.pending_count, (unsigned)status.retry_count);
+  printf("subscribers:   %u\n", (unsigned)ssdp_gena_subscriber_count());
+  return 0;
+}
+
+static int ssdp_console_stats() {
+  ssdp_mem_stats_t mem;
+  ssdp_tx_stats_t tx;
+  ssdp_get_mem_stats(&mem);
+  ssdp_get_tx_stats(&tx);
+  printf("heap:          %u bytes, peak %u\n", (unsigned)mem.heap_current,
+         (unsigned)mem.heap_peak);
+  printf("allocations:   start %" PRIu32 ", send %" PRIu32 ", schema %" PRIu32
+         ", gena %" PRIu32 ", freed %" PRIu32 ", failed %" PRIu32 "\n",
+         mem.alloc_count[SSDP_ALLOC_START], mem.alloc_count[SSDP_ALLOC_SEND],
+         mem.alloc_count[SSDP_ALLOC_SCHEMA], mem.alloc_count[SSDP_ALLOC_GENA],
+         mem.free_count, mem.alloc_failed);
+  if (mem.stack_size) {
+    printf("stack:         %u bytes, %u never used\n",
+           (unsigned)mem.stack_size, (unsigned)mem.stack_high_water);
+  }
+  printf("sent:          %" PRIu32 " datagrams\n", tx.sent);
+  printf("retries:       %" PRIu32 " deferred, %" PRIu32 " recovered, "
+         "queue %u (peak %u)\n",
+         tx.deferred, tx.recovered, (unsigned)tx.queue_depth,
+         (unsigned)tx.queue_peak);
+  printf("dropped:       %" PRIu32 " queue full, %" PRIu32 " late, %" PRIu32
+         " errors\n",
+         tx.dropped_full, tx.dropped_late, tx.dropped_error);
+  return 0;
+}
+
+static int ssdp_console_trace(const char *action) {
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if (action && strcmp(action, "dump") == 0) {
+    err = ssdp_dump_trace_stats();
+  } else if (action && strcmp(action, "reset") == 0) {
+    err = ssdp_reset_trace_stats();
+  } else {
+    return ssdp_console_usage();
+  }
+  if (err == ESP_ERR_NOT_SUPPORTED) {
+    printf("Tracing disabled, see CONFIG_SSDP_TRACE\n");
+  }
+  return err == ESP_OK ? 0 : 1;
+}
+
+static int ssdp_console_notify(const char *action) {
+  if (!action || strcmp(action, "now") != 0) {
+    return ssdp_console_usage();
+  }
+  if (ssdp_notify_now() != ESP_OK) {
+    printf("SSDP not started\n");
+    return 1;
+  }
+  printf("NOTIFY requested\n");
+  return 0;
+}
+
+static void ssdp_console_print_target(const ssdp_manifest_target_t *target,
+                                      void *arg) {
+  // "<ST>\r\nUSN: <USN>\r\n"
+  const char *line = target->line;
+  const char *eol = strchr(line, '\r');
+  int st_len = eol ? eol - line : (int)strlen(line);
+  const char *usn = eol ? eol + 2 : "";
+  int usn_len = strcspn(usn, "\r");
+  printf("ST: %.*s\n%.*s\n", st_len, line, usn_len, usn);
+}
+
+// Dry run of the matching: what a search for st would be answered with
+static int ssdp_console_search(const char *st) {
+  if (!st) {
+    return ssdp_console_usage();
+  }
+  if (ssdp_search_targets(st, ssdp_console_print_target, NULL) == 0) {
+    printf("No response to ST: %s\n", st);
+    return 1;
+  }
+  return 0;
+}
+
+static int ssdp_console_config() {
+  ssdp_status_t status;
+  if (ssdp_get_status(&status) != ESP_OK) {
+    printf("SSDP not started\n");
+    return 1;
+  }
+  printf("identity:      %s\n", status.manifest ? "manifest" : "runtime");
+  printf("device type:   %s\n", ssdp_console_str(status.device_type));
+  printf("schema url:    %s\n", ssdp_console_str(status.schema_url));
+  printf("http port:     %u\n", status.port);
+  printf("search port:   %u\n", status.search_port);
+  printf("ttl:           %u\n", status.ttl);
+  printf("max-age:       %" PRIu32 " s, NOTIFY every %" PRIu32
+         " s minus up to %u%%\n",
+         status.max_age, status.notify_period, status.jitter_percent);
+  printf("mx max delay:  %u ms\n", status.mx_max_delay);
+  printf("targets:       %u\n", (unsigned)status.target_count);
+  printf("source filter: %u allowed, %u denied, own packets %s\n",
+         (unsigned)status.allowed_source_count,
+         (unsigned)status.denied_source_count,
+         status.ignore_own_packets ? "ignored" : "parsed");
+  if (status.relay) {
+    printf("relay:         AP <-> STA, %u upstream devices cached\n",
+           (unsigned)status.relay_cached);
+  } else {
+    printf("relay:         off\n");
+  }
+  return 0;
+}
+
+static int ssdp_console_command(int argc, char **argv) {
+  if (argc < 2) {
+    return ssdp_console_usage();
+  }
+  const char *command = argv[1];
+  const char *arg = argc > 2 ? argv[2] : NULL;
+  if (strcmp(command, "status") == 0) {
+    return ssdp_console_status();
+  }
+  if (strcmp(command, "stats") == 0) {
+    return ssdp_console_stats();
+  }
+  if (strcmp(command, "trace") == 0) {
+    return ssdp_console_trace(arg);
+  }
+  if (strcmp(command, "notify") == 0) {
+    return ssdp_console_notify(arg);
+  }
+  if (strcmp(command, "search") == 0) {
+    return ssdp_console_search(arg);
+  }
+  if (strcmp(command, "config") == 0) {
+    return ssdp_console_config();
+  }
+  return ssdp_console_usage();
+}
+
+/*
+ * Global Functions
+ */
+esp_err_t ssdp_register_console_commands() {
+  const esp_console_cmd_t command = {
+      .command = "ssdp",
+      .help = "Inspect the SSDP responder while it runs",
+      .hint = "status|stats|trace dump|trace reset|notify now|search <st>|"
+              "config",
+      .func = &ssdp_console_command,
+  };
+  return esp_console_cmd_register(&command);
+}
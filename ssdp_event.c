@@ -0,0 +1,92 @@
+/*
+  ssdp_event.c SSDP_EVENT events posted on the default event loop
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "esp_event.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+ESP_EVENT_DEFINE_BASE(SSDP_EVENT);
+
+#if CONFIG_SSDP_EVENTS
+
+/*
+ * Defines
+ */
+#define SSDP_EVENT_WINDOW 1000  // ms, event_rate is per window
+
+/*
+ * Global variables
+ */
+
+// Kinds posted, 0 while stopped, read by SSDP_EVENT_ENABLED()
+volatile uint32_t ssdp_event_mask = 0;
+static uint16_t ssdp_event_rate = 0;
+// Posted from the SSDP task, and from the application at start and stop
+static portMUX_TYPE ssdp_event_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+  uint64_t window_start;
+  uint16_t count;
+} ssdp_event_budget[SSDP_EVENT_MAX];
+
+/*
+ * Global Functions
+ */
+
+void ssdp_event_start(uint32_t mask, uint16_t rate) {
+  portENTER_CRITICAL(&ssdp_event_lock);
+  for (size_t i = 0; i < SSDP_EVENT_MAX; i++) {
+    ssdp_event_budget[i].window_start = 0;
+    ssdp_event_budget[i].count = 0;
+  }
+  ssdp_event_rate = rate;
+  ssdp_event_mask = mask & SSDP_EVENT_MASK_ALL;
+  portEXIT_CRITICAL(&ssdp_event_lock);
+}
+
+void ssdp_event_stop() { ssdp_event_mask = 0; }
+
+void ssdp_event_post(ssdp_event_id_t id, const void *data, size_t size) {
+  if (!SSDP_EVENT_ENABLED(id)) {
+    return;
+  }
+  uint64_t now = ssdp_millis();
+  bool allowed = true;
+  portENTER_CRITICAL(&ssdp_event_lock);
+  if (ssdp_event_rate) {
+    // Fixed window: a burst beyond the rate is dropped until the next one
+    if (now - ssdp_event_budget[id].window_start >= SSDP_EVENT_WINDOW) {
+      ssdp_event_budget[id].window_start = now;
+      ssdp_event_budget[id].count = 0;
+    }
+    allowed = ssdp_event_budget[id].count < ssdp_event_rate;
+    if (allowed) {
+      ssdp_event_budget[id].count++;
+    }
+  }
+  portEXIT_CRITICAL(&ssdp_event_lock);
+  if (allowed) {
+    // No wait: a full event queue or no default loop loses the event
+    esp_event_post(SSDP_EVENT, id, data, size, 0);
+  }
+}
+
+#else
+void ssdp_event_start(uint32_t mask, uint16_t rate) {}
+
+void ssdp_event_stop() {}
+
+void ssdp_event_post(ssdp_event_id_t id, const void *data, size_t size) {}
+#endif
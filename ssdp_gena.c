@@ -0,0 +1,812 @@
+/*
+  ssdp_gena.c GENA eventing for the services of the description
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_log.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+static const char *TAG = "esp-ssdp-gena";
+
+/*
+ * Defines
+ */
+#define SSDP_GENA_SERVICES_MAX 4
+#define SSDP_GENA_VARIABLES_MAX 8  // per service, one dirty bit each
+// Dirty bit of the initial event, sent even before any variable is set
+#define SSDP_GENA_INITIAL_EVENT (1u << 31)
+#define SSDP_GENA_SUBSCRIBERS_MAX 8
+#define SSDP_GENA_TIMEOUT_MIN 60     // s
+#define SSDP_GENA_SEND_TIMEOUT 5000  // ms to deliver one event
+#define SSDP_GENA_POLL_INTERVAL 20   // ms while an event is in flight
+
+/*
+ * Sizes
+ */
+#define SSDP_GENA_SERVICE_ID_SIZE 64
+#define SSDP_GENA_URL_SIZE 64
+#define SSDP_GENA_NAME_SIZE 32
+#define SSDP_GENA_VALUE_SIZE 64
+#define SSDP_GENA_PATH_SIZE 96
+#define SSDP_GENA_SID_SIZE 42  // "uuid:" and 36 characters
+#define SSDP_GENA_HEADER_SIZE 160
+#define SSDP_GENA_TIMEOUT_SIZE 24
+#define SSDP_GENA_HEAD_SIZE 320
+#define SSDP_GENA_MESSAGE_SIZE 1460
+
+/*
+ * Templates messages
+ */
+
+static const char SSDP_GENA_NOTIFY_TEMPLATE[] =
+    "NOTIFY %s HTTP/1.1\r\n"  // callback path
+    "HOST: %s:%u\r\n"         // callback address and port
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+    "CONTENT-LENGTH: %u\r\n"
+    "NT: upnp:event\r\n"
+    "NTS: upnp:propchange\r\n"
+    "SID: %s\r\n"
+    "SEQ: %" PRIu32 "\r\n"
+    "CONNECTION: close\r\n"
+    "\r\n";
+
+static const char SSDP_GENA_BODY_HEAD[] =
+    "<?xml version=\"1.0\"?>"
+    "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">";
+
+static const char SSDP_GENA_PROPERTY_TEMPLATE[] =
+    "<e:property><%s>%s</%s></e:property>";
+
+static const char SSDP_GENA_BODY_TAIL[] = "</e:propertyset>";
+
+/*
+ * Struct definitions
+ */
+
+typedef struct {
+  char name[SSDP_GENA_NAME_SIZE];
+  char value[SSDP_GENA_VALUE_SIZE];  // already escaped for XML
+} ssdp_gena_variable_t;
+
+// Evented service of the description, identified by its serviceId
+typedef struct {
+  char service_id[SSDP_GENA_SERVICE_ID_SIZE];
+  char event_url[SSDP_GENA_URL_SIZE];  // eventSubURL, always starts with '/'
+  ssdp_gena_variable_t variables[SSDP_GENA_VARIABLES_MAX];
+  size_t variable_count;
+} ssdp_gena_service_t;
+
+typedef enum {
+  SSDP_GENA_IDLE,
+  SSDP_GENA_CONNECTING,
+  SSDP_GENA_SENDING,
+  SSDP_GENA_RECEIVING,
+} ssdp_gena_state_t;
+
+typedef struct {
+  char sid[SSDP_GENA_SID_SIZE];  // empty when the slot is free
+  size_t service;
+  struct sockaddr_in callback;
+  char path[SSDP_GENA_PATH_SIZE];
+  uint64_t expiry;
+  uint32_t seq;
+  uint32_t dirty;       // variables changed since the last event
+  uint64_t next_event;  // moderation, changes until then are coalesced
+  // Event in flight
+  ssdp_gena_state_t state;
+  int sock;
+  char *message;
+  size_t offset;  // next byte to send
+  size_t len;
+  uint64_t deadline;
+} ssdp_gena_subscriber_t;
+
+typedef struct {
+  uint16_t moderation;
+  uint32_t timeout_max;
+  ssdp_gena_service_t services[SSDP_GENA_SERVICES_MAX];
+  size_t service_count;
+  ssdp_gena_subscriber_t subscribers[SSDP_GENA_SUBSCRIBERS_MAX];
+} ssdp_gena_t;
+
+/*
+ * Global variables
+ */
+
+// Shared by the application (ssdp_gena_set), the httpd task (subscriptions)
+// and the SSDP task (deliveries), the lock lives as long as the program
+static ssdp_gena_t *ssdp_gena = NULL;
+static SemaphoreHandle_t ssdp_gena_lock = NULL;
+static StaticSemaphore_t ssdp_gena_lock_buffer;
+
+/*
+ * Local Functions
+ */
+
+// Copy the text of the first <tag> in [start, end)
+static bool ssdp_gena_find_tag(const char *start, const char *end,
+                               const char *tag, char *value, size_t size) {
+  char open_tag[SSDP_GENA_NAME_SIZE];
+  char close_tag[SSDP_GENA_NAME_SIZE];
+  snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
+  snprintf(close_tag, sizeof(close_tag), "</%s>", tag);
+  const char *text = strstr(start, open_tag);
+  if (!text || text >= end) {
+    return false;
+  }
+  text += strlen(open_tag);
+  const char *text_end = strstr(text, close_tag);
+  if (!text_end || text_end > end || (size_t)(text_end - text) >= size) {
+    return false;
+  }
+  memcpy(value, text, text_end - text);
+  value[text_end - text] = 0;
+  return true;
+}
+
+// The services with an eventSubURL in the serviceList of the description
+static void ssdp_gena_parse_services(const char *description) {
+  const char *service = description;
+  while ((service = strstr(service, "<service>")) != NULL) {
+    const char *end = strstr(service, "</service>");
+    if (!end) {
+      break;
+    }
+    if (ssdp_gena->service_count == SSDP_GENA_SERVICES_MAX) {
+      ESP_LOGW(TAG, "Only %d services are evented", SSDP_GENA_SERVICES_MAX);
+      break;
+    }
+    ssdp_gena_service_t *entry =
+        &ssdp_gena->services[ssdp_gena->service_count];
+    char url[SSDP_GENA_URL_SIZE - 1];
+    if (ssdp_gena_find_tag(service, end, "serviceId", entry->service_id,
+                           sizeof(entry->service_id)) &&
+        ssdp_gena_find_tag(service, end, "eventSubURL", url, sizeof(url)) &&
+        url[0]) {
+      snprintf(entry->event_url, sizeof(entry->event_url), "%s%s",
+               url[0] == '/' ? "" : "/", url);
+      ssdp_gena->service_count++;
+    } else {
+      memset(entry, 0, sizeof(ssdp_gena_service_t));
+    }
+    service = end;
+  }
+}
+
+static int ssdp_gena_find_service(const char *service_id) {
+  for (size_t i = 0; i < ssdp_gena->service_count; i++) {
+    if (strcmp(ssdp_gena->services[i].service_id, service_id) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static ssdp_gena_subscriber_t *ssdp_gena_find_subscriber(const char *sid) {
+  for (size_t i = 0; i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+    if (ssdp_gena->subscribers[i].sid[0] &&
+        strcmp(ssdp_gena->subscribers[i].sid, sid) == 0) {
+      return &ssdp_gena->subscribers[i];
+    }
+  }
+  return NULL;
+}
+
+static void ssdp_gena_close(ssdp_gena_subscriber_t *subscriber) {
+  if (subscriber->sock >= 0) {
+    close(subscriber->sock);
+    subscriber->sock = -1;
+  }
+  ssdp_free(subscriber->message);
+  subscriber->message = NULL;
+  subscriber->state = SSDP_GENA_IDLE;
+}
+
+static void ssdp_gena_release(ssdp_gena_subscriber_t *subscriber) {
+  ssdp_gena_close(subscriber);
+  memset(subscriber, 0, sizeof(ssdp_gena_subscriber_t));
+  subscriber->sock = -1;
+}
+
+// The name is the element of its property: an XML NCName, ASCII only
+static bool ssdp_gena_valid_name(const char *name) {
+  if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+    return false;
+  }
+  for (const char *c = name + 1; *c; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-' && *c != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Escape &, < and > so any value can be carried in the property set
+static bool ssdp_gena_escape(const char *value, char *escaped, size_t size) {
+  size_t len = 0;
+  for (; *value; value++) {
+    const char *entity = *value == '&'   ? "&amp;"
+                         : *value == '<' ? "&lt;"
+                         : *value == '>' ? "&gt;"
+                                         : NULL;
+    size_t entity_len = entity ? strlen(entity) : 1;
+    if (len + entity_len >= size) {
+      return false;
+    }
+    if (entity) {
+      memcpy(escaped + len, entity, entity_len);
+    } else {
+      escaped[len] = *value;
+    }
+    len += entity_len;
+  }
+  escaped[len] = 0;
+  return true;
+}
+
+// First URL of "<http://host:port/path><...>", host must be an IPv4 address
+static bool ssdp_gena_parse_callback(const char *callback,
+                                     struct sockaddr_in *addr, char *path,
+                                     size_t path_size) {
+  static const char prefix[] = "<http://";
+  const char *host = strstr(callback, prefix);
+  if (!host) {
+    return false;
+  }
+  host += sizeof(prefix) - 1;
+  const char *end = strchr(host, '>');
+  if (!end) {
+    return false;
+  }
+  const char *slash = memchr(host, '/', end - host);
+  const char *host_end = slash ? slash : end;
+  const char *colon = memchr(host, ':', host_end - host);
+  char address[16];
+  size_t address_len = (colon ? colon : host_end) - host;
+  if (address_len == 0 || address_len >= sizeof(address)) {
+    return false;
+  }
+  memcpy(address, host, address_len);
+  address[address_len] = 0;
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  if (inet_aton(address, &addr->sin_addr) != 1) {
+    return false;
+  }
+  unsigned long port = colon ? strtoul(colon + 1, NULL, 10) : 80;
+  if (port == 0 || port > UINT16_MAX) {
+    return false;
+  }
+  addr->sin_port = htons(port);
+  size_t path_len = slash ? (size_t)(end - slash) : 0;
+  if (path_len >= path_size) {
+    return false;
+  }
+  if (slash) {
+    memcpy(path, slash, path_len);
+    path[path_len] = 0;
+  } else {
+    strcpy(path, "/");
+  }
+  return true;
+}
+
+static void ssdp_gena_new_sid(char *sid) {
+  uint16_t r[8];
+  for (size_t i = 0; i < 8; i++) {
+    r[i] = ssdp_random(0, UINT16_MAX);
+  }
+  snprintf(sid, SSDP_GENA_SID_SIZE,
+           "uuid:%04x%04x-%04x-4%03x-%04x-%04x%04x%04x", r[0], r[1], r[2],
+           r[3] & 0xfff, (r[4] & 0x3fff) | 0x8000, r[5], r[6], r[7]);
+}
+
+// "Second-N" or "Second-infinite", bounded by timeout_max
+static uint32_t ssdp_gena_parse_timeout(const char *timeout) {
+  uint32_t seconds = ssdp_gena->timeout_max;
+  if (strncasecmp(timeout, "Second-", 7) == 0 &&
+      strcasecmp(timeout + 7, "infinite") != 0) {
+    unsigned long requested = strtoul(timeout + 7, NULL, 10);
+    if (requested < seconds) {
+      seconds = requested;
+    }
+  }
+  return seconds < SSDP_GENA_TIMEOUT_MIN ? SSDP_GENA_TIMEOUT_MIN : seconds;
+}
+
+// Render the changed variables, as many as fit, and open the connection
+static void ssdp_gena_begin_event(ssdp_gena_subscriber_t *subscriber,
+                                  uint64_t now) {
+  const ssdp_gena_service_t *service =
+      &ssdp_gena->services[subscriber->service];
+  char *message =
+      (char *)ssdp_calloc(SSDP_ALLOC_GENA, SSDP_GENA_MESSAGE_SIZE, 1);
+  if (!message) {
+    ESP_LOGE(TAG, "Memory allocation error for event");
+    subscriber->next_event = now + ssdp_gena->moderation;
+    return;
+  }
+  // The body goes after room for the head, which is then put in front of it
+  char *body = message + SSDP_GENA_HEAD_SIZE;
+  size_t body_size = SSDP_GENA_MESSAGE_SIZE - SSDP_GENA_HEAD_SIZE -
+                     sizeof(SSDP_GENA_BODY_TAIL);
+  size_t body_len = snprintf(body, body_size, "%s", SSDP_GENA_BODY_HEAD);
+  uint32_t sent = SSDP_GENA_INITIAL_EVENT;
+  for (size_t i = 0; i < service->variable_count; i++) {
+    if (!(subscriber->dirty & (1u << i))) {
+      continue;
+    }
+    const ssdp_gena_variable_t *variable = &service->variables[i];
+    int len = snprintf(body + body_len, body_size - body_len,
+                       SSDP_GENA_PROPERTY_TEMPLATE, variable->name,
+                       variable->value, variable->name);
+    if (len < 0 || (size_t)len >= body_size - body_len) {
+      // The others go with the next event
+      break;
+    }
+    body_len += len;
+    sent |= 1u << i;
+  }
+  strcpy(body + body_len, SSDP_GENA_BODY_TAIL);
+  body_len += sizeof(SSDP_GENA_BODY_TAIL) - 1;
+  char host[16];
+  inet_ntoa_r(subscriber->callback.sin_addr, host, sizeof(host));
+  char head[SSDP_GENA_HEAD_SIZE];
+  int head_len = snprintf(head, sizeof(head), SSDP_GENA_NOTIFY_TEMPLATE,
+                          subscriber->path, host,
+                          ntohs(subscriber->callback.sin_port),
+                          (unsigned)body_len, subscriber->sid,
+                          subscriber->seq);
+  if (head_len < 0 || (size_t)head_len >= sizeof(head)) {
+    ESP_LOGE(TAG, "Event head too long for %s", subscriber->sid);
+    ssdp_free(message);
+    subscriber->next_event = now + ssdp_gena->moderation;
+    return;
+  }
+  memcpy(body - head_len, head, head_len);
+  subscriber->message = message;
+  subscriber->offset = SSDP_GENA_HEAD_SIZE - head_len;
+  subscriber->len = SSDP_GENA_HEAD_SIZE + body_len;
+  subscriber->dirty &= ~sent;
+  // A lost event still uses its SEQ, the gap tells the control point
+  subscriber->seq = subscriber->seq == UINT32_MAX ? 1 : subscriber->seq + 1;
+  subscriber->deadline = now + SSDP_GENA_SEND_TIMEOUT;
+
+  subscriber->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (subscriber->sock < 0) {
+    ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+    ssdp_gena_close(subscriber);
+    subscriber->next_event = now + ssdp_gena->moderation;
+    return;
+  }
+  fcntl(subscriber->sock, F_SETFL, O_NONBLOCK);
+  if (connect(subscriber->sock, (struct sockaddr *)&subscriber->callback,
+              sizeof(struct sockaddr_in)) == 0) {
+    subscriber->state = SSDP_GENA_SENDING;
+  } else if (errno == EINPROGRESS) {
+    subscriber->state = SSDP_GENA_CONNECTING;
+  } else {
+    ESP_LOGW(TAG, "Failed to connect %s: errno %d", host, errno);
+    ssdp_gena_close(subscriber);
+    subscriber->next_event = now + ssdp_gena->moderation;
+  }
+}
+
+static bool ssdp_gena_would_block() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// One non-blocking step of the event in flight, never waits
+static void ssdp_gena_advance(ssdp_gena_subscriber_t *subscriber,
+                              uint64_t now) {
+  bool done = false;
+  bool failed = false;
+  if (subscriber->state == SSDP_GENA_CONNECTING) {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(subscriber->sock, &writable);
+    struct timeval immediate = {0};
+    if (select(subscriber->sock + 1, NULL, &writable, NULL, &immediate) > 0) {
+      int error = 0;
+      socklen_t len = sizeof(error);
+      getsockopt(subscriber->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+      if (error == 0) {
+        subscriber->state = SSDP_GENA_SENDING;
+      } else {
+        errno = error;
+        failed = true;
+      }
+    }
+  }
+  if (subscriber->state == SSDP_GENA_SENDING && !failed) {
+    int sent = send(subscriber->sock, subscriber->message + subscriber->offset,
+                    subscriber->len - subscriber->offset, MSG_DONTWAIT);
+    if (sent > 0) {
+      subscriber->offset += sent;
+      if (subscriber->offset == subscriber->len) {
+        subscriber->state = SSDP_GENA_RECEIVING;
+      }
+    } else if (sent < 0 && !ssdp_gena_would_block()) {
+      failed = true;
+    }
+  } else if (subscriber->state == SSDP_GENA_RECEIVING) {
+    // The status line is enough, the control point closes the connection
+    char status[16];
+    int len = recv(subscriber->sock, status, sizeof(status) - 1, MSG_DONTWAIT);
+    if (len > 0) {
+      status[len] = 0;
+      if (strncmp(status, "HTTP/1.1 2", 10) != 0 &&
+          strncmp(status, "HTTP/1.0 2", 10) != 0) {
+        ESP_LOGW(TAG, "Event %" PRIu32 " refused by %s", subscriber->seq - 1,
+                 subscriber->sid);
+      }
+      done = true;
+    } else if (len == 0) {
+      done = true;
+    } else if (!ssdp_gena_would_block()) {
+      failed = true;
+    }
+  }
+  if (!done && !failed && now >= subscriber->deadline) {
+    errno = ETIMEDOUT;
+    failed = true;
+  }
+  if (failed) {
+    ESP_LOGW(TAG, "Event to %s lost: errno %d", subscriber->sid, errno);
+  }
+  if (done || failed) {
+    ssdp_gena_close(subscriber);
+    subscriber->next_event = now + ssdp_gena->moderation;
+  }
+}
+
+static esp_err_t ssdp_gena_reply(httpd_req_t *req, const char *status) {
+  httpd_resp_set_status(req, status);
+  return httpd_resp_send(req, NULL, 0);
+}
+
+static bool ssdp_gena_get_header(httpd_req_t *req, const char *field,
+                                 char *value, size_t size) {
+  return httpd_req_get_hdr_value_str(req, field, value, size) == ESP_OK;
+}
+
+static esp_err_t ssdp_gena_subscribe_handler(httpd_req_t *req) {
+  char sid[SSDP_GENA_SID_SIZE];
+  char callback[SSDP_GENA_HEADER_SIZE];
+  char nt[SSDP_GENA_TIMEOUT_SIZE];
+  char timeout[SSDP_GENA_TIMEOUT_SIZE] = "";
+  bool has_sid = ssdp_gena_get_header(req, "SID", sid, sizeof(sid));
+  bool has_callback =
+      ssdp_gena_get_header(req, "CALLBACK", callback, sizeof(callback));
+  bool has_nt = ssdp_gena_get_header(req, "NT", nt, sizeof(nt));
+  ssdp_gena_get_header(req, "TIMEOUT", timeout, sizeof(timeout));
+  if (has_sid && (has_callback || has_nt)) {
+    return ssdp_gena_reply(req, "400 Bad Request");
+  }
+  if (!has_sid &&
+      (!has_callback || !has_nt || strcmp(nt, "upnp:event") != 0)) {
+    return ssdp_gena_reply(req, "412 Precondition Failed");
+  }
+  const char *status = NULL;
+  uint32_t seconds = 0;
+  uint64_t now = ssdp_millis();
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  if (!ssdp_gena) {
+    status = "404 Not Found";
+  } else if (has_sid) {
+    // Renewal
+    ssdp_gena_subscriber_t *subscriber = ssdp_gena_find_subscriber(sid);
+    if (!subscriber || subscriber->service != (size_t)req->user_ctx) {
+      status = "412 Precondition Failed";
+    } else {
+      seconds = ssdp_gena_parse_timeout(timeout);
+      subscriber->expiry = now + seconds * 1000ULL;
+    }
+  } else {
+    ssdp_gena_subscriber_t *subscriber = NULL;
+    for (size_t i = 0; !subscriber && i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+      ssdp_gena_subscriber_t *slot = &ssdp_gena->subscribers[i];
+      if (!slot->sid[0] ||
+          (slot->state == SSDP_GENA_IDLE && slot->expiry <= now)) {
+        subscriber = slot;
+      }
+    }
+    if (!subscriber) {
+      status = "503 Service Unavailable";
+    } else {
+      ssdp_gena_release(subscriber);
+      if (!ssdp_gena_parse_callback(callback, &subscriber->callback,
+                                    subscriber->path,
+                                    sizeof(subscriber->path))) {
+        status = "412 Precondition Failed";
+      } else {
+        const ssdp_gena_service_t *service =
+            &ssdp_gena->services[(size_t)req->user_ctx];
+        ssdp_gena_new_sid(subscriber->sid);
+        subscriber->service = (size_t)req->user_ctx;
+        seconds = ssdp_gena_parse_timeout(timeout);
+        subscriber->expiry = now + seconds * 1000ULL;
+        // Initial event with every variable, after the response goes out,
+        // an empty propertyset if none is set yet
+        subscriber->dirty = SSDP_GENA_INITIAL_EVENT |
+                            ((1u << service->variable_count) - 1);
+        subscriber->next_event = now + SSDP_GENA_POLL_INTERVAL;
+        strcpy(sid, subscriber->sid);
+        ESP_LOGI(TAG, "%s subscribed to %s for %" PRIu32 " s", sid,
+                 service->service_id, seconds);
+      }
+    }
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  if (status) {
+    return ssdp_gena_reply(req, status);
+  }
+  snprintf(timeout, sizeof(timeout), "Second-%" PRIu32, seconds);
+  httpd_resp_set_hdr(req, "SID", sid);
+  httpd_resp_set_hdr(req, "TIMEOUT", timeout);
+  return httpd_resp_send(req, NULL, 0);
+}
+
+static esp_err_t ssdp_gena_unsubscribe_handler(httpd_req_t *req) {
+  char sid[SSDP_GENA_SID_SIZE];
+  char header[SSDP_GENA_HEADER_SIZE];
+  if (ssdp_gena_get_header(req, "CALLBACK", header, sizeof(header)) ||
+      ssdp_gena_get_header(req, "NT", header, sizeof(header))) {
+    return ssdp_gena_reply(req, "400 Bad Request");
+  }
+  if (!ssdp_gena_get_header(req, "SID", sid, sizeof(sid))) {
+    return ssdp_gena_reply(req, "412 Precondition Failed");
+  }
+  bool found = false;
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  if (ssdp_gena) {
+    ssdp_gena_subscriber_t *subscriber = ssdp_gena_find_subscriber(sid);
+    if (subscriber && subscriber->service == (size_t)req->user_ctx) {
+      ssdp_gena_release(subscriber);
+      found = true;
+    }
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  if (!found) {
+    return ssdp_gena_reply(req, "412 Precondition Failed");
+  }
+  return httpd_resp_send(req, NULL, 0);
+}
+
+/*
+ * Global Functions
+ */
+
+esp_err_t ssdp_gena_start(const char *description, uint16_t moderation,
+                          uint32_t timeout_max) {
+  if (!ssdp_gena_lock) {
+    ssdp_gena_lock = xSemaphoreCreateMutexStatic(&ssdp_gena_lock_buffer);
+  }
+  ssdp_gena_t *gena =
+      (ssdp_gena_t *)ssdp_calloc(SSDP_ALLOC_GENA, 1, sizeof(ssdp_gena_t));
+  if (!gena) {
+    ESP_LOGE(TAG, "Memory allocation error for GENA");
+    return ESP_ERR_NO_MEM;
+  }
+  gena->moderation = moderation;
+  gena->timeout_max =
+      timeout_max < SSDP_GENA_TIMEOUT_MIN ? SSDP_GENA_TIMEOUT_MIN : timeout_max;
+  for (size_t i = 0; i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+    gena->subscribers[i].sock = -1;
+  }
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  ssdp_gena = gena;
+  ssdp_gena_parse_services(description);
+  if (ssdp_gena->service_count == 0) {
+    // Nothing evented, no need to keep the tables
+    ssdp_gena = NULL;
+    ssdp_free(gena);
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  return ESP_OK;
+}
+
+void ssdp_gena_stop() {
+  if (!ssdp_gena_lock) {
+    return;
+  }
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  if (ssdp_gena) {
+    for (size_t i = 0; i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+      ssdp_gena_close(&ssdp_gena->subscribers[i]);
+    }
+    ssdp_free(ssdp_gena);
+    ssdp_gena = NULL;
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+}
+
+uint32_t ssdp_gena_poll(uint64_t now) {
+  uint32_t delay = UINT32_MAX;
+  if (!ssdp_gena_lock) {
+    return delay;
+  }
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  for (size_t i = 0; ssdp_gena && i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+    ssdp_gena_subscriber_t *subscriber = &ssdp_gena->subscribers[i];
+    if (!subscriber->sid[0]) {
+      continue;
+    }
+    if (subscriber->state == SSDP_GENA_IDLE) {
+      if (subscriber->expiry <= now) {
+        ESP_LOGI(TAG, "%s expired", subscriber->sid);
+        ssdp_gena_release(subscriber);
+        continue;
+      }
+      if (subscriber->dirty && now >= subscriber->next_event) {
+        ssdp_gena_begin_event(subscriber, now);
+      }
+    }
+    if (subscriber->state != SSDP_GENA_IDLE) {
+      ssdp_gena_advance(subscriber, now);
+    }
+    // Changes can come at any time, look again after one moderation period
+    uint32_t wait = ssdp_gena->moderation;
+    if (subscriber->state != SSDP_GENA_IDLE) {
+      wait = SSDP_GENA_POLL_INTERVAL;
+    } else if (subscriber->dirty) {
+      wait = subscriber->next_event > now ? subscriber->next_event - now : 0;
+    }
+    if (wait < delay) {
+      delay = wait;
+    }
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  return delay;
+}
+
+size_t ssdp_gena_subscriber_count() {
+  size_t count = 0;
+  if (!ssdp_gena_lock) {
+    return count;
+  }
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  for (size_t i = 0; ssdp_gena && i < SSDP_GENA_SUBSCRIBERS_MAX; i++) {
+    if (ssdp_gena->subscribers[i].sid[0]) {
+      count++;
+    }
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  return count;
+}
+
+esp_err_t ssdp_gena_register_httpd_handlers(httpd_handle_t server) {
+  if (!ssdp_gena_lock) {
+    return ESP_OK;
+  }
+  esp_err_t err = ESP_OK;
+  char uri[SSDP_GENA_URL_SIZE];
+  for (size_t i = 0; err == ESP_OK; i++) {
+    xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+    bool found = ssdp_gena && i < ssdp_gena->service_count;
+    if (found) {
+      strcpy(uri, ssdp_gena->services[i].event_url);
+    }
+    xSemaphoreGive(ssdp_gena_lock);
+    if (!found) {
+      break;
+    }
+    // esp_http_server keeps its own copy of the URI
+    const httpd_uri_t subscribe = {
+        .uri = uri,
+        .method = HTTP_SUBSCRIBE,
+        .handler = ssdp_gena_subscribe_handler,
+        .user_ctx = (void *)i,
+    };
+    const httpd_uri_t unsubscribe = {
+        .uri = uri,
+        .method = HTTP_UNSUBSCRIBE,
+        .handler = ssdp_gena_unsubscribe_handler,
+        .user_ctx = (void *)i,
+    };
+    err = httpd_register_uri_handler(server, &subscribe);
+    if (err == ESP_OK) {
+      err = httpd_register_uri_handler(server, &unsubscribe);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to register %s: %s", uri, esp_err_to_name(err));
+    }
+  }
+  return err;
+}
+
+void ssdp_gena_unregister_httpd_handlers(httpd_handle_t server) {
+  if (!ssdp_gena_lock) {
+    return;
+  }
+  char uri[SSDP_GENA_URL_SIZE];
+  for (size_t i = 0;; i++) {
+    xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+    bool found = ssdp_gena && i < ssdp_gena->service_count;
+    if (found) {
+      strcpy(uri, ssdp_gena->services[i].event_url);
+    }
+    xSemaphoreGive(ssdp_gena_lock);
+    if (!found) {
+      break;
+    }
+    httpd_unregister_uri_handler(server, uri, HTTP_SUBSCRIBE);
+    httpd_unregister_uri_handler(server, uri, HTTP_UNSUBSCRIBE);
+  }
+}
+
+esp_err_t ssdp_gena_set(const char *service_id, const char *variable,
+                        const char *value) {
+  if (!service_id || !variable || !value ||
+      !ssdp_gena_valid_name(variable)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  char escaped[SSDP_GENA_VALUE_SIZE];
+  if (strlen(variable) >= SSDP_GENA_NAME_SIZE ||
+      !ssdp_gena_escape(value, escaped, sizeof(escaped))) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (!ssdp_gena_lock) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(ssdp_gena_lock, portMAX_DELAY);
+  int index = ssdp_gena ? ssdp_gena_find_service(service_id) : -1;
+  if (!ssdp_gena) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if (index < 0) {
+    err = ESP_ERR_NOT_FOUND;
+  } else {
+    ssdp_gena_service_t *service = &ssdp_gena->services[index];
+    size_t i = 0;
+    bool created = false;
+    while (i < service->variable_count &&
+           strcmp(service->variables[i].name, variable) != 0) {
+      i++;
+    }
+    if (i == service->variable_count) {
+      if (i == SSDP_GENA_VARIABLES_MAX) {
+        err = ESP_ERR_NO_MEM;
+      } else {
+        strcpy(service->variables[i].name, variable);
+        service->variable_count++;
+        created = true;
+      }
+    }
+    if (err == ESP_OK &&
+        (created || strcmp(service->variables[i].value, escaped) != 0)) {
+      // Only the last value is kept, the subscribers get it at their next
+      // event whatever the number of changes in between
+      strcpy(service->variables[i].value, escaped);
+      for (size_t j = 0; j < SSDP_GENA_SUBSCRIBERS_MAX; j++) {
+        if (ssdp_gena->subscribers[j].sid[0] &&
+            ssdp_gena->subscribers[j].service == (size_t)index) {
+          ssdp_gena->subscribers[j].dirty |= 1u << i;
+        }
+      }
+    }
+  }
+  xSemaphoreGive(ssdp_gena_lock);
+  return err;
+}
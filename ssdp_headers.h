@@ -0,0 +1,69 @@
+/*
+  ssdp_headers.h perfect hash of SSDP header names
+
+  Generated by tools/gen_header_hash.py, do not edit.
+*/
+#ifndef ESP_SSDP_HEADERS_H_
+#define ESP_SSDP_HEADERS_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "ssdp_header_ids.h"
+
+typedef struct {
+  const char *name;
+  uint8_t len;
+  ssdp_header_t id;
+} ssdp_header_entry_t;
+
+static const ssdp_header_entry_t SSDP_HEADERS_TABLE[32] = {
+  {"EXT", 3, SSDP_HEADER_EXT},
+  {"BOOTID.UPNP.ORG", 15, SSDP_HEADER_BOOTID},
+  {"ST", 2, SSDP_HEADER_ST},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"DATE", 4, SSDP_HEADER_DATE},
+  {"LOCATION", 8, SSDP_HEADER_LOCATION},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"SERVER", 6, SSDP_HEADER_SERVER},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"MAN", 3, SSDP_HEADER_MAN},
+  {"CPFN.UPNP.ORG", 13, SSDP_HEADER_CPFN},
+  {"HOST", 4, SSDP_HEADER_HOST},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"USER-AGENT", 10, SSDP_HEADER_USER_AGENT},
+  {"CPUUID.UPNP.ORG", 15, SSDP_HEADER_CPUUID},
+  {"CACHE-CONTROL", 13, SSDP_HEADER_CACHE_CONTROL},
+  {"NEXTBOOTID.UPNP.ORG", 19, SSDP_HEADER_NEXTBOOTID},
+  {"MX", 2, SSDP_HEADER_MX},
+  {"CONFIGID.UPNP.ORG", 17, SSDP_HEADER_CONFIGID},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"SEARCHPORT.UPNP.ORG", 19, SSDP_HEADER_SEARCHPORT},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"USN", 3, SSDP_HEADER_USN},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"NT", 2, SSDP_HEADER_NT},
+  {"NTS", 3, SSDP_HEADER_NTS},
+  {NULL, 0, SSDP_HEADER_UNKNOWN},
+  {"TCPPORT.UPNP.ORG", 16, SSDP_HEADER_TCPPORT},
+};
+
+static inline ssdp_header_t ssdp_header_lookup(const char *name, size_t len) {
+  if (len == 0) {
+    return SSDP_HEADER_UNKNOWN;
+  }
+  const ssdp_header_entry_t *entry =
+      &SSDP_HEADERS_TABLE[(len * 2 + (name[0] | 0x20) * 14 +
+                           (name[len - 1] | 0x20) * 1) &
+                          31];
+  if (entry->len != len || strncasecmp(name, entry->name, len) != 0) {
+    return SSDP_HEADER_UNKNOWN;
+  }
+  return entry->id;
+}
+
+#endif /* ESP_SSDP_HEADERS_H_ */
@@ -0,0 +1,186 @@
+/*
+  ssdp_httpd.c description and SCPD handlers for esp_http_server
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+static const char *TAG = "esp-ssdp-httpd";
+
+/*
+ * Defines
+ */
+#define SSDP_HTTPD_URI_SIZE 72
+#define SSDP_HTTPD_ETAG_SIZE 16
+#define SSDP_HTTPD_HEADER_SIZE 64
+// user_ctx of the description handler, the files use their index + 1
+#define SSDP_HTTPD_DESCRIPTION 0
+
+/*
+ * Local Functions
+ */
+
+// The header may be longer than the buffer, only what fits is checked
+static bool ssdp_httpd_header_contains(httpd_req_t *req, const char *field,
+                                       const char *value) {
+  char header[SSDP_HTTPD_HEADER_SIZE];
+  esp_err_t err =
+      httpd_req_get_hdr_value_str(req, field, header, sizeof(header));
+  if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) {
+    return false;
+  }
+  return strstr(header, value) != NULL;
+}
+
+// Called with the description acquired, which the bodies point into
+static esp_err_t ssdp_httpd_send(httpd_req_t *req,
+                                 const ssdp_description_t *description) {
+  const char *body = description->body;
+  size_t len = description->len;
+  const uint8_t *gzip = description->gzip;
+  size_t gzip_len = description->gzip_len;
+  size_t index = (size_t)req->user_ctx;
+  if (index != SSDP_HTTPD_DESCRIPTION) {
+    if (!description->manifest || index > description->manifest->file_count) {
+      return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+    }
+    const ssdp_manifest_file_t *file =
+        &description->manifest->files[index - 1];
+    body = file->body;
+    len = file->len;
+    gzip = file->gzip;
+    gzip_len = file->gzip_len;
+  }
+  // Both encodings are different representations, they need their own tag
+  bool use_gzip =
+      gzip && ssdp_httpd_header_contains(req, "Accept-Encoding", "gzip");
+  char etag[SSDP_HTTPD_ETAG_SIZE];
+  snprintf(etag, sizeof(etag), "\"%08" PRIx32 "%s\"",
+           description->generation, use_gzip ? "gz" : "");
+  httpd_resp_set_hdr(req, "ETag", etag);
+  // Control points may keep it but must revalidate, which costs a 304 only
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (gzip) {
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+  }
+  if (ssdp_httpd_header_contains(req, "If-None-Match", etag) ||
+      ssdp_httpd_header_contains(req, "If-None-Match", "*")) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  httpd_resp_set_type(req, "text/xml; charset=\"utf-8\"");
+  if (use_gzip) {
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char *)gzip, gzip_len);
+  }
+  return httpd_resp_send(req, body, len);
+}
+
+// ssdp_stop() waits for the end of the send before freeing the body
+static esp_err_t ssdp_httpd_get_handler(httpd_req_t *req) {
+  ssdp_description_t description;
+  if (ssdp_acquire_description(&description) != ESP_OK) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+  }
+  esp_err_t err = ssdp_httpd_send(req, &description);
+  ssdp_release_description();
+  return err;
+}
+
+// schema_url with a leading slash
+static esp_err_t ssdp_httpd_description_uri(
+    const ssdp_description_t *description, char *uri, size_t size) {
+  int len = snprintf(uri, size, "%s%s",
+                     description->url[0] == '/' ? "" : "/", description->url);
+  if (len < 0 || (size_t)len >= size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t ssdp_httpd_register(httpd_handle_t server, const char *uri,
+                                     size_t index) {
+  // esp_http_server keeps its own copy of the URI
+  const httpd_uri_t handler = {
+      .uri = uri,
+      .method = HTTP_GET,
+      .handler = ssdp_httpd_get_handler,
+      .user_ctx = (void *)index,
+  };
+  esp_err_t err = httpd_register_uri_handler(server, &handler);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to register %s: %s", uri, esp_err_to_name(err));
+  }
+  return err;
+}
+
+/*
+ * Global Functions
+ */
+esp_err_t ssdp_register_httpd_handlers(httpd_handle_t server) {
+  if (!server) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  ssdp_description_t description;
+  if (ssdp_acquire_description(&description) != ESP_OK) {
+    ESP_LOGE(TAG, "SSDP not started");
+    return ESP_ERR_INVALID_STATE;
+  }
+  char uri[SSDP_HTTPD_URI_SIZE];
+  esp_err_t err = ssdp_httpd_description_uri(&description, uri, sizeof(uri));
+  if (err == ESP_OK) {
+    err = ssdp_httpd_register(server, uri, SSDP_HTTPD_DESCRIPTION);
+  }
+  if (description.manifest) {
+    for (size_t i = 0; err == ESP_OK && i < description.manifest->file_count;
+         i++) {
+      err = ssdp_httpd_register(server, description.manifest->files[i].path,
+                                i + 1);
+    }
+  }
+  ssdp_release_description();
+  if (err == ESP_OK) {
+    err = ssdp_gena_register_httpd_handlers(server);
+  }
+  return err;
+}
+
+esp_err_t ssdp_unregister_httpd_handlers(httpd_handle_t server) {
+  if (!server) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  ssdp_description_t description;
+  if (ssdp_acquire_description(&description) != ESP_OK) {
+    ESP_LOGE(TAG, "SSDP not started");
+    return ESP_ERR_INVALID_STATE;
+  }
+  char uri[SSDP_HTTPD_URI_SIZE];
+  if (ssdp_httpd_description_uri(&description, uri, sizeof(uri)) == ESP_OK) {
+    httpd_unregister_uri_handler(server, uri, HTTP_GET);
+  }
+  for (size_t i = 0;
+       description.manifest && i < description.manifest->file_count; i++) {
+    httpd_unregister_uri_handler(server, description.manifest->files[i].path,
+                                 HTTP_GET);
+  }
+  ssdp_release_description();
+  ssdp_gena_unregister_httpd_handlers(server);
+  return ESP_OK;
+}
@@ -0,0 +1,169 @@
+/*
+  ssdp_parse.c zero-copy parser of SSDP messages
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <strings.h>
+
+#include "ssdp.h"
+#include "ssdp_headers.h"
+
+/*
+ * Local Functions
+ */
+
+static void ssdp_view_trim(ssdp_view_t *view) {
+  while (view->len > 0 && (*view->ptr == ' ' || *view->ptr == '\t')) {
+    view->ptr++;
+    view->len--;
+  }
+  while (view->len > 0 && (view->ptr[view->len - 1] == ' ' ||
+                           view->ptr[view->len - 1] == '\t')) {
+    view->len--;
+  }
+}
+
+static bool ssdp_view_is(const ssdp_view_t *view, const char *str) {
+  return strlen(str) == view->len &&
+         strncasecmp(view->ptr, str, view->len) == 0;
+}
+
+// Named field of a header classified by ssdp_headers.h, NULL if it has
+// none and is only in headers[]
+static ssdp_view_t *ssdp_message_field(ssdp_message_t *message,
+                                       ssdp_header_t header) {
+  switch (header) {
+    case SSDP_HEADER_ST:
+      return &message->st;
+    case SSDP_HEADER_MAN:
+      return &message->man;
+    case SSDP_HEADER_MX:
+      return &message->mx;
+    case SSDP_HEADER_USN:
+      return &message->usn;
+    case SSDP_HEADER_LOCATION:
+      return &message->location;
+    case SSDP_HEADER_CACHE_CONTROL:
+      return &message->cache_control;
+    case SSDP_HEADER_NT:
+      return &message->nt;
+    case SSDP_HEADER_NTS:
+      return &message->nts_value;
+    case SSDP_HEADER_SERVER:
+      return &message->server;
+    case SSDP_HEADER_BOOTID:
+      return &message->boot_id;
+    case SSDP_HEADER_CONFIGID:
+      return &message->config_id;
+    case SSDP_HEADER_SEARCHPORT:
+      return &message->search_port;
+    default:
+      return NULL;
+  }
+}
+
+static ssdp_nts_t ssdp_classify_nts(const ssdp_view_t *nts) {
+  if (!nts->ptr) {
+    return SSDP_NTS_NONE;
+  }
+  if (ssdp_view_is(nts, "ssdp:alive")) {
+    return SSDP_NTS_ALIVE;
+  }
+  if (ssdp_view_is(nts, "ssdp:byebye")) {
+    return SSDP_NTS_BYEBYE;
+  }
+  if (ssdp_view_is(nts, "ssdp:update")) {
+    return SSDP_NTS_UPDATE;
+  }
+  return SSDP_NTS_OTHER;
+}
+
+/*
+ * Global Functions
+ */
+
+// Split the datagram in request line and headers, each known header is
+// classified by the perfect hash of ssdp_headers.h and kept as a view
+esp_err_t ssdp_parse(const char *buf, size_t len, ssdp_message_t *message) {
+  if (!buf || !message) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(message, 0, sizeof(ssdp_message_t));
+  const char *end = buf + len;
+  const char *line = buf;
+  bool request_line = true;
+  while (line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      // The message must end with an empty line
+      return ESP_FAIL;
+    }
+    size_t line_len = eol - line;
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+      line_len--;
+    }
+    if (request_line) {
+      // <method> * HTTP/1.1, or HTTP/1.1 200 OK for a search response
+      if (line_len >= 12 && strncmp(line, "HTTP/1.", 7) == 0) {
+        if (strncmp(line + 8, " 200", 4) != 0) {
+          return ESP_FAIL;
+        }
+        message->method = SSDP_MESSAGE_RESPONSE;
+        request_line = false;
+        line = eol + 1;
+        continue;
+      }
+      const char *sp = memchr(line, ' ', line_len);
+      if (!sp) {
+        return ESP_FAIL;
+      }
+      if (sp - line == 8 && strncmp(line, "M-SEARCH", 8) == 0) {
+        message->method = SSDP_MESSAGE_SEARCH;
+      } else if (sp - line == 6 && strncmp(line, "NOTIFY", 6) == 0) {
+        message->method = SSDP_MESSAGE_NOTIFY;
+      } else {
+        return ESP_FAIL;
+      }
+      if ((size_t)(line + line_len - sp) < 11 ||
+          strncmp(sp, " * HTTP/1.", 10) != 0) {
+        return ESP_FAIL;
+      }
+      request_line = false;
+    } else if (line_len == 0) {
+      message->nts = ssdp_classify_nts(&message->nts_value);
+      return ESP_OK;
+    } else {
+      const char *colon = memchr(line, ':', line_len);
+      if (!colon) {
+        return ESP_FAIL;
+      }
+      ssdp_view_t name = {line, colon - line};
+      ssdp_view_trim(&name);
+      ssdp_header_t header = ssdp_header_lookup(name.ptr, name.len);
+      if (header != SSDP_HEADER_UNKNOWN) {
+        ssdp_view_t *value = &message->headers[header];
+        value->ptr = colon + 1;
+        value->len = line + line_len - value->ptr;
+        ssdp_view_trim(value);
+        ssdp_view_t *field = ssdp_message_field(message, header);
+        if (field) {
+          *field = *value;
+        }
+      }
+    }
+    line = eol + 1;
+  }
+  return ESP_FAIL;
+}
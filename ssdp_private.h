@@ -0,0 +1,144 @@
+/*
+  ssdp_private.h shared between the sources of the component
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ESP_SSDP_PRIVATE_H_
+#define ESP_SSDP_PRIVATE_H_
+#include "ssdp.h"
+
+// NONE is a search response
+typedef enum { NONE, SEARCH, NOTIFY } ssdp_method_t;
+
+// FNV-1a of the lower case NT or ST
+uint32_t ssdp_hash_nt(const char *nt, size_t len);
+
+// Clock, RNG and address hooks of the default platform, reused by the raw
+// UDP one
+uint64_t ssdp_default_millis(void *ctx);
+uint32_t ssdp_default_random(void *ctx);
+uint32_t ssdp_default_local_ip(void *ctx);
+
+// Description as rendered by ssdp_start()
+typedef struct {
+  const char *url;  // schema_url
+  const char *body;
+  size_t len;
+  const uint8_t *gzip;
+  size_t gzip_len;
+  uint32_t generation;  // CONFIGID.UPNP.ORG
+  const ssdp_manifest_t *manifest;
+} ssdp_description_t;
+
+// Success keeps ssdp_stop() from freeing the description until
+// ssdp_release_description(), which must then be called soon
+esp_err_t ssdp_acquire_description(ssdp_description_t *description);
+void ssdp_release_description();
+
+#define SSDP_STATUS_STR_SIZE 96
+
+// Snapshot of the responder for the console, strings copied and truncated
+typedef struct {
+  bool running;
+  bool multicast_open;
+  bool unicast_open;
+  uint32_t local_addr;
+  char uuid[SSDP_STATUS_STR_SIZE];  // empty if none
+  char device_type[SSDP_STATUS_STR_SIZE];
+  char schema_url[SSDP_STATUS_STR_SIZE];
+  bool manifest;
+  uint32_t boot_id;
+  uint32_t config_id;
+  uint16_t port;
+  uint16_t search_port;
+  uint8_t ttl;
+  uint32_t max_age;
+  uint32_t notify_period;
+  uint8_t jitter_percent;
+  uint16_t mx_max_delay;
+  int64_t next_notify;  // ms, negative when due
+  size_t target_count;
+  size_t pending_count;  // search responses waiting for their MX delay
+  size_t retry_count;
+  size_t allowed_source_count;
+  size_t denied_source_count;
+  bool ignore_own_packets;
+  bool relay;
+  size_t relay_cached;  // upstream devices not expired
+} ssdp_status_t;
+
+esp_err_t ssdp_get_status(ssdp_status_t *status);
+// The task announces at its next wake-up, SSDP_SELECT_TIMEOUT at most
+esp_err_t ssdp_notify_now();
+// Call back with each target a search for st is answered with, which is
+// only valid during the call, return their count
+typedef void (*ssdp_target_cb_t)(const ssdp_manifest_target_t *target,
+                                 void *arg);
+size_t ssdp_search_targets(const char *st, ssdp_target_cb_t callback,
+                           void *arg);
+size_t ssdp_gena_subscriber_count();
+
+// Counting allocator, clock and RNG of ssdp.c
+void *ssdp_calloc(ssdp_alloc_site_t site, size_t n, size_t size);
+void ssdp_free(void *ptr);
+uint64_t ssdp_millis();
+int ssdp_random(int lowval, int highval);
+
+// GENA eventing of the services in the description, see ssdp_gena.c
+esp_err_t ssdp_gena_start(const char *description, uint16_t moderation,
+                          uint32_t timeout_max);
+void ssdp_gena_stop();
+// Advance the deliveries from the SSDP task without blocking, return the
+// delay (ms) before it needs to be called again
+uint32_t ssdp_gena_poll(uint64_t now);
+esp_err_t ssdp_gena_register_httpd_handlers(httpd_handle_t server);
+void ssdp_gena_unregister_httpd_handlers(httpd_handle_t server);
+
+// Relay between the soft-AP and station interfaces, see ssdp_relay.c
+esp_err_t ssdp_relay_start(uint8_t ttl, size_t cache_size, uint16_t holdoff);
+void ssdp_relay_stop();
+// Sockets of the relay, at most 2, for the task to wait on
+size_t ssdp_relay_open(int multicast_socket, int *socks);
+void ssdp_relay_close();
+// Multicast datagram from addr, false if it came from the relay itself
+bool ssdp_relay_packet(const char *buf, size_t len, uint32_t addr,
+                       uint16_t port, uint64_t now);
+// Datagram received on a relay socket: response to a forwarded search
+void ssdp_relay_receive(int sock, const char *buf, size_t len, uint64_t now);
+size_t ssdp_relay_cached_count(uint64_t now);
+
+// Events of ssdp_event.c. Without CONFIG_SSDP_EVENTS SSDP_EVENT_ENABLED() is
+// false at build time, otherwise it is one test of the mask
+#if CONFIG_SSDP_EVENTS
+extern volatile uint32_t ssdp_event_mask;
+#define SSDP_EVENT_ENABLED(id) ((ssdp_event_mask & SSDP_EVENT_MASK(id)) != 0)
+#else
+#define SSDP_EVENT_ENABLED(id) false
+#endif
+void ssdp_event_start(uint32_t mask, uint16_t rate);
+void ssdp_event_stop();
+void ssdp_event_post(ssdp_event_id_t id, const void *data, size_t size);
+
+// Record a datagram received or sent while a capture runs, see
+// ssdp_capture.c. Addresses and ports in network byte order
+void ssdp_capture_packet(uint32_t src, uint16_t src_port, uint32_t dst,
+                         uint16_t dst_port, const ssdp_iovec_t *parts,
+                         size_t part_count);
+
+// Warm start blob of ssdp_warm.c, framed and checksummed. The payload is
+// allocated with ssdp_calloc(), NULL if there is none or it is corrupted
+void *ssdp_warm_load(size_t *len);
+esp_err_t ssdp_warm_save(const void *payload, size_t len);
+
+#endif /* ESP_SSDP_PRIVATE_H_ */
@@ -0,0 +1,331 @@
+/*
+  ssdp_raw.c transport over the lwIP raw UDP API, without sockets
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <errno.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+#if CONFIG_SSDP_RAW_UDP
+#include "freertos/queue.h"
+#include "lwip/igmp.h"
+#include "lwip/pbuf.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/udp.h"
+
+static const char *TAG = "esp-ssdp-raw";
+
+/*
+ * Defines
+ */
+#define SSDP_RAW_PCB_MAX 2    // multicast group and unicast search port
+#define SSDP_RAW_QUEUE_LEN 8  // datagrams received, not read yet
+#define SSDP_RAW_PARTS_MAX 3
+
+/*
+ * Struct definitions
+ */
+
+// Datagram handed over by the tcpip thread, the pbuf is not copied
+typedef struct {
+  struct pbuf *p;
+  int handle;
+  uint32_t addr;
+  uint16_t port;
+} ssdp_raw_datagram_t;
+
+// Arguments and result of a call run in the tcpip thread
+typedef struct {
+  struct tcpip_api_call_data call;  // first, as lwIP expects
+  int handle;
+  uint16_t port;
+  bool multicast;
+  uint8_t ttl;
+  bool join;
+  const ssdp_datagram_t *datagrams;
+  size_t count;
+  int result;
+  int error;
+} ssdp_raw_call_t;
+
+/*
+ * Global variables
+ */
+
+// Owned by the tcpip thread, the handle is the index
+static struct udp_pcb *ssdp_raw_pcbs[SSDP_RAW_PCB_MAX];
+static bool ssdp_raw_joined[SSDP_RAW_PCB_MAX];
+static QueueHandle_t ssdp_raw_queue = NULL;
+static StaticQueue_t ssdp_raw_queue_buffer;
+static uint8_t
+    ssdp_raw_queue_storage[SSDP_RAW_QUEUE_LEN * sizeof(ssdp_raw_datagram_t)];
+static const ip4_addr_t ssdp_raw_group =
+    IPADDR4_INIT_BYTES(239, 255, 255, 250);
+
+/*
+ * Local Functions
+ */
+
+// tcpip thread: queue the pbuf as is, never wait for the SSDP task
+static void ssdp_raw_on_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                             const ip_addr_t *addr, u16_t port) {
+  const ssdp_raw_datagram_t datagram = {
+      .p = p,
+      .handle = (int)(intptr_t)arg,
+      .addr = ip4_addr_get_u32(ip_2_ip4(addr)),
+      .port = lwip_htons(port),
+  };
+  if (xQueueSend(ssdp_raw_queue, &datagram, 0) != pdTRUE) {
+    // Like a full socket receive mailbox
+    pbuf_free(p);
+  }
+}
+
+static err_t ssdp_raw_set_group(int handle, bool join) {
+  if (ssdp_raw_joined[handle] == join) {
+    return ERR_OK;
+  }
+  err_t err = join ? igmp_joingroup(IP4_ADDR_ANY4, &ssdp_raw_group)
+                   : igmp_leavegroup(IP4_ADDR_ANY4, &ssdp_raw_group);
+  if (err == ERR_OK) {
+    ssdp_raw_joined[handle] = join;
+  }
+  return err;
+}
+
+static err_t ssdp_raw_do_open(struct tcpip_api_call_data *call) {
+  ssdp_raw_call_t *msg = (ssdp_raw_call_t *)call;
+  int handle = 0;
+  while (handle < SSDP_RAW_PCB_MAX && ssdp_raw_pcbs[handle]) {
+    handle++;
+  }
+  if (handle == SSDP_RAW_PCB_MAX) {
+    return ERR_MEM;
+  }
+  struct udp_pcb *pcb = udp_new_ip_type(IPADDR_TYPE_V4);
+  if (!pcb) {
+    return ERR_MEM;
+  }
+  ip_set_option(pcb, SOF_REUSEADDR);
+  err_t err = udp_bind(pcb, IP4_ADDR_ANY, msg->port);
+  if (err == ERR_OK && msg->multicast) {
+    udp_set_multicast_ttl(pcb, msg->ttl);
+    // Our own NOTIFY come back like with the socket, for ignore_own_packets
+    udp_set_flags(pcb, UDP_FLAGS_MULTICAST_LOOP);
+    err = ssdp_raw_set_group(handle, true);
+  }
+  if (err != ERR_OK) {
+    udp_remove(pcb);
+    return err;
+  }
+  udp_recv(pcb, ssdp_raw_on_recv, (void *)(intptr_t)handle);
+  ssdp_raw_pcbs[handle] = pcb;
+  msg->handle = handle;
+  return ERR_OK;
+}
+
+static err_t ssdp_raw_do_membership(struct tcpip_api_call_data *call) {
+  ssdp_raw_call_t *msg = (ssdp_raw_call_t *)call;
+  return ssdp_raw_set_group(msg->handle, msg->join);
+}
+
+static err_t ssdp_raw_do_close(struct tcpip_api_call_data *call) {
+  ssdp_raw_call_t *msg = (ssdp_raw_call_t *)call;
+  ssdp_raw_set_group(msg->handle, false);
+  udp_remove(ssdp_raw_pcbs[msg->handle]);
+  ssdp_raw_pcbs[msg->handle] = NULL;
+  return ERR_OK;
+}
+
+// Each datagram is a chain of PBUF_REF pointing to the rendered parts, lwIP
+// prepends the headers in a pbuf of its own and nothing is copied here
+static err_t ssdp_raw_do_send(struct tcpip_api_call_data *call) {
+  ssdp_raw_call_t *msg = (ssdp_raw_call_t *)call;
+  struct udp_pcb *pcb = ssdp_raw_pcbs[msg->handle];
+  err_t err = ERR_OK;
+  msg->result = 0;
+  for (size_t i = 0; i < msg->count && err == ERR_OK; i++) {
+    const ssdp_datagram_t *datagram = &msg->datagrams[i];
+    struct pbuf *p = NULL;
+    for (size_t j = 0; j < datagram->part_count && j < SSDP_RAW_PARTS_MAX;
+         j++) {
+      struct pbuf *part =
+          pbuf_alloc(PBUF_RAW, datagram->parts[j].len, PBUF_REF);
+      if (!part) {
+        err = ERR_MEM;
+        break;
+      }
+      part->payload = (void *)datagram->parts[j].base;
+      if (p) {
+        pbuf_cat(p, part);
+      } else {
+        p = part;
+      }
+    }
+    if (err == ERR_OK) {
+      ip_addr_t dst = IPADDR4_INIT(datagram->addr);
+      // Sent or copied by the stack before returning, the parts can go
+      err = udp_sendto(pcb, p, &dst, lwip_ntohs(datagram->port));
+    }
+    if (p) {
+      pbuf_free(p);
+    }
+    if (err == ERR_OK) {
+      msg->result++;
+    }
+  }
+  if (err != ERR_OK) {
+    msg->error = err_to_errno(err);
+  }
+  return msg->result > 0 ? ERR_OK : err;
+}
+
+static int ssdp_raw_call(tcpip_api_call_fn fn, ssdp_raw_call_t *msg) {
+  err_t err = tcpip_api_call(fn, &msg->call);
+  if (err != ERR_OK) {
+    errno = msg->error ? msg->error : err_to_errno(err);
+    return -1;
+  }
+  return 0;
+}
+
+static int ssdp_raw_open(void *ctx, uint16_t port, bool multicast,
+                         uint8_t ttl) {
+  if (!ssdp_raw_queue) {
+    ssdp_raw_queue = xQueueCreateStatic(
+        SSDP_RAW_QUEUE_LEN, sizeof(ssdp_raw_datagram_t),
+        ssdp_raw_queue_storage, &ssdp_raw_queue_buffer);
+  }
+  ssdp_raw_call_t msg = {.port = port, .multicast = multicast, .ttl = ttl};
+  if (ssdp_raw_call(ssdp_raw_do_open, &msg) < 0) {
+    ESP_LOGE(TAG, "Failed to open UDP port %u. Error %d", port, errno);
+    return -1;
+  }
+  return msg.handle;
+}
+
+static int ssdp_raw_set_membership(void *ctx, int handle, bool join) {
+  ssdp_raw_call_t msg = {.handle = handle, .join = join};
+  if (ssdp_raw_call(ssdp_raw_do_membership, &msg) < 0) {
+    ESP_LOGE(TAG, "Failed to %s the multicast group. Error %d",
+             join ? "join" : "leave", errno);
+    return -1;
+  }
+  return 0;
+}
+
+static void ssdp_raw_close(void *ctx, int handle) {
+  ssdp_raw_call_t msg = {.handle = handle};
+  ssdp_raw_call(ssdp_raw_do_close, &msg);
+  // The datagrams of this handle still queued can only be dropped, the
+  // others go back in order
+  for (UBaseType_t n = uxQueueMessagesWaiting(ssdp_raw_queue); n > 0; n--) {
+    ssdp_raw_datagram_t datagram;
+    if (xQueueReceive(ssdp_raw_queue, &datagram, 0) != pdTRUE) {
+      break;
+    }
+    if (datagram.handle == handle ||
+        xQueueSend(ssdp_raw_queue, &datagram, 0) != pdTRUE) {
+      pbuf_free(datagram.p);
+    }
+  }
+}
+
+// Only the handles of this backend can be ready, the sockets registered with
+// ssdp_loop_add_socket() are not served
+static int ssdp_raw_wait(void *ctx, const int *handles, bool *ready,
+                         size_t count, uint32_t timeout_ms) {
+  for (size_t i = 0; i < count; i++) {
+    ready[i] = false;
+  }
+  ssdp_raw_datagram_t next;
+  if (xQueuePeek(ssdp_raw_queue, &next, pdMS_TO_TICKS(timeout_ms)) !=
+      pdTRUE) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (handles[i] == next.handle) {
+      ready[i] = true;
+      return 1;
+    }
+  }
+  // Nobody reads this handle any more
+  if (xQueueReceive(ssdp_raw_queue, &next, 0) == pdTRUE) {
+    pbuf_free(next.p);
+  }
+  return 0;
+}
+
+static int ssdp_raw_recv(void *ctx, int handle, char *buf, size_t size,
+                         uint32_t *addr, uint16_t *port) {
+  ssdp_raw_datagram_t datagram;
+  if (xQueueReceive(ssdp_raw_queue, &datagram, 0) != pdTRUE) {
+    errno = EAGAIN;
+    return -1;
+  }
+  // The parser needs the datagram contiguous and null-terminated, this is
+  // the only copy, straight out of the driver buffer
+  int len = pbuf_copy_partial(datagram.p, buf, size, 0);
+  // Safe from this task, as netbuf_delete() does for the sockets
+  pbuf_free(datagram.p);
+  *addr = datagram.addr;
+  *port = datagram.port;
+  return len;
+}
+
+static int ssdp_raw_send(void *ctx, int handle,
+                         const ssdp_datagram_t *datagrams, size_t count) {
+  ssdp_raw_call_t msg = {
+      .handle = handle,
+      .datagrams = datagrams,
+      .count = count,
+  };
+  if (ssdp_raw_call(ssdp_raw_do_send, &msg) < 0) {
+    return -1;
+  }
+  if (msg.result < (int)count) {
+    // What was sent is reported, errno tells the task why the rest was not
+    errno = msg.error;
+  }
+  return msg.result;
+}
+
+static const ssdp_platform_t SSDP_RAW_PLATFORM = {
+    .ctx = NULL,
+    .millis = ssdp_default_millis,
+    .random = ssdp_default_random,
+    .local_ip = ssdp_default_local_ip,
+    .open = ssdp_raw_open,
+    .set_membership = ssdp_raw_set_membership,
+    .close = ssdp_raw_close,
+    .wait = ssdp_raw_wait,
+    .recv = ssdp_raw_recv,
+    .send = ssdp_raw_send,
+};
+
+/*
+ * Global Functions
+ */
+
+esp_err_t ssdp_set_raw_platform() {
+  return ssdp_set_platform(&SSDP_RAW_PLATFORM);
+}
+
+#else
+esp_err_t ssdp_set_raw_platform() { return ESP_ERR_NOT_SUPPORTED; }
+#endif
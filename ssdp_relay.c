@@ -0,0 +1,557 @@
+/*
+  ssdp_relay.c SSDP relay between the soft-AP and station interfaces
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "lwip/sockets.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+#if CONFIG_SSDP_RELAY
+static const char *TAG = "esp-ssdp-relay";
+
+/*
+ * Defines
+ */
+#define SSDP_RELAY_PENDING_MAX 8
+#define SSDP_RELAY_RECENT_MAX 8
+#define SSDP_RELAY_ST_SIZE 96
+#define SSDP_RELAY_USN_SIZE 128
+#define SSDP_RELAY_LOCATION_SIZE 160
+#define SSDP_RELAY_SERVER_SIZE 96
+#define SSDP_RELAY_ID_SIZE 12         // BOOTID.UPNP.ORG or CONFIGID.UPNP.ORG
+#define SSDP_RELAY_RESPONSE_SIZE 640  // every field above at its longest
+#define SSDP_RELAY_MX_MAX 5           // s, longest wait for forwarded responses
+#define SSDP_RELAY_GRACE 1000         // ms after MX for late responses
+#define SSDP_RELAY_MULTICAST_ADDR "239.255.255.250"
+#define SSDP_RELAY_PORT 1900
+
+/*
+ * Enums
+ */
+
+typedef enum {
+  SSDP_SIDE_UPSTREAM,    // station, the LAN we are a client of
+  SSDP_SIDE_DOWNSTREAM,  // soft-AP clients
+  SSDP_SIDE_MAX
+} ssdp_side_t;
+
+/*
+ * Struct definitions
+ */
+
+typedef struct {
+  const char *ifkey;
+  uint32_t addr;
+  uint32_t mask;
+  int sock;  // ephemeral port: forwarded searches and their responses
+} ssdp_relay_if_t;
+
+// Control point of one side whose search was forwarded to the other one,
+// the responses coming back until deadline go to it
+typedef struct {
+  ssdp_side_t side;
+  uint32_t addr;
+  uint16_t port;
+  char st[SSDP_RELAY_ST_SIZE];
+  uint64_t deadline;
+} ssdp_relay_pending_t;
+
+// Search forwarded upstream, the same ST is answered from the cache only
+// until the holdoff expires
+typedef struct {
+  uint32_t hash;
+  bool all;  // ssdp:all, covers every ST
+  uint64_t forwarded;
+} ssdp_relay_recent_t;
+
+// Upstream device, the search response to send for it is rendered from
+// these fields with the max-age left
+typedef struct {
+  char st[SSDP_RELAY_ST_SIZE];
+  char usn[SSDP_RELAY_USN_SIZE];
+  char location[SSDP_RELAY_LOCATION_SIZE];
+  char server[SSDP_RELAY_SERVER_SIZE];
+  char boot_id[SSDP_RELAY_ID_SIZE];    // empty if not announced
+  char config_id[SSDP_RELAY_ID_SIZE];  // empty if not announced
+  uint64_t expires;                    // 0: free slot
+} ssdp_relay_entry_t;
+
+typedef struct {
+  ssdp_relay_if_t sides[SSDP_SIDE_MAX];
+  uint8_t ttl;
+  uint32_t holdoff;  // ms
+  ssdp_relay_pending_t pending[SSDP_RELAY_PENDING_MAX];
+  size_t pending_count;
+  ssdp_relay_recent_t recent[SSDP_RELAY_RECENT_MAX];
+  size_t cache_size;
+  ssdp_relay_entry_t cache[];
+} ssdp_relay_t;
+
+/*
+ * Global variables
+ */
+
+// Only used by the SSDP task between ssdp_relay_start() and ssdp_relay_stop()
+static ssdp_relay_t *ssdp_relay = NULL;
+
+/*
+ * Local Functions
+ */
+
+static bool ssdp_relay_view_equals(const ssdp_view_t *view, const char *str) {
+  return view->ptr && strlen(str) == view->len &&
+         strncasecmp(view->ptr, str, view->len) == 0;
+}
+
+// Copy a header value, false if missing or too long to be kept
+static bool ssdp_relay_copy(char *dst, size_t size, const ssdp_view_t *view) {
+  if (!view->ptr || view->len == 0 || view->len >= size) {
+    return false;
+  }
+  memcpy(dst, view->ptr, view->len);
+  dst[view->len] = 0;
+  return true;
+}
+
+// Same for a header that may be missing, then empty
+static bool ssdp_relay_copy_optional(char *dst, size_t size,
+                                     const ssdp_view_t *view) {
+  dst[0] = 0;
+  return !view->ptr || view->len == 0 ||
+         ssdp_relay_copy(dst, size, view);
+}
+
+// CACHE-CONTROL: max-age = <seconds>, 0 if missing
+static uint32_t ssdp_relay_max_age(const ssdp_view_t *cache_control) {
+  const char *p = cache_control->ptr;
+  const char *end = p + cache_control->len;
+  if (!p) {
+    return 0;
+  }
+  for (; p + 7 <= end; p++) {
+    if (strncasecmp(p, "max-age", 7) == 0) {
+      p += 7;
+      while (p < end && (*p == ' ' || *p == '=')) {
+        p++;
+      }
+      uint32_t max_age = 0;
+      while (p < end && isdigit((unsigned char)*p) && max_age < 86400) {
+        max_age = max_age * 10 + (*p++ - '0');
+      }
+      return max_age;
+    }
+  }
+  return 0;
+}
+
+static void ssdp_relay_send(int sock, const char *buf, size_t len,
+                            uint32_t addr, uint16_t port) {
+  struct sockaddr_in dest = {0};
+  dest.sin_family = PF_INET;
+  dest.sin_addr.s_addr = addr;
+  dest.sin_port = port;
+  if (sendto(sock, buf, len, MSG_DONTWAIT, (struct sockaddr *)&dest,
+             sizeof(dest)) < 0) {
+    ESP_LOGD(TAG, "Relay send failed: errno %d", errno);
+  }
+}
+
+static int ssdp_relay_socket(uint32_t addr, uint8_t ttl) {
+  int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Failed to create relay socket. Error %d", errno);
+    return -1;
+  }
+  struct sockaddr_in saddr = {0};
+  saddr.sin_family = PF_INET;
+  saddr.sin_addr.s_addr = addr;
+  struct in_addr iaddr = {.s_addr = addr};
+  uint8_t loopback_val = 0;
+  if (bind(sock, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iaddr, sizeof(iaddr)) <
+          0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback_val,
+                 sizeof(loopback_val)) < 0) {
+    ESP_LOGE(TAG, "Failed to set up relay socket. Error %d", errno);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static ssdp_side_t ssdp_relay_side(uint32_t addr) {
+  const ssdp_relay_if_t *ap = &ssdp_relay->sides[SSDP_SIDE_DOWNSTREAM];
+  return ap->addr && (addr & ap->mask) == (ap->addr & ap->mask)
+             ? SSDP_SIDE_DOWNSTREAM
+             : SSDP_SIDE_UPSTREAM;
+}
+
+static bool ssdp_relay_st_matches(const char *pending_st, const char *st) {
+  return strcasecmp(pending_st, "ssdp:all") == 0 ||
+         strcasecmp(pending_st, st) == 0;
+}
+
+// Slot for usn: the same device, else a free or expired one, else the one
+// expiring first
+static ssdp_relay_entry_t *ssdp_relay_slot(const char *usn, uint64_t now) {
+  ssdp_relay_entry_t *slot = NULL;
+  for (size_t i = 0; i < ssdp_relay->cache_size; i++) {
+    ssdp_relay_entry_t *entry = &ssdp_relay->cache[i];
+    if (entry->expires > now && strcmp(entry->usn, usn) == 0) {
+      return entry;
+    }
+    if (!slot || entry->expires < slot->expires) {
+      slot = entry;
+    }
+  }
+  return slot;
+}
+
+// Keep the device a response or an ssdp:alive describes, st being its ST
+// or NT, until its max-age expires
+static void ssdp_relay_cache_device(const ssdp_message_t *message,
+                                    const ssdp_view_t *st, uint64_t now) {
+  char usn[SSDP_RELAY_USN_SIZE];
+  uint32_t max_age = ssdp_relay_max_age(&message->cache_control);
+  if (max_age == 0 || !ssdp_relay_copy(usn, sizeof(usn), &message->usn)) {
+    return;
+  }
+  ssdp_relay_entry_t *entry = ssdp_relay_slot(usn, now);
+  if (!ssdp_relay_copy(entry->st, sizeof(entry->st), st) ||
+      !ssdp_relay_copy(entry->location, sizeof(entry->location),
+                       &message->location) ||
+      !ssdp_relay_copy_optional(entry->server, sizeof(entry->server),
+                                &message->server) ||
+      !ssdp_relay_copy_optional(entry->boot_id, sizeof(entry->boot_id),
+                                &message->boot_id) ||
+      !ssdp_relay_copy_optional(entry->config_id, sizeof(entry->config_id),
+                                &message->config_id)) {
+    entry->expires = 0;
+    return;
+  }
+  strcpy(entry->usn, usn);
+  entry->expires = now + max_age * 1000ULL;
+}
+
+// ssdp:alive is kept like the search response the device would send,
+// ssdp:byebye removes it
+static void ssdp_relay_cache_notify(const ssdp_message_t *notify,
+                                    uint64_t now) {
+  if (notify->nts == SSDP_NTS_BYEBYE) {
+    char usn[SSDP_RELAY_USN_SIZE];
+    if (!ssdp_relay_copy(usn, sizeof(usn), &notify->usn)) {
+      return;
+    }
+    for (size_t i = 0; i < ssdp_relay->cache_size; i++) {
+      if (strcmp(ssdp_relay->cache[i].usn, usn) == 0) {
+        ssdp_relay->cache[i].expires = 0;
+      }
+    }
+    return;
+  }
+  if (notify->nts == SSDP_NTS_ALIVE) {
+    ssdp_relay_cache_device(notify, &notify->nt, now);
+  }
+}
+
+// The max-age sent is what is left of the one received, so a control point
+// does not keep the device longer than upstream ones would
+static size_t ssdp_relay_answer_from_cache(const char *st, uint32_t addr,
+                                           uint16_t port, uint64_t now) {
+  size_t count = 0;
+  int sock = ssdp_relay->sides[SSDP_SIDE_DOWNSTREAM].sock;
+  char response[SSDP_RELAY_RESPONSE_SIZE];
+  for (size_t i = 0; i < ssdp_relay->cache_size; i++) {
+    const ssdp_relay_entry_t *entry = &ssdp_relay->cache[i];
+    uint64_t left = entry->expires > now ? (entry->expires - now) / 1000 : 0;
+    if (left == 0 || !ssdp_relay_st_matches(st, entry->st)) {
+      continue;
+    }
+    bool boot_id = entry->boot_id[0];
+    bool config_id = entry->config_id[0];
+    int len = snprintf(
+        response, sizeof(response),
+        "HTTP/1.1 200 OK\r\n"
+        "CACHE-CONTROL: max-age=%u\r\n"
+        "EXT:\r\n"
+        "LOCATION: %s\r\n"
+        "SERVER: %s\r\n"
+        "ST: %s\r\n"
+        "USN: %s\r\n"
+        "%s%s%s%s%s%s"
+        "\r\n",
+        (unsigned)left, entry->location, entry->server, entry->st, entry->usn,
+        boot_id ? "BOOTID.UPNP.ORG: " : "", entry->boot_id,
+        boot_id ? "\r\n" : "", config_id ? "CONFIGID.UPNP.ORG: " : "",
+        entry->config_id, config_id ? "\r\n" : "");
+    if (len > 0 && len < (int)sizeof(response)) {
+      ssdp_relay_send(sock, response, len, addr, port);
+      count++;
+    }
+  }
+  return count;
+}
+
+// True if st was forwarded upstream less than holdoff ago, else it is
+// recorded as forwarded now
+static bool ssdp_relay_held_off(const char *st, uint64_t now) {
+  uint32_t hash = ssdp_hash_nt(st, strlen(st));
+  bool all = strcasecmp(st, "ssdp:all") == 0;
+  ssdp_relay_recent_t *oldest = &ssdp_relay->recent[0];
+  for (size_t i = 0; i < SSDP_RELAY_RECENT_MAX; i++) {
+    ssdp_relay_recent_t *recent = &ssdp_relay->recent[i];
+    if (recent->forwarded && recent->forwarded + ssdp_relay->holdoff > now &&
+        (recent->all || (!all && recent->hash == hash))) {
+      return true;
+    }
+    if (recent->forwarded < oldest->forwarded) {
+      oldest = recent;
+    }
+  }
+  *oldest = (ssdp_relay_recent_t){hash, all, now};
+  return false;
+}
+
+static void ssdp_relay_add_pending(ssdp_side_t side, uint32_t addr,
+                                  uint16_t port, const char *st,
+                                  uint64_t deadline, uint64_t now) {
+  ssdp_relay_pending_t *slot = NULL;
+  for (size_t i = 0; i < ssdp_relay->pending_count; i++) {
+    if (ssdp_relay->pending[i].deadline <= now) {
+      slot = &ssdp_relay->pending[i];
+      break;
+    }
+  }
+  if (!slot) {
+    if (ssdp_relay->pending_count >= SSDP_RELAY_PENDING_MAX) {
+      ESP_LOGW(TAG, "Too many forwarded searches, not relaying responses");
+      return;
+    }
+    slot = &ssdp_relay->pending[ssdp_relay->pending_count++];
+  }
+  slot->side = side;
+  slot->addr = addr;
+  slot->port = port;
+  strcpy(slot->st, st);
+  slot->deadline = deadline;
+}
+
+/*
+ * Global Functions
+ */
+
+esp_err_t ssdp_relay_start(uint8_t ttl, size_t cache_size, uint16_t holdoff) {
+  ssdp_relay = (ssdp_relay_t *)ssdp_calloc(
+      SSDP_ALLOC_RELAY, 1,
+      sizeof(ssdp_relay_t) + cache_size * sizeof(ssdp_relay_entry_t));
+  if (!ssdp_relay) {
+    ESP_LOGE(TAG, "Memory allocation error for relay cache");
+    return ESP_ERR_NO_MEM;
+  }
+  ssdp_relay->sides[SSDP_SIDE_UPSTREAM] =
+      (ssdp_relay_if_t){.ifkey = "WIFI_STA_DEF", .sock = -1};
+  ssdp_relay->sides[SSDP_SIDE_DOWNSTREAM] =
+      (ssdp_relay_if_t){.ifkey = "WIFI_AP_DEF", .sock = -1};
+  ssdp_relay->ttl = ttl;
+  ssdp_relay->holdoff = holdoff * 1000;
+  ssdp_relay->cache_size = cache_size;
+  return ESP_OK;
+}
+
+void ssdp_relay_stop() {
+  ssdp_relay_close();
+  ssdp_free(ssdp_relay);
+  ssdp_relay = NULL;
+}
+
+size_t ssdp_relay_open(int multicast_socket, int *socks) {
+  if (!ssdp_relay) {
+    return 0;
+  }
+  ssdp_relay_close();
+  size_t count = 0;
+  for (size_t i = 0; i < SSDP_SIDE_MAX; i++) {
+    ssdp_relay_if_t *side = &ssdp_relay->sides[i];
+    esp_netif_ip_info_t ip_info = {0};
+    esp_netif_t *netif = esp_netif_get_handle_from_ifkey(side->ifkey);
+    side->addr = 0;
+    if (!netif || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK ||
+        ip_info.ip.addr == 0) {
+      continue;
+    }
+    side->addr = ip_info.ip.addr;
+    side->mask = ip_info.netmask.addr;
+    // A membership through IPADDR_ANY only covers the interfaces that were
+    // up when it was taken, join through each side explicitly
+    struct ip_mreq imreq = {0};
+    imreq.imr_interface.s_addr = side->addr;
+    inet_aton(SSDP_RELAY_MULTICAST_ADDR, &imreq.imr_multiaddr.s_addr);
+    if (setsockopt(multicast_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imreq,
+                   sizeof(imreq)) < 0) {
+      ESP_LOGD(TAG, "%s membership: errno %d", side->ifkey, errno);
+    }
+    side->sock = ssdp_relay_socket(side->addr, ssdp_relay->ttl);
+    if (side->sock >= 0) {
+      socks[count++] = side->sock;
+    }
+  }
+  if (ssdp_relay->sides[SSDP_SIDE_UPSTREAM].sock < 0 ||
+      ssdp_relay->sides[SSDP_SIDE_DOWNSTREAM].sock < 0) {
+    ESP_LOGW(TAG, "Relay needs both the AP and STA interfaces up");
+  }
+  return count;
+}
+
+void ssdp_relay_close() {
+  if (!ssdp_relay) {
+    return;
+  }
+  for (size_t i = 0; i < SSDP_SIDE_MAX; i++) {
+    if (ssdp_relay->sides[i].sock >= 0) {
+      close(ssdp_relay->sides[i].sock);
+      ssdp_relay->sides[i].sock = -1;
+    }
+  }
+  ssdp_relay->pending_count = 0;
+}
+
+bool ssdp_relay_packet(const char *buf, size_t len, uint32_t addr,
+                       uint16_t port, uint64_t now) {
+  if (!ssdp_relay) {
+    return true;
+  }
+  if (addr == ssdp_relay->sides[SSDP_SIDE_UPSTREAM].addr ||
+      addr == ssdp_relay->sides[SSDP_SIDE_DOWNSTREAM].addr) {
+    // Sent by us, e.g. a search forwarded to the other side
+    return false;
+  }
+  ssdp_message_t message;
+  if (ssdp_parse(buf, len, &message) != ESP_OK) {
+    return true;
+  }
+  ssdp_side_t side = ssdp_relay_side(addr);
+  if (message.method == SSDP_MESSAGE_NOTIFY) {
+    if (side == SSDP_SIDE_UPSTREAM) {
+      ssdp_relay_cache_notify(&message, now);
+    }
+    return true;
+  }
+  const ssdp_view_t *man = &message.man;
+  char st[SSDP_RELAY_ST_SIZE];
+  if (message.method != SSDP_MESSAGE_SEARCH ||
+      (!ssdp_relay_view_equals(man, "\"ssdp:discover\"") &&
+       !ssdp_relay_view_equals(man, "ssdp:discover")) ||
+      !ssdp_relay_copy(st, sizeof(st), &message.st)) {
+    return true;
+  }
+  ssdp_side_t other =
+      side == SSDP_SIDE_UPSTREAM ? SSDP_SIDE_DOWNSTREAM : SSDP_SIDE_UPSTREAM;
+  if (ssdp_relay->sides[side].sock < 0 || ssdp_relay->sides[other].sock < 0) {
+    return true;
+  }
+  uint32_t mx = 1;
+  const ssdp_view_t *mx_view = &message.mx;
+  if (mx_view->ptr && mx_view->len > 0 &&
+      isdigit((unsigned char)*mx_view->ptr)) {
+    mx = *mx_view->ptr - '0';
+    if (mx_view->len > 1 || mx > SSDP_RELAY_MX_MAX) {
+      mx = SSDP_RELAY_MX_MAX;
+    }
+  }
+  // Responses still in flight for an earlier search go to this one too
+  ssdp_relay_add_pending(side, addr, port, st,
+                         now + mx * 1000 + SSDP_RELAY_GRACE, now);
+  if (side == SSDP_SIDE_DOWNSTREAM) {
+    size_t cached = ssdp_relay_answer_from_cache(st, addr, port, now);
+    if (ssdp_relay_held_off(st, now)) {
+      ESP_LOGD(TAG, "Search for %s answered from cache (%u)", st,
+               (unsigned)cached);
+      return true;
+    }
+  }
+  uint32_t group = 0;
+  inet_aton(SSDP_RELAY_MULTICAST_ADDR, &group);
+  // Forwarded as is, the responses come back to the relay socket
+  ssdp_relay_send(ssdp_relay->sides[other].sock, buf, len, group,
+                  htons(SSDP_RELAY_PORT));
+  ESP_LOGD(TAG, "Search for %s forwarded to %s", st,
+           ssdp_relay->sides[other].ifkey);
+  return true;
+}
+
+void ssdp_relay_receive(int sock, const char *buf, size_t len, uint64_t now) {
+  if (!ssdp_relay) {
+    return;
+  }
+  ssdp_side_t side = sock == ssdp_relay->sides[SSDP_SIDE_UPSTREAM].sock
+                         ? SSDP_SIDE_UPSTREAM
+                         : SSDP_SIDE_DOWNSTREAM;
+  ssdp_message_t response;
+  char st[SSDP_RELAY_ST_SIZE];
+  if (ssdp_parse(buf, len, &response) != ESP_OK ||
+      response.method != SSDP_MESSAGE_RESPONSE ||
+      !ssdp_relay_copy(st, sizeof(st), &response.st)) {
+    return;
+  }
+  if (side == SSDP_SIDE_UPSTREAM) {
+    ssdp_relay_cache_device(&response, &response.st, now);
+  }
+  // Unchanged to the control points of the other side waiting for it
+  for (size_t i = 0; i < ssdp_relay->pending_count; i++) {
+    const ssdp_relay_pending_t *pending = &ssdp_relay->pending[i];
+    if (pending->side != side && pending->deadline > now &&
+        ssdp_relay_st_matches(pending->st, st)) {
+      ssdp_relay_send(ssdp_relay->sides[pending->side].sock, buf, len,
+                      pending->addr, pending->port);
+    }
+  }
+}
+
+size_t ssdp_relay_cached_count(uint64_t now) {
+  size_t count = 0;
+  for (size_t i = 0; ssdp_relay && i < ssdp_relay->cache_size; i++) {
+    count += ssdp_relay->cache[i].expires > now;
+  }
+  return count;
+}
+
+#else
+esp_err_t ssdp_relay_start(uint8_t ttl, size_t cache_size, uint16_t holdoff) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+void ssdp_relay_stop() {}
+
+size_t ssdp_relay_open(int multicast_socket, int *socks) { return 0; }
+
+void ssdp_relay_close() {}
+
+bool ssdp_relay_packet(const char *buf, size_t len, uint32_t addr,
+                       uint16_t port, uint64_t now) {
+  return true;
+}
+
+void ssdp_relay_receive(int sock, const char *buf, size_t len, uint64_t now) {}
+
+size_t ssdp_relay_cached_count(uint64_t now) { return 0; }
+#endif
@@ -0,0 +1,235 @@
+/*
+  ssdp_warm.c warm start state kept across reboots
+
+  Copyright (c) 2022 Luc Lebosse. All rights reserved.
+  This code is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This code is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with This code; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "ssdp.h"
+#include "ssdp_private.h"
+
+#if CONFIG_SSDP_WARM_START
+static const char *TAG = "esp-ssdp-warm";
+
+/*
+ * Defines
+ */
+#define SSDP_WARM_MAGIC 0x4d524157  // "WARM"
+#define SSDP_WARM_VERSION 1
+#define SSDP_WARM_NVS_NAMESPACE "ssdp"
+#define SSDP_WARM_NVS_KEY "warm"
+#define SSDP_WARM_SIZE_MAX 4096  // header included
+
+// A host build keeps the blob in a file, the device in NVS
+#if CONFIG_IDF_TARGET_LINUX
+#define SSDP_WARM_USE_FILE 1
+#else
+#define SSDP_WARM_USE_FILE 0
+#endif
+
+/*
+ * Struct definitions
+ */
+
+// Stored in front of the payload, in the same blob
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t len;       // payload
+  uint32_t checksum;  // FNV-1a of the payload
+} ssdp_warm_header_t;
+
+/*
+ * Local Functions
+ */
+
+static uint32_t ssdp_warm_checksum(const uint8_t *data, size_t len) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+// The whole blob in one read, NULL if there is none
+static uint8_t *ssdp_warm_read(size_t *size) {
+#if SSDP_WARM_USE_FILE
+  FILE *file = fopen(CONFIG_SSDP_WARM_START_FILE, "rb");
+  if (!file) {
+    return NULL;
+  }
+  uint8_t *blob = NULL;
+  long len = -1;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    len = ftell(file);
+  }
+  if (len > 0 && len <= SSDP_WARM_SIZE_MAX &&
+      fseek(file, 0, SEEK_SET) == 0) {
+    blob = (uint8_t *)ssdp_calloc(SSDP_ALLOC_START, 1, len);
+    if (blob && fread(blob, 1, len, file) != (size_t)len) {
+      ssdp_free(blob);
+      blob = NULL;
+    }
+  }
+  fclose(file);
+  *size = len;
+  return blob;
+#else
+  nvs_handle_t handle;
+  if (nvs_open(SSDP_WARM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return NULL;
+  }
+  uint8_t *blob = NULL;
+  size_t len = 0;
+  // The length comes from the entry index, the data is read once
+  if (nvs_get_blob(handle, SSDP_WARM_NVS_KEY, NULL, &len) == ESP_OK &&
+      len > 0 && len <= SSDP_WARM_SIZE_MAX) {
+    blob = (uint8_t *)ssdp_calloc(SSDP_ALLOC_START, 1, len);
+    if (blob &&
+        nvs_get_blob(handle, SSDP_WARM_NVS_KEY, blob, &len) != ESP_OK) {
+      ssdp_free(blob);
+      blob = NULL;
+    }
+  }
+  nvs_close(handle);
+  *size = len;
+  return blob;
+#endif
+}
+
+static esp_err_t ssdp_warm_write(const uint8_t *blob, size_t size) {
+#if SSDP_WARM_USE_FILE
+  // Renamed over the previous one once complete, a power cut in the middle
+  // leaves the previous state
+  char temp_path[sizeof(CONFIG_SSDP_WARM_START_FILE) + 4];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp",
+           CONFIG_SSDP_WARM_START_FILE);
+  FILE *file = fopen(temp_path, "wb");
+  if (!file) {
+    return ESP_FAIL;
+  }
+  bool written = fwrite(blob, 1, size, file) == size;
+  if (fclose(file) != 0 || !written ||
+      rename(temp_path, CONFIG_SSDP_WARM_START_FILE) != 0) {
+    remove(temp_path);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+#else
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(SSDP_WARM_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_set_blob(handle, SSDP_WARM_NVS_KEY, blob, size);
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  return err;
+#endif
+}
+
+/*
+ * Global Functions
+ */
+
+void *ssdp_warm_load(size_t *len) {
+  size_t size = 0;
+  uint8_t *blob = ssdp_warm_read(&size);
+  if (!blob) {
+    ESP_LOGD(TAG, "No warm state");
+    return NULL;
+  }
+  ssdp_warm_header_t header;
+  if (size >= sizeof(header)) {
+    memcpy(&header, blob, sizeof(header));
+  }
+  if (size < sizeof(header) || header.magic != SSDP_WARM_MAGIC ||
+      header.version != SSDP_WARM_VERSION ||
+      header.header_size != sizeof(header) ||
+      header.len != size - sizeof(header) ||
+      header.checksum !=
+          ssdp_warm_checksum(blob + sizeof(header), header.len)) {
+    ESP_LOGW(TAG, "Invalid warm state, ignored");
+    ssdp_free(blob);
+    return NULL;
+  }
+  // The payload goes to the start of the buffer, which the caller frees
+  memmove(blob, blob + sizeof(header), header.len);
+  *len = header.len;
+  return blob;
+}
+
+esp_err_t ssdp_warm_save(const void *payload, size_t len) {
+  size_t size = sizeof(ssdp_warm_header_t) + len;
+  if (size > SSDP_WARM_SIZE_MAX) {
+    ESP_LOGW(TAG, "Warm state of %u bytes is too large", (unsigned)size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  uint8_t *blob = (uint8_t *)ssdp_calloc(SSDP_ALLOC_START, 1, size);
+  if (!blob) {
+    return ESP_ERR_NO_MEM;
+  }
+  const ssdp_warm_header_t header = {
+      .magic = SSDP_WARM_MAGIC,
+      .version = SSDP_WARM_VERSION,
+      .header_size = sizeof(ssdp_warm_header_t),
+      .len = len,
+      .checksum = ssdp_warm_checksum((const uint8_t *)payload, len),
+  };
+  memcpy(blob, &header, sizeof(header));
+  memcpy(blob + sizeof(header), payload, len);
+  esp_err_t err = ssdp_warm_write(blob, size);
+  ssdp_free(blob);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to save warm state: %s", esp_err_to_name(err));
+  }
+  return err;
+}
+
+esp_err_t ssdp_warm_clear() {
+#if SSDP_WARM_USE_FILE
+  if (remove(CONFIG_SSDP_WARM_START_FILE) != 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return ESP_OK;
+#else
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(SSDP_WARM_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_erase_key(handle, SSDP_WARM_NVS_KEY);
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  return err == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : err;
+#endif
+}
+
+#else
+void *ssdp_warm_load(size_t *len) { return NULL; }
+
+esp_err_t ssdp_warm_save(const void *payload, size_t len) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t ssdp_warm_clear() { return ESP_ERR_NOT_SUPPORTED; }
+#endif
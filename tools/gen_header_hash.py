@@ -0,0 +1,151 @@
+#!/usr/bin/python
+
+import itertools
+import os
+import sys
+
+# Header names recognized by the parser, UPnP Device Architecture 1.1/2.0
+HEADERS = [
+    "HOST",
+    "MAN",
+    "MX",
+    "ST",
+    "NT",
+    "NTS",
+    "USN",
+    "LOCATION",
+    "CACHE-CONTROL",
+    "SERVER",
+    "USER-AGENT",
+    "EXT",
+    "DATE",
+    "BOOTID.UPNP.ORG",
+    "NEXTBOOTID.UPNP.ORG",
+    "CONFIGID.UPNP.ORG",
+    "SEARCHPORT.UPNP.ORG",
+    "CPFN.UPNP.ORG",
+    "CPUUID.UPNP.ORG",
+    "TCPPORT.UPNP.ORG",
+]
+
+
+def header_hash(name, mul_len, mul_first, mul_last, mask):
+    """
+    Hash used at runtime, it only reads the length and two characters so it is
+    computed in constant time whatever the header length is.
+    Characters are folded to lower case with | 0x20, harmless for '-' and '.'
+    that do not collide with letters once folded.
+    """
+    first = ord(name[0]) | 0x20
+    last = ord(name[-1]) | 0x20
+    return (len(name) * mul_len + first * mul_first + last * mul_last) & mask
+
+
+def find_parameters():
+    """
+    Searches the smallest power of two table and multipliers giving a
+    collision free hash for all HEADERS.
+    """
+    for bits in range(5, 9):
+        mask = (1 << bits) - 1
+        for mul_len, mul_first, mul_last in itertools.product(range(1, 32),
+                                                              repeat=3):
+            slots = set()
+            for name in HEADERS:
+                slot = header_hash(name, mul_len, mul_first, mul_last, mask)
+                if slot in slots:
+                    break
+                slots.add(slot)
+            else:
+                return mul_len, mul_first, mul_last, mask
+    raise RuntimeError("no perfect hash found")
+
+
+def enum_name(name):
+    return "SSDP_HEADER_" + name.replace(".UPNP.ORG", "").replace("-", "_")
+
+
+def generate():
+    """
+    Generates include/ssdp_header_ids.h and ssdp_headers.h at the root of
+    the component.
+
+    The first one is public and defines the ssdp_header_t enum that indexes
+    the headers of ssdp_message_t, the second one the perfect hash table and
+    ssdp_header_lookup() that classifies a header name, case insensitively,
+    in O(1). Run this script again after changing HEADERS.
+    """
+    mul_len, mul_first, mul_last, mask = find_parameters()
+    table = ["  {NULL, 0, SSDP_HEADER_UNKNOWN},"] * (mask + 1)
+    for name in HEADERS:
+        slot = header_hash(name, mul_len, mul_first, mul_last, mask)
+        table[slot] = '  {"%s", %d, %s},' % (name, len(name), enum_name(name))
+    enums = "\n".join("  %s," % enum_name(name) for name in HEADERS)
+    ids = """/*
+  ssdp_header_ids.h identifiers of the SSDP headers known to the parser
+
+  Generated by tools/gen_header_hash.py, do not edit.
+*/
+#ifndef ESP_SSDP_HEADER_IDS_H_
+#define ESP_SSDP_HEADER_IDS_H_
+
+typedef enum {
+%s
+  SSDP_HEADER_COUNT,
+  SSDP_HEADER_UNKNOWN = SSDP_HEADER_COUNT
+} ssdp_header_t;
+
+#endif /* ESP_SSDP_HEADER_IDS_H_ */
+""" % enums
+    content = """/*
+  ssdp_headers.h perfect hash of SSDP header names
+
+  Generated by tools/gen_header_hash.py, do not edit.
+*/
+#ifndef ESP_SSDP_HEADERS_H_
+#define ESP_SSDP_HEADERS_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "ssdp_header_ids.h"
+
+typedef struct {
+  const char *name;
+  uint8_t len;
+  ssdp_header_t id;
+} ssdp_header_entry_t;
+
+static const ssdp_header_entry_t SSDP_HEADERS_TABLE[%d] = {
+%s
+};
+
+static inline ssdp_header_t ssdp_header_lookup(const char *name, size_t len) {
+  if (len == 0) {
+    return SSDP_HEADER_UNKNOWN;
+  }
+  const ssdp_header_entry_t *entry =
+      &SSDP_HEADERS_TABLE[(len * %d + (name[0] | 0x20) * %d +
+                           (name[len - 1] | 0x20) * %d) &
+                          %d];
+  if (entry->len != len || strncasecmp(name, entry->name, len) != 0) {
+    return SSDP_HEADER_UNKNOWN;
+  }
+  return entry->id;
+}
+
+#endif /* ESP_SSDP_HEADERS_H_ */
+""" % (mask + 1, "\n".join(table), mul_len, mul_first, mul_last, mask)
+    script_dir = os.path.dirname(os.path.abspath(__file__))
+    component_dir = os.path.join(script_dir, "..")
+    for name, text in (("include/ssdp_header_ids.h", ids),
+                       ("ssdp_headers.h", content)):
+        output = os.path.abspath(os.path.join(component_dir, name))
+        with open(output, "w") as header_file:
+            header_file.write(text)
+        print("Generated " + output)
+
+
+if __name__ == "__main__":
+    generate()
+    sys.exit(0)
@@ -0,0 +1,460 @@
+#!/usr/bin/python
+
+import argparse
+import gzip
+import json
+import os
+import re
+import sys
+
+# Same defaults as SDDP_DEFAULT_CONFIG()
+DEFAULTS = {
+    "uuid": None,
+    "schema_url": "description.xml",
+    "device_type": "Basic",
+    "friendly_name": "ESP32",
+    "serial_number": "000000",
+    "presentation_url": "/",
+    "manufacturer_name": "Espressif Systems",
+    "manufacturer_url": "https://www.espressif.com",
+    "model_name": "ESP32",
+    "model_url": "https://www.espressif.com",
+    "model_number": "12345",
+    "model_description": None,
+    "server_name": "SSDPServer/1.0",
+    "services_description": None,
+    "icons_description": None,
+    # Typed alternative to the two above, lists of objects with the fields
+    # of ssdp_service_t and ssdp_icon_t
+    "services": None,
+    "icons": None,
+    # URI to file, relative to the manifest, served with the description
+    "files": {},
+    # Also store gzip bodies, served to clients accepting them
+    "gzip": False,
+}
+
+# Same limits as the SSDP_*_SIZE of ssdp.c, the services and icons
+# descriptions are not limited as they stay in flash
+LIMITS = {
+    "schema_url": 64,
+    "device_type": 64,
+    "friendly_name": 64,
+    "serial_number": 32,
+    "presentation_url": 128,
+    "model_name": 64,
+    "model_url": 128,
+    "model_number": 32,
+    "model_description": 64,
+    "server_name": 64,
+    "manufacturer_name": 64,
+    "manufacturer_url": 128,
+}
+
+# Must match SSDP_SCHEMA_TEMPLATE of ssdp.c
+SCHEMA_TEMPLATE = (
+    "<?xml version=\"1.0\"?>"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\" configId=\"%(config_id)s\">"
+    "<specVersion>"
+    "<major>1</major>"
+    "<minor>0</minor>"
+    "</specVersion>"
+    "<device>"
+    "<deviceType>urn:schemas-upnp-org:device:%(device_type)s:1</deviceType>"
+    "<friendlyName>%(friendly_name)s</friendlyName>"
+    "<presentationURL>%(presentation_url)s</presentationURL>"
+    "<serialNumber>%(serial_number)s</serialNumber>"
+    "<modelName>%(model_name)s</modelName>"
+    "<modelDescription>%(model_description)s</modelDescription>"
+    "<modelNumber>%(model_number)s</modelNumber>"
+    "<modelURL>%(model_url)s</modelURL>"
+    "<manufacturer>%(manufacturer_name)s</manufacturer>"
+    "<manufacturerURL>%(manufacturer_url)s</manufacturerURL>"
+    "<UDN>uuid:%(uuid)s</UDN>"
+    "<serviceList>%(services_description)s</serviceList>"
+    "<iconList>%(icons_description)s</iconList>"
+    "</device>"
+    "</root>\r\n"
+    "\r\n")
+
+# Must match SSDP_SERVICE_TEMPLATE and SSDP_ICON_TEMPLATE of ssdp.c
+SERVICE_TEMPLATE = (
+    "<service>"
+    "<serviceType>%(type)s</serviceType>"
+    "<serviceId>%(id)s</serviceId>"
+    "<SCPDURL>%(scpd_url)s</SCPDURL>"
+    "<controlURL>%(control_url)s</controlURL>"
+    "<eventSubURL>%(event_url)s</eventSubURL>"
+    "</service>")
+
+ICON_TEMPLATE = (
+    "<icon>"
+    "<mimetype>%(mime_type)s</mimetype>"
+    "<width>%(width)d</width>"
+    "<height>%(height)d</height>"
+    "<depth>%(depth)d</depth>"
+    "<url>%(url)s</url>"
+    "</icon>")
+
+UDN_MARK = "<UDN>uuid:"
+UUID_PATTERN = re.compile(r"^[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-"
+                          r"[0-9a-fA-F]{4}-[0-9a-fA-F]{12}$")
+CONFIGID_MAX = 16777215
+
+
+def fnv1a(data):
+    """
+    FNV-1a 32 bits, same as ssdp_hash_nt() when data is lower case.
+    """
+    value = 2166136261
+    for byte in data.encode():
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    return value
+
+
+def c_string(text, indent="    "):
+    """
+    C literal of text, split after each LF to keep the generated lines
+    readable.
+    """
+    segments = []
+    for segment in re.split(r"(?<=\n)", text):
+        if not segment and segments:
+            continue
+        out = []
+        for char in segment:
+            if char == "\\":
+                out.append("\\\\")
+            elif char == "\"":
+                out.append("\\\"")
+            elif char == "\r":
+                out.append("\\r")
+            elif char == "\n":
+                out.append("\\n")
+            elif ord(char) < 0x20 or ord(char) > 0x7e:
+                # Octal keeps the next character out of the escape
+                out.extend("\\%03o" % byte for byte in char.encode())
+            else:
+                out.append(char)
+        segments.append("\"" + "".join(out) + "\"")
+    return ("\n" + indent).join(segments)
+
+
+def valid_text(text, required):
+    """
+    Same check as ssdp_valid_text(): copied as is, so no markup.
+    """
+    if not text:
+        return not required
+    return isinstance(text, str) and not re.search(r"[<>&]", text)
+
+
+def render_services(services):
+    """
+    serviceList of the typed services, checked as ssdp_validate_services()
+    does.
+    """
+    ids = set()
+    xml = []
+    for index, service in enumerate(services):
+        unknown = set(service) - set(("type", "id", "scpd_url", "control_url",
+                                      "event_url"))
+        if unknown or not valid_text(service.get("type"), True) or \
+                not service["type"].startswith("urn:") or \
+                ":service:" not in service["type"] or \
+                not valid_text(service.get("id"), True) or \
+                not valid_text(service.get("scpd_url"), True) or \
+                not valid_text(service.get("control_url"), True) or \
+                not valid_text(service.get("event_url"), False):
+            raise ValueError("invalid service %d" % index)
+        if service["id"] in ids:
+            raise ValueError("duplicate serviceId " + service["id"])
+        ids.add(service["id"])
+        fields = dict(service)
+        fields["event_url"] = service.get("event_url") or ""
+        xml.append(SERVICE_TEMPLATE % fields)
+    return "".join(xml)
+
+
+def render_icons(icons):
+    """
+    iconList of the typed icons, checked as ssdp_validate_services() does.
+    """
+    xml = []
+    for index, icon in enumerate(icons):
+        unknown = set(icon) - set(("mime_type", "width", "height", "depth",
+                                   "url"))
+        if unknown or not valid_text(icon.get("mime_type"), True) or \
+                "/" not in icon["mime_type"] or \
+                not valid_text(icon.get("url"), True) or \
+                not all(isinstance(icon.get(key), int) and icon[key] > 0
+                        for key in ("width", "height", "depth")):
+            raise ValueError("invalid icon %d" % index)
+        xml.append(ICON_TEMPLATE % icon)
+    return "".join(xml)
+
+
+def load(path):
+    """
+    Reads a JSON manifest, or a YAML one when PyYAML is available.
+    """
+    with open(path) as manifest_file:
+        if path.endswith((".yaml", ".yml")):
+            import yaml
+            data = yaml.safe_load(manifest_file)
+        else:
+            data = json.load(manifest_file)
+    if not isinstance(data, dict):
+        raise ValueError("the manifest must be an object")
+    unknown = set(data) - set(DEFAULTS)
+    if unknown:
+        raise ValueError("unknown keys: " + ", ".join(sorted(unknown)))
+    manifest = dict(DEFAULTS)
+    manifest.update(data)
+    for key, render in (("services", render_services),
+                        ("icons", render_icons)):
+        if manifest[key] is None:
+            continue
+        if manifest[key + "_description"] is not None:
+            raise ValueError("%s and %s_description are exclusive"
+                             % (key, key))
+        manifest[key + "_description"] = render(manifest[key])
+    for key, limit in LIMITS.items():
+        if manifest[key] is not None and len(manifest[key]) > limit:
+            raise ValueError("%s is longer than %d" % (key, limit))
+    if manifest["uuid"] is not None and \
+            not UUID_PATTERN.match(manifest["uuid"]):
+        raise ValueError("uuid is not a valid UUID")
+    base_dir = os.path.dirname(os.path.abspath(path))
+    files = []
+    for uri, file_path in sorted(manifest["files"].items()):
+        if not uri.startswith("/"):
+            raise ValueError("file URI %s must start with /" % uri)
+        file_path = os.path.join(base_dir, file_path)
+        with open(file_path, "rb") as content:
+            files.append((uri, file_path, content.read().decode("utf-8")))
+    manifest["files"] = files
+    return manifest
+
+
+def service_types(services_xml):
+    """
+    Service types announced after the root device, uuid and device type, in
+    the order of the services description and each type once, as
+    ssdp_build_targets() does.
+    """
+    types = []
+    for service_type in re.findall(r"<serviceType>(.*?)</serviceType>",
+                                   services_xml or ""):
+        if service_type.lower() not in (known.lower() for known in types):
+            types.append(service_type)
+    return types
+
+
+def compress(text):
+    """
+    gzip body with a null timestamp so the build is reproducible.
+    """
+    return gzip.compress(text.encode(), compresslevel=9, mtime=0)
+
+
+def c_bytes(data, indent="    "):
+    """
+    C initializer of a byte array, 12 bytes per line.
+    """
+    rows = []
+    for start in range(0, len(data), 12):
+        rows.append(", ".join("0x%02x" % byte
+                              for byte in data[start:start + 12]))
+    return "{\n" + indent + (",\n" + indent).join(rows) + "}"
+
+
+def render_description(manifest, config_id, uuid):
+    fields = dict((key, value or "") for key, value in manifest.items())
+    fields["config_id"] = config_id
+    fields["uuid"] = uuid
+    return SCHEMA_TEMPLATE % fields
+
+
+def st_table(nts):
+    """
+    Open addressing table of the target indexes on the NT hash, at least half
+    empty so a missing ST is rejected after a few probes.
+    """
+    size = 4
+    while size < len(nts) * 2:
+        size *= 2
+    mask = size - 1
+    table = [-1] * size
+    for index, nt in enumerate(nts):
+        slot = fnv1a(nt.lower()) & mask
+        while table[slot] >= 0:
+            slot = (slot + 1) & mask
+        table[slot] = index
+    return table, mask
+
+
+def generate(manifest, source, symbol):
+    uuid = manifest["uuid"]
+    # CONFIGID.UPNP.ORG follows the content of the description and of the
+    # files served with it
+    content = render_description(manifest, "", uuid or "")
+    content += "".join(uri + body for uri, _, body in manifest["files"])
+    config_id = fnv1a(content) & CONFIGID_MAX
+    description = render_description(manifest, config_id, uuid or "")
+    nts = ["upnp:rootdevice",
+           "uuid:" + uuid if uuid else None,
+           "urn:schemas-upnp-org:device:%s:1" % (manifest["device_type"] or "")]
+    nts.extend(service_types(manifest["services_description"]))
+
+    lines = []
+    lines.append("/*\n"
+                 "  ssdp_manifest.c device identity compiled from %s\n"
+                 "\n"
+                 "  Generated by tools/ssdp_manifest.py, do not edit.\n"
+                 "*/\n"
+                 "#include \"ssdp.h\"\n" % os.path.basename(source))
+    if uuid:
+        lines.append("static const char SSDP_MANIFEST_DESCRIPTION[] =\n    %s;\n"
+                     % c_string(description))
+        if manifest["gzip"]:
+            lines.append("static const uint8_t SSDP_MANIFEST_DESCRIPTION_GZIP[] "
+                         "= %s;\n" % c_bytes(compress(description)))
+    else:
+        head, tail = description.split(UDN_MARK, 1)
+        head += UDN_MARK
+        lines.append("static const char SSDP_MANIFEST_DESCRIPTION[] =\n    %s;\n"
+                     % c_string(head))
+        lines.append("static const char SSDP_MANIFEST_DESCRIPTION_TAIL[] =\n"
+                     "    %s;\n" % c_string(tail))
+    lines.append("static const ssdp_manifest_target_t SSDP_MANIFEST_TARGETS[] "
+                 "= {")
+    for nt in nts:
+        if nt is None:
+            lines.append("    {NULL, NULL, 0, 0, 0},")
+            continue
+        if uuid:
+            # Must match SSDP_TARGET_TEMPLATE of ssdp.c
+            usn = uuid if nt.startswith("uuid:") else uuid + "::" + nt
+            line = "%s\r\nUSN: uuid:%s\r\n" % (nt, usn)
+            lines.append("    {%s,\n     %s,\n     %d, %d, 0x%08xu}," %
+                         (c_string(nt), c_string(line, "     "), len(nt),
+                          len(line), fnv1a(nt.lower())))
+        else:
+            lines.append("    {%s, NULL, %d, 0, 0x%08xu}," %
+                         (c_string(nt), len(nt), fnv1a(nt.lower())))
+    lines.append("};\n")
+    for index, (uri, _, body) in enumerate(manifest["files"]):
+        lines.append("static const char SSDP_MANIFEST_FILE_%d[] =\n    %s;\n" %
+                     (index, c_string(body)))
+        if manifest["gzip"]:
+            lines.append("static const uint8_t SSDP_MANIFEST_FILE_%d_GZIP[] = "
+                         "%s;\n" % (index, c_bytes(compress(body))))
+    if manifest["files"]:
+        lines.append("static const ssdp_manifest_file_t SSDP_MANIFEST_FILES[] "
+                     "= {")
+        for index, (uri, _, body) in enumerate(manifest["files"]):
+            if manifest["gzip"]:
+                gzip_body = "SSDP_MANIFEST_FILE_%d_GZIP" % index
+                gzip_len = "sizeof(%s)" % gzip_body
+            else:
+                gzip_body = "NULL"
+                gzip_len = "0"
+            lines.append("    {%s, SSDP_MANIFEST_FILE_%d,\n"
+                         "     sizeof(SSDP_MANIFEST_FILE_%d) - 1, %s, %s}," %
+                         (c_string(uri), index, index, gzip_body, gzip_len))
+        lines.append("};\n")
+    if uuid:
+        table, mask = st_table(nts)
+        lines.append("static const int16_t SSDP_MANIFEST_ST_TABLE[%d] = {%s};\n"
+                     % (len(table), ", ".join(str(value) for value in table)))
+
+    def string_or_null(key):
+        return c_string(manifest[key]) if manifest[key] is not None \
+            else "NULL"
+
+    lines.append("const ssdp_manifest_t %s = {" % symbol)
+    lines.append("    .uuid = %s," % (c_string(uuid) if uuid else "NULL"))
+    for key in ["schema_url", "device_type", "server_name", "model_name",
+                "model_number"]:
+        lines.append("    .%s = %s," % (key, string_or_null(key)))
+    lines.append("    .description = SSDP_MANIFEST_DESCRIPTION,")
+    lines.append("    .description_len = sizeof(SSDP_MANIFEST_DESCRIPTION) - 1,")
+    if uuid:
+        lines.append("    .description_tail = NULL,")
+        lines.append("    .description_tail_len = 0,")
+    else:
+        lines.append("    .description_tail = SSDP_MANIFEST_DESCRIPTION_TAIL,")
+        lines.append("    .description_tail_len = "
+                     "sizeof(SSDP_MANIFEST_DESCRIPTION_TAIL) - 1,")
+    if uuid and manifest["gzip"]:
+        lines.append("    .description_gzip = SSDP_MANIFEST_DESCRIPTION_GZIP,")
+        lines.append("    .description_gzip_len = "
+                     "sizeof(SSDP_MANIFEST_DESCRIPTION_GZIP),")
+    else:
+        lines.append("    .description_gzip = NULL,")
+        lines.append("    .description_gzip_len = 0,")
+    if manifest["files"]:
+        lines.append("    .files = SSDP_MANIFEST_FILES,")
+        lines.append("    .file_count = %d," % len(manifest["files"]))
+    else:
+        lines.append("    .files = NULL,")
+        lines.append("    .file_count = 0,")
+    lines.append("    .config_id = %du," % config_id)
+    lines.append("    .targets = SSDP_MANIFEST_TARGETS,")
+    lines.append("    .target_count = %d," % len(nts))
+    if uuid:
+        lines.append("    .st_table = SSDP_MANIFEST_ST_TABLE,")
+        lines.append("    .st_mask = %du," % mask)
+    else:
+        lines.append("    .st_table = NULL,")
+        lines.append("    .st_mask = 0,")
+    lines.append("};\n")
+    return "\n".join(lines)
+
+
+def main():
+    """
+    Compiles a device manifest into C.
+
+    The manifest is a JSON (or YAML) object using the string fields of
+    ssdp_config_t. The generated source defines a const ssdp_manifest_t with
+    the description, the NOTIFY/response target lines, their lengths and the
+    ST hash table, all in flash, along with the files listed in "files"
+    (SCPDs...) and their gzip bodies when "gzip" is true. Without uuid in the
+    manifest, the uuid is made from uuid_root and the MAC address at start
+    and only the uuid parts are rendered in RAM.
+    """
+    parser = argparse.ArgumentParser(description=main.__doc__.split("\n")[1])
+    parser.add_argument("manifest", help="JSON or YAML device manifest")
+    parser.add_argument("-o", "--output", required=True,
+                        help="generated C source")
+    parser.add_argument("--depfile", default=None,
+                        help="write the files read, for the build system")
+    parser.add_argument("--symbol", default="ssdp_manifest",
+                        help="name of the ssdp_manifest_t (default "
+                        "%(default)s)")
+    args = parser.parse_args()
+    try:
+        manifest = load(args.manifest)
+    except (IOError, ValueError, ImportError) as error:
+        sys.stderr.write("%s: %s\n" % (args.manifest, error))
+        return 1
+    content = generate(manifest, args.manifest, args.symbol)
+    if args.depfile:
+        with open(args.depfile, "w") as depfile:
+            depfile.write("%s: %s\n" % (args.output, " ".join(
+                [os.path.abspath(args.manifest)] +
+                [file_path for _, file_path, _ in manifest["files"]])))
+    # Keep the timestamp when nothing changed, it is rebuilt otherwise
+    if os.path.exists(args.output):
+        with open(args.output) as previous:
+            if previous.read() == content:
+                return 0
+    with open(args.output, "w") as output:
+        output.write(content)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,337 @@
+#!/usr/bin/python
+
+import argparse
+import json
+import selectors
+import socket
+import struct
+import sys
+import time
+
+SSDP_ADDR = "239.255.255.250"
+SSDP_PORT = 1900
+
+# pcap magic as read little endian: (byte order, timestamp divisor)
+PCAP_MAGICS = {
+    0xa1b2c3d4: ("<", 1e6),
+    0xd4c3b2a1: (">", 1e6),
+    0xa1b23c4d: ("<", 1e9),
+    0x4d3cb2a1: (">", 1e9),
+}
+LINKTYPE_NULL = 0
+LINKTYPE_ETHERNET = 1
+LINKTYPE_RAW = 101
+LINKTYPE_LINUX_SLL = 113
+LINKTYPE_IPV4 = 228
+
+
+def ip_offset(linktype, frame):
+    """
+    Finds where the IPv4 header starts in a captured frame.
+
+    Returns:
+        offset, or None for anything else than IPv4
+    """
+    if linktype in (LINKTYPE_RAW, LINKTYPE_IPV4):
+        offset = 0
+    elif linktype == LINKTYPE_NULL:
+        offset = 4
+    elif linktype == LINKTYPE_ETHERNET:
+        offset = 14
+        ethertype = struct.unpack_from("!H", frame, 12)[0]
+        if ethertype == 0x8100:
+            offset, ethertype = 18, struct.unpack_from("!H", frame, 16)[0]
+        if ethertype != 0x0800:
+            return None
+    elif linktype == LINKTYPE_LINUX_SLL:
+        if struct.unpack_from("!H", frame, 14)[0] != 0x0800:
+            return None
+        offset = 16
+    else:
+        raise ValueError("unsupported pcap link type %d" % linktype)
+    if len(frame) < offset + 20 or frame[offset] >> 4 != 4:
+        return None
+    return offset
+
+
+def read_pcap(path):
+    """
+    Reads the UDP over IPv4 datagrams of a pcap file, as written by
+    ssdp_capture_start() or tcpdump.
+
+    Returns:
+        list of dict(time, src, sport, dst, dport, payload)
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < 24:
+        raise ValueError("%s: not a pcap file" % path)
+    magic = struct.unpack_from("<I", data, 0)[0]
+    if magic not in PCAP_MAGICS:
+        raise ValueError("%s: not a pcap file" % path)
+    order, divisor = PCAP_MAGICS[magic]
+    linktype = struct.unpack_from(order + "I", data, 20)[0] & 0xffff
+    packets = []
+    pos = 24
+    while pos + 16 <= len(data):
+        sec, frac, incl_len, _ = struct.unpack_from(order + "IIII", data, pos)
+        frame = data[pos + 16:pos + 16 + incl_len]
+        pos += 16 + incl_len
+        offset = ip_offset(linktype, frame)
+        if offset is None:
+            continue
+        ihl = (frame[offset] & 0x0f) * 4
+        if frame[offset + 9] != socket.IPPROTO_UDP:
+            continue
+        total_len = struct.unpack_from("!H", frame, offset + 2)[0]
+        udp = offset + ihl
+        if len(frame) < udp + 8:
+            continue
+        sport, dport, udp_len = struct.unpack_from("!HHH", frame, udp)
+        end = min(len(frame), offset + total_len, udp + udp_len)
+        packets.append({
+            "time": sec + frac / divisor,
+            "src": socket.inet_ntoa(frame[offset + 12:offset + 16]),
+            "sport": sport,
+            "dst": socket.inet_ntoa(frame[offset + 16:offset + 20]),
+            "dport": dport,
+            "payload": frame[udp + 8:end],
+        })
+    return packets
+
+
+def header_value(payload, name):
+    """
+    Returns the value of the first header called name, or None.
+    """
+    for line in payload.split(b"\r\n")[1:]:
+        key, sep, value = line.partition(b":")
+        if sep and key.strip().lower() == name:
+            return value.strip().decode(errors="replace")
+    return None
+
+
+def select_requests(packets, args):
+    """
+    Keeps the datagrams sent to the responder by other hosts.
+
+    Returns:
+        list of packets
+    """
+    ports = {SSDP_PORT} | set(args.search_port)
+    requests = []
+    for packet in packets:
+        if packet["dport"] not in ports or packet["src"] in args.device:
+            continue
+        if packet["payload"].startswith(b"HTTP/"):
+            continue
+        if args.search_only and not packet["payload"].startswith(b"M-SEARCH"):
+            continue
+        requests.append(packet)
+    return requests
+
+
+def replay(requests, args):
+    """
+    Sends the requests at their captured pace divided by --speed, each from
+    its own socket so the responses can be told apart, and collects the
+    responses for --wait seconds after each one.
+
+    Returns:
+        list of per packet results
+    """
+    selector = selectors.DefaultSelector()
+    results = []
+    start = time.monotonic()
+    origin = requests[0]["time"] if requests else 0
+    index = 0
+    while index < len(requests) or selector.get_map():
+        now = time.monotonic()
+        if index < len(requests):
+            offset = requests[index]["time"] - origin
+            due = start + (offset / args.speed if args.speed > 0 else 0)
+            if due <= now:
+                packet = requests[index]
+                sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM,
+                                     socket.IPPROTO_UDP)
+                sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL,
+                                args.ttl)
+                if args.interface:
+                    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF,
+                                    socket.inet_aton(args.interface))
+                    sock.bind((args.interface, 0))
+                sock.setblocking(False)
+                dport = args.port if packet["dport"] == SSDP_PORT \
+                    else packet["dport"]
+                sent = time.monotonic()
+                sock.sendto(packet["payload"], (args.target, dport))
+                payload = packet["payload"]
+                result = {
+                    "index": index,
+                    "offset": round(offset, 6),
+                    "lag_ms": round((sent - due) * 1000, 3),
+                    "request": payload.split(b"\r\n", 1)[0].decode(
+                        errors="replace"),
+                    "st": header_value(payload, b"st") or
+                    header_value(payload, b"nt"),
+                    "latency_ms": [],
+                    "usn": [],
+                }
+                results.append(result)
+                selector.register(sock, selectors.EVENT_READ,
+                                  (result, sent, sent + args.wait))
+                index += 1
+                continue
+            timeout = due - now
+        else:
+            timeout = args.wait
+        for key in list(selector.get_map().values()):
+            deadline = key.data[2]
+            if deadline <= now:
+                selector.unregister(key.fileobj)
+                key.fileobj.close()
+            else:
+                timeout = min(timeout, deadline - now)
+        for key, _ in selector.select(max(timeout, 0)):
+            result, sent, _ = key.data
+            try:
+                data = key.fileobj.recv(2048)
+            except BlockingIOError:
+                continue
+            result["latency_ms"].append(
+                round((time.monotonic() - sent) * 1000, 3))
+            result["usn"].append(header_value(data, b"usn"))
+    return results
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def summarize(results):
+    """
+    Returns:
+        dict of totals and first response latency percentiles
+    """
+    first = [r["latency_ms"][0] for r in results if r["latency_ms"]]
+    lags = [r["lag_ms"] for r in results]
+    return {
+        "packets": len(results),
+        "answered": len(first),
+        "responses": sum(len(r["latency_ms"]) for r in results),
+        "first_p50_ms": percentile(first, 0.5),
+        "first_p99_ms": percentile(first, 0.99),
+        "first_max_ms": max(first) if first else None,
+        "lag_max_ms": max(lags) if lags else None,
+    }
+
+
+def compare(results, baseline):
+    """
+    Lists the packets whose set of responses differs from a previous run
+    (--json output of another build).
+
+    Returns:
+        list of (index, request, missing USNs, extra USNs)
+    """
+    previous = {r["index"]: r for r in baseline["packets"]}
+    differences = []
+    for result in results:
+        old = previous.get(result["index"])
+        old_usn = set(old["usn"]) if old else set()
+        new_usn = set(result["usn"])
+        if old_usn != new_usn:
+            differences.append((result["index"], result["request"],
+                                sorted(old_usn - new_usn),
+                                sorted(new_usn - old_usn)))
+    return differences
+
+
+def print_report(results, summary, differences):
+    for r in results:
+        latency = r["latency_ms"]
+        print("%5d %10.3fs %-24s %-40s %3d responses, first %s ms, "
+              "last %s ms" % (r["index"], r["offset"], r["request"][:24],
+                              (r["st"] or "-")[:40], len(latency),
+                              latency[0] if latency else "-",
+                              latency[-1] if latency else "-"))
+    print("%d packets, %d answered, %d responses" %
+          (summary["packets"], summary["answered"], summary["responses"]))
+    print("first response p50 %s ms, p99 %s ms, max %s ms" %
+          (summary["first_p50_ms"], summary["first_p99_ms"],
+           summary["first_max_ms"]))
+    print("send lag max %s ms" % summary["lag_max_ms"])
+    if differences is not None:
+        print("%d packets answered differently from the baseline" %
+              len(differences))
+        for index, request, missing, extra in differences:
+            print("%5d %s" % (index, request))
+            for usn in missing:
+                print("        - %s" % usn)
+            for usn in extra:
+                print("        + %s" % usn)
+
+
+def main():
+    """
+    Replays a pcap capture against the SSDP responder.
+
+    The datagrams other hosts sent to port 1900 (and to the search ports) in a
+    capture written by ssdp_capture_start() or tcpdump are sent again to a
+    device or a host build, at their original pace, faster with --speed, or
+    back to back with --speed 0. The responses to each one are collected with
+    their latency, and --baseline compares them with the --json report of
+    another build, e.g. before and after a change of the matching code. Run
+    the host build with CONFIG_SSDP_TRACE to compare the time spent in each
+    stage as well.
+    """
+    parser = argparse.ArgumentParser(description=main.__doc__.split("\n")[1])
+    parser.add_argument("pcap", help="capture to replay")
+    parser.add_argument("--target", default=SSDP_ADDR,
+                        help="multicast group or unicast address of the "
+                        "responder (default %(default)s)")
+    parser.add_argument("--port", type=int, default=SSDP_PORT)
+    parser.add_argument("--search-port", type=int, action="append",
+                        default=[], help="unicast search port of the "
+                        "captured device, replayed as is")
+    parser.add_argument("--interface", default=None,
+                        help="local address to send from (veth, loopback...)")
+    parser.add_argument("--device", action="append", default=[],
+                        help="address of the captured device, its own "
+                        "datagrams are not replayed")
+    parser.add_argument("--search-only", action="store_true",
+                        help="replay the M-SEARCH requests only")
+    parser.add_argument("--speed", type=float, default=1.0,
+                        help="replay speed factor, 0 for back to back")
+    parser.add_argument("--wait", type=float, default=6.0,
+                        help="seconds to collect the responses to a packet")
+    parser.add_argument("--ttl", type=int, default=2)
+    parser.add_argument("--baseline", default=None,
+                        help="--json report of a previous run to compare with")
+    parser.add_argument("--json", action="store_true",
+                        help="dump the report as JSON")
+    args = parser.parse_args()
+
+    requests = select_requests(read_pcap(args.pcap), args)
+    if not requests:
+        print("No datagram to replay in %s" % args.pcap, file=sys.stderr)
+        return 1
+    results = replay(requests, args)
+    summary = summarize(results)
+    differences = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            differences = compare(results, json.load(f))
+    if args.json:
+        json.dump({"summary": summary, "packets": results}, sys.stdout,
+                  indent=2)
+    else:
+        print_report(results, summary, differences)
+    return 0 if not differences else 2
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,553 @@
+#!/usr/bin/python
+
+import argparse
+import heapq
+import itertools
+import json
+import random
+import sys
+
+# Event kinds, ordered so that simultaneous events are processed the same way
+# on every run
+EVENT_NOTIFY = 0
+EVENT_SEARCH = 1
+EVENT_REBOOT = 2
+
+
+class Bus(object):
+    """
+    In-memory multicast medium: every datagram is lost with a probability,
+    delayed by a base delay plus a random jitter, and may be reordered by an
+    extra delay. With a capacity, datagrams over the limit of a 10 ms slot are
+    dropped as a congested Wi-Fi channel would do.
+    """
+
+    SLOT_MS = 10
+
+    def __init__(self, args, rnd):
+        self.rnd = rnd
+        self.loss = args.loss
+        self.delay = args.delay
+        self.delay_jitter = args.delay_jitter
+        self.reorder = args.reorder
+        self.reorder_delay = args.reorder_delay
+        self.capacity = args.capacity
+        self.slots = {}
+        self.seconds = {}
+        self.sent = 0
+        self.lost = 0
+        self.congested = 0
+
+    def transmit(self, now, count=1):
+        """
+        Sends count datagrams at now.
+
+        Returns:
+            number of datagrams accepted by the medium
+        """
+        self.sent += count
+        second = now // 1000
+        self.seconds[second] = self.seconds.get(second, 0) + count
+        if not self.capacity:
+            return count
+        slot = now // self.SLOT_MS
+        used = self.slots.get(slot, 0)
+        accepted = max(0, min(count, self.capacity - used))
+        self.slots[slot] = used + accepted
+        self.congested += count - accepted
+        return accepted
+
+    def arrival(self, now):
+        """
+        Arrival time of one datagram sent at now to one receiver, None if it
+        is lost.
+        """
+        if self.loss and self.rnd.random() < self.loss:
+            self.lost += 1
+            return None
+        delay = self.delay
+        if self.delay_jitter:
+            delay += self.rnd.randint(0, self.delay_jitter)
+        if self.reorder and self.rnd.random() < self.reorder:
+            delay += self.reorder_delay
+        return now + delay
+
+    def peak_rate(self):
+        return max(self.seconds.values()) if self.seconds else 0
+
+
+class Responder(object):
+    """
+    Announcement and search response policy of ssdp.c: random startup delay,
+    startup burst, refresh period shortened by jitter, MX spreading and a
+    bounded queue of pending responses.
+    """
+
+    def __init__(self, index, args, rnd):
+        self.index = index
+        self.args = args
+        self.rnd = rnd
+        self.targets = 3 + args.services
+        self.notify_time = 0
+        self.burst_remaining = 0
+        self.pending = []
+        self.boot = 0
+
+    def restart_announcements(self, now):
+        # ssdp_restart_announcements()
+        self.notify_time = now + self.rnd.randint(0,
+                                                  self.args.startup_delay_max)
+        self.burst_remaining = max(0, self.args.startup_burst - 1)
+        self.pending = []
+        self.boot += 1
+
+    def schedule_notify(self, now):
+        # ssdp_schedule_notify()
+        if self.burst_remaining > 0:
+            self.burst_remaining -= 1
+            spacing = self.args.startup_burst_spacing
+            delay = self.rnd.randint(spacing // 2, spacing)
+        else:
+            period = self.args.max_age * self.args.refresh_percent * 10
+            jitter = period * self.args.jitter_percent // 100
+            delay = period - self.rnd.randint(0, jitter)
+        self.notify_time = now + delay
+
+    def queue_reply(self, now, mx):
+        """
+        onPacket() and ssdp_queue_reply(): due time of the response, None if
+        the queue of pending responses is full.
+        """
+        self.pending = [due for due in self.pending if due > now]
+        if len(self.pending) >= self.args.pending_max:
+            return None
+        window = min(mx * 1000, self.args.mx_max_delay)
+        due = now + self.rnd.randint(0, window)
+        self.pending.append(due)
+        return due
+
+
+class ControlPoint(object):
+    """
+    Control point caching devices from NOTIFY for max-age and searching
+    periodically with MX and a number of copies of each M-SEARCH.
+    """
+
+    def __init__(self, index, devices):
+        self.index = index
+        self.expiry = [0] * devices
+        self.stale_ms = 0
+        self.seen = bytearray(devices)
+
+    def refresh(self, device, arrival, max_age_ms):
+        # Time the device was missing from the cache since it expired
+        expiry = self.expiry[device]
+        if self.seen[device] and arrival > expiry:
+            self.stale_ms += arrival - expiry
+        self.seen[device] = 1
+        if arrival + max_age_ms > expiry:
+            self.expiry[device] = arrival + max_age_ms
+
+
+class Simulation(object):
+
+    def __init__(self, args, mx, repeat, max_age):
+        self.args = args
+        self.mx = mx
+        self.repeat = repeat
+        self.max_age_ms = max_age * 1000
+        self.rnd = random.Random(args.seed)
+        self.bus = Bus(args, self.rnd)
+        self.events = []
+        self.seq = itertools.count()
+        self.duration = int(args.hours * 3600 * 1000)
+        responder_args = argparse.Namespace(**vars(args))
+        responder_args.max_age = max_age
+        self.responders = [Responder(i, responder_args, self.rnd)
+                           for i in range(args.devices)]
+        self.control_points = [ControlPoint(i, args.devices)
+                               for i in range(args.control_points)]
+        self.rounds = []
+        self.pending_dropped = 0
+        self.notify_sent = 0
+        self.responses_sent = 0
+
+    def push(self, when, kind, index, extra=0):
+        if when <= self.duration:
+            heapq.heappush(self.events, (when, kind, next(self.seq), index,
+                                         extra))
+
+    def boot(self, responder, now):
+        responder.restart_announcements(now)
+        self.push(responder.notify_time, EVENT_NOTIFY, responder.index,
+                  responder.boot)
+
+    def setup(self):
+        args = self.args
+        window = int(args.boot_window * 1000)
+        for responder in self.responders:
+            self.boot(responder, self.rnd.randint(0, window))
+            if args.reboots_per_day:
+                self.schedule_reboot(responder, 0)
+        interval = int(args.search_interval * 1000)
+        for point in self.control_points:
+            start = self.rnd.randint(0, interval)
+            self.push(start, EVENT_SEARCH, point.index)
+
+    def schedule_reboot(self, responder, now):
+        mean = 86400000.0 / self.args.reboots_per_day
+        self.push(now + int(self.rnd.expovariate(1.0 / mean)), EVENT_REBOOT,
+                  responder.index)
+
+    def on_notify(self, now, responder):
+        responder.schedule_notify(now)
+        self.push(responder.notify_time, EVENT_NOTIFY, responder.index,
+                  responder.boot)
+        accepted = self.bus.transmit(now, responder.targets)
+        self.notify_sent += responder.targets
+        if not accepted:
+            return
+        for point in self.control_points:
+            # Known as soon as one datagram of the batch arrives
+            arrival = None
+            for _ in range(accepted):
+                arrival = self.bus.arrival(now)
+                if arrival is not None:
+                    break
+            if arrival is not None:
+                point.refresh(responder.index, arrival, self.max_age_ms)
+
+    def on_search(self, now, point):
+        args = self.args
+        deadline = now + self.mx * 1000 + int(args.grace * 1000)
+        found = bytearray(args.devices)
+        answers = 0 if args.st == "ssdp:all" else 1
+        for copy in range(self.repeat):
+            sent_at = now + copy * args.repeat_spacing
+            if not self.bus.transmit(sent_at):
+                continue
+            for responder in self.responders:
+                arrival = self.bus.arrival(sent_at)
+                if arrival is None:
+                    continue
+                due = responder.queue_reply(arrival, self.mx)
+                if due is None:
+                    self.pending_dropped += 1
+                    continue
+                count = answers or responder.targets
+                self.responses_sent += count
+                accepted = self.bus.transmit(due, count)
+                for _ in range(accepted):
+                    back = self.bus.arrival(due)
+                    if back is not None:
+                        if back <= deadline:
+                            found[responder.index] = 1
+                        break
+        self.rounds.append(sum(found) / float(args.devices))
+        self.push(now + int(args.search_interval * 1000), EVENT_SEARCH,
+                  point.index)
+
+    def run(self):
+        self.setup()
+        while self.events:
+            now, kind, _, index, extra = heapq.heappop(self.events)
+            if kind == EVENT_NOTIFY:
+                responder = self.responders[index]
+                # Announcements scheduled before a reboot are dropped
+                if extra == responder.boot:
+                    self.on_notify(now, responder)
+            elif kind == EVENT_SEARCH:
+                self.on_search(now, self.control_points[index])
+            else:
+                responder = self.responders[index]
+                self.boot(responder, now)
+                self.schedule_reboot(responder, now)
+
+    def report(self):
+        args = self.args
+        devices = args.devices
+        rounds = sorted(self.rounds)
+        stale = 0
+        for point in self.control_points:
+            # Devices still missing at the end of the run, and those never seen
+            for device in range(devices):
+                if point.seen[device] and point.expiry[device] < self.duration:
+                    point.stale_ms += self.duration - point.expiry[device]
+            stale += point.stale_ms
+        observed = float(devices * self.duration * len(self.control_points))
+        unseen = sum(devices - sum(point.seen)
+                     for point in self.control_points)
+        return {
+            "mx": self.mx,
+            "repeat": self.repeat,
+            "max_age": self.max_age_ms // 1000,
+            "devices": devices,
+            "control_points": len(self.control_points),
+            "hours": args.hours,
+            "searches": len(rounds),
+            "search_success_mean": (sum(rounds) / len(rounds)
+                                    if rounds else None),
+            "search_success_min": rounds[0] if rounds else None,
+            "search_complete_rate": (sum(1 for value in rounds
+                                         if value >= 1.0) / len(rounds)
+                                     if rounds else None),
+            "cache_availability": (1.0 - stale / observed
+                                   if observed else None),
+            "never_announced": unseen,
+            "notify_datagrams": self.notify_sent,
+            "response_datagrams": self.responses_sent,
+            "pending_dropped": self.pending_dropped,
+            "datagrams": self.bus.sent,
+            "lost": self.bus.lost,
+            "congested": self.bus.congested,
+            "peak_datagrams_per_s": self.bus.peak_rate(),
+        }
+
+
+def print_report(report):
+    def rate(value):
+        return "-" if value is None else "%.2f%%" % (value * 100)
+
+    print("MX %d, repeat %d, max-age %d s: %d searches, success mean %s "
+          "min %s complete %s" % (report["mx"], report["repeat"],
+                                  report["max_age"], report["searches"],
+                                  rate(report["search_success_mean"]),
+                                  rate(report["search_success_min"]),
+                                  rate(report["search_complete_rate"])))
+    print("  NOTIFY cache availability %s, never announced %d" %
+          (rate(report["cache_availability"]), report["never_announced"]))
+    print("  datagrams %d (notify %d, responses %d), lost %d, congested %d, "
+          "pending dropped %d, peak %d/s" %
+          (report["datagrams"], report["notify_datagrams"],
+           report["response_datagrams"], report["lost"], report["congested"],
+           report["pending_dropped"], report["peak_datagrams_per_s"]))
+
+
+def load_trace(path):
+    """
+    Reads the JSON lines printed by examples/ssdp_sim_check, anything before
+    the first brace of a line (log prefixes) is skipped.
+
+    Returns:
+        (config, events, end)
+    """
+    config, events, end = None, [], None
+    with open(path) as trace:
+        for line in trace:
+            start = line.find("{")
+            if start < 0:
+                continue
+            try:
+                record = json.loads(line[start:])
+            except ValueError:
+                continue
+            if "config" in record:
+                config = record["config"]
+            elif "end" in record:
+                end = record["end"]
+            else:
+                events.append(record)
+    return config, events, end
+
+
+def check_trace(args):
+    """
+    Cross-checks the Responder model with one real responder: every
+    announcement and response of the trace must fall within the bounds the
+    model draws from, and a lossless one-device simulation with the same
+    settings must send as many datagrams, give or take one announcement
+    and one search.
+
+    Returns:
+        list of the mismatches, empty if the model agrees
+    """
+    config, events, end = load_trace(args.check)
+    if config is None or end is None:
+        return ["%s: no config or end record, incomplete trace" % args.check]
+    sim_args = argparse.Namespace(**vars(args))
+    for key in ("max_age", "refresh_percent", "jitter_percent",
+                "startup_delay_max", "startup_burst", "startup_burst_spacing",
+                "mx_max_delay", "search_interval"):
+        setattr(sim_args, key, config[key])
+    sim_args.hours = end / 3600000.0
+    sim_args.devices = 1
+    sim_args.control_points = 1
+    sim_args.services = 0
+    sim_args.boot_window = 0
+    sim_args.reboots_per_day = 0
+    sim_args.st = "ssdp:all"
+    sim_args.loss = sim_args.reorder = 0
+    sim_args.delay = sim_args.delay_jitter = sim_args.capacity = 0
+    targets = Responder(0, sim_args, None).targets
+    errors = []
+
+    # Announcements: startup delay, burst spacing, then the refresh period
+    spacing = config["startup_burst_spacing"]
+    period = config["max_age"] * config["refresh_percent"] * 10
+    jitter = period * config["jitter_percent"] // 100
+    notifies = [event for event in events if "notify" in event]
+    previous = 0
+    for index, event in enumerate(notifies):
+        if index == 0:
+            low, high = 0, config["startup_delay_max"]
+        elif index < config["startup_burst"]:
+            low, high = spacing // 2, spacing
+        else:
+            low, high = period - jitter, period
+        delay = event["t"] - previous
+        if not low <= delay <= high:
+            errors.append("NOTIFY %d at %d ms: %d ms after the previous one, "
+                          "model draws from [%d, %d]" %
+                          (index, event["t"], delay, low, high))
+        if event["notify"] != targets:
+            errors.append("NOTIFY %d at %d ms: %d datagrams, model sends %d" %
+                          (index, event["t"], event["notify"], targets))
+        previous = event["t"]
+
+    # Responses: one batch per search within the MX window
+    searches = dict((event["search"], event) for event in events
+                    if "mx" in event)
+    responses = [event for event in events if "response" in event]
+    answered = set()
+    for event in responses:
+        search = searches.get(event["search"])
+        if search is None:
+            errors.append("response at %d ms to unknown search %d" %
+                          (event["t"], event["search"]))
+            continue
+        answered.add(event["search"])
+        window = min(search["mx"] * 1000, config["mx_max_delay"])
+        delay = event["t"] - search["t"]
+        if not 0 <= delay <= window:
+            errors.append("search %d: answered after %d ms, model draws from "
+                          "[0, %d]" % (event["search"], delay, window))
+        if event["response"] != targets:
+            errors.append("search %d: %d datagrams, model sends %d" %
+                          (event["search"], event["response"], targets))
+    for index in sorted(set(searches) - answered):
+        # Only a full queue of pending responses drops one, never here
+        if searches[index]["t"] + config["mx_max_delay"] <= end:
+            errors.append("search %d at %d ms never answered" %
+                          (index, searches[index]["t"]))
+
+    # Totals over the whole run
+    simulation = Simulation(sim_args, config["mx"], 1, config["max_age"])
+    simulation.run()
+    report = simulation.report()
+    notify_datagrams = sum(event["notify"] for event in notifies)
+    response_datagrams = sum(event["response"] for event in responses)
+    if abs(report["notify_datagrams"] - notify_datagrams) > targets:
+        errors.append("%d NOTIFY datagrams, the model sends %d" %
+                      (notify_datagrams, report["notify_datagrams"]))
+    if abs(report["response_datagrams"] - response_datagrams) > targets:
+        errors.append("%d response datagrams, the model sends %d" %
+                      (response_datagrams, report["response_datagrams"]))
+    if not errors:
+        print("%s: %d NOTIFY and %d responses within the model, %d and %d "
+              "datagrams against %d and %d simulated" %
+              (args.check, len(notifies), len(responses), notify_datagrams,
+               response_datagrams, report["notify_datagrams"],
+               report["response_datagrams"]))
+    return errors
+
+
+def int_list(text):
+    try:
+        values = [int(value) for value in text.split(",") if value]
+    except ValueError:
+        raise argparse.ArgumentTypeError("expected comma separated integers")
+    if not values:
+        raise argparse.ArgumentTypeError("empty list")
+    return values
+
+
+def main():
+    """
+    Deterministic discrete-event simulator of an SSDP site.
+
+    Runs thousands of responders, following the announcement and response
+    policy of ssdp.c, and control points over an in-memory multicast bus with
+    loss, delay, reordering and an optional channel capacity, in virtual time:
+    24 hours of a 5,000 device site take seconds to minutes depending on the
+    search rate. It reports the share of devices found by each search and the
+    availability of devices in the control point caches fed by NOTIFY.
+
+    --mx, --repeat and --max-age accept comma separated values, every
+    combination is simulated with the same seed to compare fleet defaults.
+
+    --check compares the model with the trace of the real responder printed
+    by examples/ssdp_sim_check, and exits with 1 if they disagree.
+    """
+    parser = argparse.ArgumentParser(description=main.__doc__.split("\n")[1])
+    parser.add_argument("--devices", type=int, default=5000)
+    parser.add_argument("--control-points", type=int, default=4)
+    parser.add_argument("--hours", type=float, default=24)
+    parser.add_argument("--seed", type=int, default=1)
+    # Responder settings, same meaning as in ssdp_config_t
+    parser.add_argument("--max-age", type=int_list, default=[1200],
+                        help="CACHE-CONTROL max-age in seconds")
+    parser.add_argument("--refresh-percent", type=int, default=50)
+    parser.add_argument("--jitter-percent", type=int, default=10)
+    parser.add_argument("--startup-delay-max", type=int, default=1000)
+    parser.add_argument("--startup-burst", type=int, default=3)
+    parser.add_argument("--startup-burst-spacing", type=int, default=200)
+    parser.add_argument("--mx-max-delay", type=int, default=10000)
+    parser.add_argument("--pending-max", type=int, default=8,
+                        help="SSDP_PENDING_MAX")
+    parser.add_argument("--services", type=int, default=0,
+                        help="service types announced by each device")
+    parser.add_argument("--boot-window", type=float, default=0,
+                        help="seconds over which the devices power up, 0 for "
+                        "a site wide power cut")
+    parser.add_argument("--reboots-per-day", type=float, default=0)
+    # Control point settings
+    parser.add_argument("--mx", type=int_list, default=[3])
+    parser.add_argument("--repeat", type=int_list, default=[1],
+                        help="copies of each M-SEARCH")
+    parser.add_argument("--repeat-spacing", type=int, default=100,
+                        help="ms between copies of an M-SEARCH")
+    parser.add_argument("--search-interval", type=float, default=1800,
+                        help="seconds between searches of a control point")
+    parser.add_argument("--st", default="ssdp:all",
+                        help="ssdp:all or any single target")
+    parser.add_argument("--grace", type=float, default=0.5,
+                        help="seconds to wait for responses after MX")
+    # Network
+    parser.add_argument("--loss", type=float, default=0.01)
+    parser.add_argument("--delay", type=int, default=2, help="ms")
+    parser.add_argument("--delay-jitter", type=int, default=5, help="ms")
+    parser.add_argument("--reorder", type=float, default=0.0,
+                        help="share of datagrams delayed by --reorder-delay")
+    parser.add_argument("--reorder-delay", type=int, default=50, help="ms")
+    parser.add_argument("--capacity", type=int, default=0,
+                        help="datagrams per 10 ms slot, 0 for unlimited")
+    parser.add_argument("--json", action="store_true",
+                        help="dump the reports as JSON")
+    parser.add_argument("--check", metavar="TRACE",
+                        help="cross-check the model with a trace of "
+                        "examples/ssdp_sim_check instead of simulating")
+    args = parser.parse_args()
+
+    if args.check:
+        errors = check_trace(args)
+        for error in errors:
+            print(error)
+        return 1 if errors else 0
+
+    reports = []
+    for mx, repeat, max_age in itertools.product(args.mx, args.repeat,
+                                                 args.max_age):
+        simulation = Simulation(args, mx, repeat, max_age)
+        simulation.run()
+        report = simulation.report()
+        reports.append(report)
+        if not args.json:
+            print_report(report)
+    if args.json:
+        json.dump(reports, sys.stdout, indent=2)
+        print()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,377 @@
+#!/usr/bin/python
+
+import argparse
+import json
+import math
+import random
+import selectors
+import socket
+import sys
+import time
+
+SSDP_ADDR = "239.255.255.250"
+SSDP_PORT = 1900
+
+MALFORMED_KINDS = ["bad_method", "bad_uri", "no_man", "bad_man", "truncated",
+                   "garbage", "long_line", "no_terminator"]
+
+
+def build_search(st, mx, host):
+    """
+    Builds a well formed M-SEARCH request for the given search target.
+    """
+    return ("M-SEARCH * HTTP/1.1\r\n"
+            "HOST: %s:%d\r\n"
+            "MAN: \"ssdp:discover\"\r\n"
+            "MX: %d\r\n"
+            "ST: %s\r\n"
+            "USER-AGENT: Linux/1.0 UPnP/1.1 ssdp_storm/1.0\r\n"
+            "\r\n" % (host, SSDP_PORT, mx, st)).encode()
+
+
+def build_malformed(st, mx, host, rnd):
+    """
+    Builds a request the responder must not answer, the kind of defect is
+    picked randomly from MALFORMED_KINDS.
+
+    Returns:
+        (kind, payload)
+    """
+    kind = rnd.choice(MALFORMED_KINDS)
+    good = build_search(st, mx, host).decode()
+    if kind == "bad_method":
+        payload = good.replace("M-SEARCH", "M-SERCH", 1)
+    elif kind == "bad_uri":
+        payload = good.replace("M-SEARCH *", "M-SEARCH /", 1)
+    elif kind == "no_man":
+        payload = good.replace("MAN: \"ssdp:discover\"\r\n", "")
+    elif kind == "bad_man":
+        payload = good.replace("ssdp:discover", "ssdp:dicsover")
+    elif kind == "truncated":
+        payload = good[:rnd.randint(1, len(good) // 2)]
+    elif kind == "garbage":
+        return kind, bytes(rnd.getrandbits(8) for _ in range(rnd.randint(1, 512)))
+    elif kind == "long_line":
+        payload = good.replace("USER-AGENT: ", "USER-AGENT: " + "A" * 1200)
+    else:
+        payload = good[:-2]
+    return kind, payload.encode()
+
+
+def parse_st_mix(text):
+    """
+    Parses a search target mix like "ssdp:all=1,upnp:rootdevice=3".
+
+    Returns:
+        list of (st, weight)
+    """
+    mix = []
+    for item in text.split(","):
+        item = item.strip()
+        if not item:
+            continue
+        st, _, weight = item.rpartition("=")
+        if not st:
+            st, weight = weight, "1"
+        mix.append((st, float(weight)))
+    if not mix:
+        raise argparse.ArgumentTypeError("empty ST mix")
+    return mix
+
+
+def percentile(values, pct):
+    """
+    Nearest rank percentile of an already sorted list.
+    """
+    if not values:
+        return None
+    rank = int(math.ceil(pct / 100.0 * len(values))) - 1
+    return values[max(0, min(rank, len(values) - 1))]
+
+
+def header_value(payload, name):
+    """
+    Extracts a header value from a raw SSDP response, case insensitively.
+    """
+    for line in payload.split(b"\r\n")[1:]:
+        key, sep, value = line.partition(b":")
+        if sep and key.strip().lower() == name:
+            return value.strip().decode(errors="replace")
+    return None
+
+
+class ControlPoint:
+    """
+    One simulated control point: its own socket, one outstanding search at a
+    time, every response received in the MX window is attributed to it.
+    """
+
+    def __init__(self, index, args, rnd):
+        self.index = index
+        self.args = args
+        self.rnd = rnd
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM,
+                                  socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL,
+                             args.ttl)
+        if args.interface:
+            self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF,
+                                 socket.inet_aton(args.interface))
+        self.sock.bind((args.interface or "", 0))
+        self.sock.setblocking(False)
+        self.remaining = args.searches
+        self.search = None
+        self.next_send = time.monotonic() + rnd.uniform(0, args.spread)
+
+    def start_search(self, now, stats):
+        st = weighted_choice(self.args.st_mix, self.rnd)
+        malformed = self.rnd.random() < self.args.malformed_ratio
+        if malformed:
+            kind, payload = build_malformed(st, self.args.mx, self.args.target,
+                                            self.rnd)
+            stats["malformed_sent"][kind] = \
+                stats["malformed_sent"].get(kind, 0) + 1
+        else:
+            payload = build_search(st, self.args.mx, self.args.target)
+        self.search = {"st": st, "malformed": malformed, "sent": now,
+                       "responses": [], "deadline": now + self.args.mx +
+                       self.args.grace}
+        for _ in range(self.args.repeat):
+            try:
+                self.sock.sendto(payload, (self.args.target, self.args.port))
+                stats["datagrams_sent"] += 1
+            except OSError:
+                stats["send_errors"] += 1
+        self.remaining -= 1
+
+    def receive(self, now, stats):
+        while True:
+            try:
+                payload, source = self.sock.recvfrom(2048)
+            except BlockingIOError:
+                return
+            except OSError:
+                stats["recv_errors"] += 1
+                return
+            stats["datagrams_received"] += 1
+            if self.search is None or not payload.startswith(b"HTTP/1.1 200"):
+                stats["unexpected"] += 1
+                continue
+            self.search["responses"].append(
+                (now - self.search["sent"], source[0],
+                 header_value(payload, b"st"), header_value(payload, b"usn")))
+
+    def finish_search(self, stats):
+        search = self.search
+        self.search = None
+        self.next_send = time.monotonic() + self.args.pause
+        if search["malformed"]:
+            stats["malformed"] += 1
+            if search["responses"]:
+                stats["malformed_answered"] += 1
+            return
+        stats["searches"] += 1
+        if not search["responses"]:
+            stats["unanswered"] += 1
+            return
+        stats["answered"] += 1
+        usns = set()
+        for delay, source, st, usn in search["responses"]:
+            stats["latencies"].append(delay)
+            stats["normalized"].append(delay / self.args.mx
+                                       if self.args.mx else 0.0)
+            if st != search["st"] and search["st"] != "ssdp:all":
+                stats["wrong_st"] += 1
+            key = (source, usn, st)
+            if key in usns:
+                stats["duplicates"] += 1
+            usns.add(key)
+        stats["responses"] += len(search["responses"])
+
+    def done(self):
+        return self.remaining <= 0 and self.search is None
+
+
+def weighted_choice(mix, rnd):
+    total = sum(weight for _, weight in mix)
+    pick = rnd.uniform(0, total)
+    for st, weight in mix:
+        pick -= weight
+        if pick <= 0:
+            return st
+    return mix[-1][0]
+
+
+def run_storm(args, clients):
+    """
+    Runs one storm with the given number of control points and returns the
+    collected statistics.
+    """
+    rnd = random.Random(args.seed)
+    stats = {"searches": 0, "answered": 0, "unanswered": 0, "responses": 0,
+             "malformed": 0, "malformed_answered": 0, "malformed_sent": {},
+             "wrong_st": 0, "duplicates": 0, "unexpected": 0,
+             "datagrams_sent": 0, "datagrams_received": 0, "send_errors": 0,
+             "recv_errors": 0, "latencies": [], "normalized": []}
+    selector = selectors.DefaultSelector()
+    points = [ControlPoint(i, args, rnd) for i in range(clients)]
+    for point in points:
+        selector.register(point.sock, selectors.EVENT_READ, point)
+    started = time.monotonic()
+    while not all(point.done() for point in points):
+        now = time.monotonic()
+        wake = now + 1.0
+        for point in points:
+            if point.search is None and point.remaining > 0:
+                if now >= point.next_send:
+                    point.start_search(now, stats)
+                else:
+                    wake = min(wake, point.next_send)
+            if point.search is not None:
+                if now >= point.search["deadline"]:
+                    point.finish_search(stats)
+                else:
+                    wake = min(wake, point.search["deadline"])
+        for key, _ in selector.select(max(0.0, wake - time.monotonic())):
+            key.data.receive(time.monotonic(), stats)
+    stats["elapsed"] = time.monotonic() - started
+    for point in points:
+        selector.unregister(point.sock)
+        point.sock.close()
+    return stats
+
+
+def summarize(stats, args, clients):
+    """
+    Reduces raw statistics to the report printed or dumped as JSON.
+    """
+    latencies = sorted(stats["latencies"])
+    searches = stats["searches"]
+    # Spread across MX: share of responses in each tenth of the window,
+    # a responder that ignores MX puts everything in the first bucket
+    buckets = [0] * 10
+    for value in stats["normalized"]:
+        buckets[min(9, max(0, int(value * 10)))] += 1
+    total = len(stats["normalized"])
+    shares = [count / total if total else 0.0 for count in buckets]
+    max_deviation = max(abs(share - 0.1) for share in shares) if total else 0.0
+    report = {
+        "clients": clients,
+        "searches": searches,
+        "search_rate": searches / stats["elapsed"] if stats["elapsed"] else 0,
+        "response_rate": stats["answered"] / searches if searches else 0.0,
+        "drop_rate": stats["unanswered"] / searches if searches else 0.0,
+        "responses": stats["responses"],
+        "malformed": stats["malformed"],
+        "malformed_answered": stats["malformed_answered"],
+        "malformed_sent": stats["malformed_sent"],
+        "wrong_st": stats["wrong_st"],
+        "duplicates": stats["duplicates"],
+        "send_errors": stats["send_errors"],
+        "recv_errors": stats["recv_errors"],
+        "p50_ms": None, "p99_ms": None, "p999_ms": None, "max_ms": None,
+        "mx_spread": shares,
+        # Too few samples to say anything about the distribution
+        "mx_spread_ok": (max_deviation <= args.spread_tolerance
+                         if total >= 100 else None),
+        "elapsed_s": stats["elapsed"],
+    }
+    if latencies:
+        report["p50_ms"] = percentile(latencies, 50) * 1000
+        report["p99_ms"] = percentile(latencies, 99) * 1000
+        report["p999_ms"] = percentile(latencies, 99.9) * 1000
+        report["max_ms"] = latencies[-1] * 1000
+    return report
+
+
+def print_report(report):
+    def ms(value):
+        return "-" if value is None else "%.1f" % value
+
+    print("clients %d: %d searches (%.1f/s), response rate %.2f%%, "
+          "drop rate %.2f%%" % (report["clients"], report["searches"],
+                                report["search_rate"],
+                                report["response_rate"] * 100,
+                                report["drop_rate"] * 100))
+    print("  latency ms p50 %s p99 %s p999 %s max %s" %
+          (ms(report["p50_ms"]), ms(report["p99_ms"]),
+           ms(report["p999_ms"]), ms(report["max_ms"])))
+    print("  MX spread %s => %s" %
+          (" ".join("%.2f" % share for share in report["mx_spread"]),
+           {True: "ok", False: "NOT SPREAD",
+            None: "too few samples"}[report["mx_spread_ok"]]))
+    print("  malformed %d (answered %d), wrong ST %d, duplicates %d, "
+          "send errors %d" % (report["malformed"],
+                              report["malformed_answered"],
+                              report["wrong_st"], report["duplicates"],
+                              report["send_errors"]))
+
+
+def main():
+    """
+    M-SEARCH storm generator for the SSDP responder.
+
+    Simulates N control points, each one firing M searches with a configurable
+    search target mix, MX, repetition and share of malformed packets, against
+    a device or a host build reached through loopback or a veth pair. It
+    reports response and drop rates, p50/p99/p999 response latency and whether
+    responses are spread across the MX window.
+
+    Use --ramp to repeat the storm with an increasing number of control points
+    and find where the responder saturates.
+    """
+    parser = argparse.ArgumentParser(description=main.__doc__.split("\n")[1])
+    parser.add_argument("--target", default=SSDP_ADDR,
+                        help="multicast group or unicast address of the "
+                        "responder (default %(default)s)")
+    parser.add_argument("--port", type=int, default=SSDP_PORT)
+    parser.add_argument("--interface", default=None,
+                        help="local address to send from (veth, loopback...)")
+    parser.add_argument("--clients", type=int, default=10,
+                        help="number of simulated control points")
+    parser.add_argument("--searches", type=int, default=10,
+                        help="searches sent by each control point")
+    parser.add_argument("--st-mix", type=parse_st_mix,
+                        default=parse_st_mix("ssdp:all=1,upnp:rootdevice=1"),
+                        help="weighted search targets, e.g. "
+                        "\"ssdp:all=1,upnp:rootdevice=3\"")
+    parser.add_argument("--mx", type=int, default=3)
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="copies of each datagram, as control points do "
+                        "on lossy links")
+    parser.add_argument("--malformed-ratio", type=float, default=0.0,
+                        help="share of searches replaced by malformed ones")
+    parser.add_argument("--grace", type=float, default=0.5,
+                        help="seconds to wait for responses after MX")
+    parser.add_argument("--pause", type=float, default=0.0,
+                        help="seconds between searches of a control point")
+    parser.add_argument("--spread", type=float, default=1.0,
+                        help="window in seconds for the first searches")
+    parser.add_argument("--spread-tolerance", type=float, default=0.1,
+                        help="max deviation of one MX tenth from 10%%")
+    parser.add_argument("--ttl", type=int, default=2)
+    parser.add_argument("--seed", type=int, default=None)
+    parser.add_argument("--ramp", default=None,
+                        help="comma separated client counts to run in turn")
+    parser.add_argument("--json", action="store_true",
+                        help="dump the reports as JSON")
+    args = parser.parse_args()
+
+    steps = [args.clients]
+    if args.ramp:
+        steps = [int(value) for value in args.ramp.split(",") if value]
+    reports = []
+    for clients in steps:
+        report = summarize(run_storm(args, clients), args, clients)
+        reports.append(report)
+        if not args.json:
+            print_report(report)
+    if args.json:
+        json.dump(reports, sys.stdout, indent=2)
+        print()
+    return 0 if all(report["malformed_answered"] == 0 for report in reports) \
+        else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())